@@ -4,9 +4,10 @@
 #include <stdbool.h>
 #include "mr_rax/rax.h"
 
-#define MAX_TOKENS 32
-#define MAX_TOKEN_LEN 64
-#define MAX_TOPIC_LEN 256
+#define MAX_TOPIC_LEN 256 // a convenient buffer size for callers, not a limit: a topic may be as long & deep as MQTT allows
+#define MR_MAX_TOPIC_BYTES 65535 // an MQTT UTF-8 string's length is 16 bits
+#define MR_NORMALIZED_TOPIC_LEN(len) (2 * (len) + 4) // with its hierarchy & each empty level grown to 0x1f
+#define MR_MAX_DICTIONARY_TOKENS 650 // 10 given 1 byte codes & 640 given 2 byte codes
 #define NUMBITS 7
 #define NUMBYTES ((64 + NUMBITS - 1) / NUMBITS)
 
@@ -14,15 +15,138 @@
 static uint8_t shared_mark = 0xfe;
 static uint8_t client_mark = 0xff;
 
+// invalid utf8 char before each level after the hierarchy in the keys of a delimited topic tree
+static uint8_t level_mark = 0xfd;
+
 // MQTT disallowed control char used to represent a zero-length token
 static char empty_tokenv[] = {0x1f, 0};
 
+// how the tokens of a topic are joined into the topic tree's keys - see mr_topic_tree_new
+typedef enum mr_key_encoding {
+    MR_KEY_CONCATENATED, // the default: foo/bar is @foobar, the same key as foob/ar
+    MR_KEY_DELIMITED, // a level mark before each token: foo/bar is @<0xfd>foo<0xfd>bar
+} mr_key_encoding;
+
+// a reusable, dedup'd list of Client IDs: keep one per thread and its allocations are reused for every publish
+typedef struct mr_client_list {
+    uint64_t* clients; // Client IDs in the order found
+    size_t numclients;
+    size_t maxclients;
+    uint32_t* slots; // scratch open-addressing set: index + 1 into clients, 0 if empty
+    size_t numslots; // power of 2
+} mr_client_list;
+
+// a reusable, dedup'd set of Client IDs for large fan-outs: Roaring-style containers, each holding the Client IDs
+// that share their high 48 bits as a sorted array while sparse and as a bitmap once dense
+typedef struct mr_bitmap_container mr_bitmap_container;
+
+typedef struct mr_client_bitmap {
+    mr_bitmap_container* containers; // in the order found until sorted for reading
+    size_t numcontainers;
+    size_t maxcontainers;
+    uint32_t* slots; // open-addressing index of containers by high bits: index + 1, 0 if empty
+    size_t numslots; // power of 2
+    size_t last; // the container of the last Client ID added
+    bool issorted;
+    size_t numclients;
+} mr_client_bitmap;
+
+typedef struct mr_client_bitmap_cursor {
+    size_t container;
+    size_t pos;
+} mr_client_bitmap_cursor;
+
+// called once for each distinct Client ID as it is found
+typedef void (*mr_client_fn)(void* ctx, uint64_t client);
+
+// a publish topic normalized & tokenized once for matching many times, but coded per match on a tree with a token
+// dictionary - see mr_compile_pubtopic
+typedef struct mr_pubtopic mr_pubtopic;
+
+// publish topics interned to dense 32 bit IDs - see mr_intern_topic
+typedef struct mr_topic_table mr_topic_table;
+
+// how a shared subscription picks the one member of its group that receives a publish. Picks are safe from concurrent
+// publishes but for MR_SHARE_LEAST_RECENT, whose picks reorder the group: serialize the publishes matching such a group
+typedef enum mr_share_strategy {
+    MR_SHARE_RANDOM, // the default
+    MR_SHARE_ROUND_ROBIN,
+    MR_SHARE_STICKY, // by hash of the publish topic
+    MR_SHARE_LEAST_RECENT, // the member least recently picked
+} mr_share_strategy;
+
+// match results for recently published topics, kept valid as subscriptions change
+typedef struct mr_match_cache mr_match_cache;
+
+// worker threads that split the widest client subtrees of a match between them
+typedef struct mr_match_pool mr_match_pool;
+
+// the Client IDs subscribed to a publish topic, read one at a time without gathering them - see mr_match_cursor_new
+typedef struct mr_match_cursor mr_match_cursor;
+
 int mr_next_client(raxIterator* piter, uint64_t* pu64);
 
+int mr_validate_and_normalize_topic(
+    const char* topic_in, size_t tlen, bool issubscribe, char* topic, char* share, char* topic_key
+);
+
+rax* mr_topic_tree_new(mr_key_encoding encoding);
+rax* mr_topic_tree_new_with_dictionary(mr_key_encoding encoding, const char* const* tokenv, size_t numtokens);
 int mr_insert_subscription(rax* topic_tree, rax* client_tree, const char* subtopic, const uint64_t client);
 int mr_remove_subscription(rax* topic_tree, rax* client_tree, const char* subtopic, const uint64_t client);
 int mr_remove_client_subscriptions(rax* topic_tree, rax* client_tree, const uint64_t client);
+int mr_set_share_strategy(rax* topic_tree, const char* subtopic, mr_share_strategy strategy);
+int mr_restore_subscriptions(
+    rax* topic_tree, rax* client_tree, const char* const* subtopicv, const uint64_t* clientv, size_t numsubs
+);
+void mr_free_topic_tree(rax* topic_tree);
+bool mr_may_have_subscribers(rax* topic_tree, const char* pubtopic);
 int mr_get_subscribed_clients(rax* topic_tree, rax* client_set, const char* pubtopic);
+int mr_count_subscribed_clients(rax* topic_tree, const char* pubtopic, size_t* pcount, bool* pisexact);
+int mr_get_subscribed_clients_batch(rax* topic_tree, rax** client_setv, const char** pubtopicv, size_t numtopics);
+int mr_get_subscribed_client_list(rax* topic_tree, mr_client_list* plist, const char* pubtopic);
+int mr_get_subscribed_clients_fn(
+    rax* topic_tree, mr_client_list* plist, const char* pubtopic, mr_client_fn fn, void* ctx
+);
+
+mr_pubtopic* mr_compile_pubtopic(const char* pubtopic);
+void mr_pubtopic_free(mr_pubtopic* ppub);
+int mr_get_subscribed_clients_compiled(rax* topic_tree, rax* client_set, const mr_pubtopic* ppub);
+int mr_get_subscribed_clients_fn_compiled(
+    rax* topic_tree, mr_client_list* plist, const mr_pubtopic* ppub, mr_client_fn fn, void* ctx
+);
+
+mr_topic_table* mr_topic_table_new(void);
+void mr_topic_table_free(mr_topic_table* ptable);
+int mr_intern_topic(mr_topic_table* ptable, const char* pubtopic, uint32_t* pid);
+int mr_find_topic_id(mr_topic_table* ptable, const char* pubtopic, uint32_t* pid);
+const mr_pubtopic* mr_get_interned_pubtopic(mr_topic_table* ptable, uint32_t id);
+int mr_get_interned_topic(mr_topic_table* ptable, uint32_t id, char* pubtopic);
+int mr_get_subscribed_clients_by_id(rax* topic_tree, mr_topic_table* ptable, rax* client_set, uint32_t id);
+
+void mr_client_list_init(mr_client_list* plist);
+void mr_client_list_free(mr_client_list* plist);
+
+int mr_get_subscribed_client_bitmap(rax* topic_tree, mr_client_bitmap* pbitmap, const char* pubtopic);
+void mr_client_bitmap_init(mr_client_bitmap* pbitmap);
+void mr_client_bitmap_free(mr_client_bitmap* pbitmap);
+int mr_client_bitmap_add(mr_client_bitmap* pbitmap, uint64_t client);
+int mr_client_bitmap_next(mr_client_bitmap* pbitmap, mr_client_bitmap_cursor* pcursor, uint64_t* pclient);
+size_t mr_client_bitmap_extract(mr_client_bitmap* pbitmap, uint64_t* clientv);
+
+mr_match_pool* mr_match_pool_new(size_t numthreads, size_t minclients);
+void mr_match_pool_free(mr_match_pool* ppool);
+int mr_get_subscribed_client_bitmap_parallel(
+    rax* topic_tree, mr_match_pool* ppool, mr_client_bitmap* pbitmap, const char* pubtopic
+);
+
+mr_match_cursor* mr_match_cursor_new(rax* topic_tree, const char* pubtopic);
+int mr_match_cursor_next(mr_match_cursor* pcursor, uint64_t* pclient);
+void mr_match_cursor_free(mr_match_cursor* pcursor);
+
+mr_match_cache* mr_match_cache_new(rax* topic_tree, size_t maxentries);
+void mr_match_cache_free(mr_match_cache* pcache);
+int mr_get_subscribed_clients_cached(mr_match_cache* pcache, rax* client_set, const char* pubtopic);
 
 int mr_upsert_client_topic_alias(
     rax* client_tree, const uint64_t client, const bool isincoming, const char* pubtopic, const uint8_t alias
@@ -31,6 +155,13 @@ int mr_upsert_client_topic_alias(
 int mr_remove_client_topic_aliases(rax* client_tree, const uint64_t client);
 int mr_get_alias_by_topic(rax* client_tree, const uint64_t client, const bool isincoming, const char* pubtopic, uint8_t* palias);
 int mr_get_topic_by_alias(rax* client_tree, const uint64_t client, const bool isincoming, const uint8_t alias, char* pubtopic);
+
+int mr_upsert_client_topic_alias_id(
+    rax* client_tree, const uint64_t client, const bool isincoming, const uint32_t id, const uint8_t alias
+);
+
+int mr_get_alias_by_topic_id(rax* client_tree, const uint64_t client, const bool isincoming, const uint32_t id, uint8_t* palias);
+int mr_get_topic_id_by_alias(rax* client_tree, const uint64_t client, const bool isincoming, const uint8_t alias, uint32_t* pid);
 int mr_remove_client_data(rax* topic_tree, rax* client_tree, uint64_t client);
 
 int mr_make_BEVBVBI(uint64_t u64, uint8_t *u8v, size_t u8vlen, int numbits);
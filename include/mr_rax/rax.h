@@ -97,6 +97,7 @@
  */
 
 #define RAX_NODE_MAX_SIZE ((1<<29)-1)
+#define RAX_NODE_MAX_SORTED 48 /* Wider non compressed nodes are direct. */
 typedef struct raxNode {
     uint32_t iskey:1;     /* Does this node contain a key? */
     uint32_t isnull:1;    /* Associated value is NULL (don't store it). */
@@ -111,6 +112,15 @@ typedef struct raxNode {
      *
      * [header iscompr=0][abc][a-ptr][b-ptr][c-ptr](value-ptr?)
      *
+     * Once a non compressed node has more than RAX_NODE_MAX_SORTED children
+     * it becomes "direct": the characters are no longer stored, and there
+     * is one pointer slot for every possible byte, NULL for the bytes
+     * without a child. Adding or removing a child just sets its slot, and
+     * the node switches back to the layout above when it shrinks to
+     * RAX_NODE_MAX_SORTED children:
+     *
+     * [header iscompr=0 size=49..256][0x00-ptr]...[0xff-ptr](value-ptr?)
+     *
      * if node is compressed (iscompr bit is 1) the node has 1 children.
      * In that case the 'size' bytes of the string stored immediately at
      * the start of the data section, represent a sequence of successive
@@ -132,10 +142,24 @@ typedef struct raxNode {
     unsigned char data[];
 } raxNode;
 
+/* Optional allocator for the nodes of a rax, see raxNewWithAllocator(). The
+ * size given to realloc() and free() is the length of the node, that may be
+ * less than the block was allocated with but never more. When release() is
+ * set, raxFree() calls it once to drop all the nodes together instead of
+ * freeing them one by one, so it must free any per tree state as well. */
+typedef struct raxAllocator {
+    void *(*malloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t oldsize, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void (*release)(void *ctx);
+    void *ctx;
+} raxAllocator;
+
 typedef struct rax {
     raxNode *head;
     uint64_t numele;
     uint64_t numnodes;
+    raxAllocator *alloc; /* Node allocator, NULL for rax_malloc(). */
 } rax;
 
 /* Stack data structure used by raxLowWalk() in order to, optionally, return
@@ -197,11 +221,23 @@ typedef struct raxIterator {
 /* A special pointer returned for not found items. */
 extern void *raxNotFound;
 
+/* Hands raxBulkLoadWithCallback() its keys in ascending order: sets the
+ * next key, its length and value and returns 1, returns 0 when there are
+ * no more keys, or -1 on error with errno set. */
+typedef int (*raxBulkNextFunc)(void *privdata, unsigned char **key, size_t *len, void **data);
+
 /* Exported API. */
 rax *raxNew(void);
+rax *raxNewWithAllocator(raxAllocator *alloc);
+rax *raxNewWithSlabs(void);
+raxAllocator *raxSlabAllocatorNew(void);
 int raxInsert(rax *rax, unsigned char *s, size_t len, void *data, void **old);
 int raxTryInsert(rax *rax, unsigned char *s, size_t len, void *data, void **old);
+int raxTryInsertPrefixes(rax *rax, unsigned char *s, size_t *lens, void **data, int *inserted, size_t count);
 int raxRemove(rax *rax, unsigned char *s, size_t len, void **old);
+int raxRemoveWithPrune(rax *rax, unsigned char *s, size_t len, void **old, size_t *lens, size_t count, size_t *pruned);
+int raxBulkLoad(rax *rax, unsigned char **keys, size_t *lens, void **data, size_t count);
+int raxBulkLoadWithCallback(rax *rax, raxBulkNextFunc next, void *privdata);
 void *raxFind(rax *rax, unsigned char *s, size_t len);
 void raxFree(rax *rax);
 void raxFreeWithCallback(rax *rax, void (*free_callback)(void*));
@@ -218,6 +254,12 @@ uint64_t raxSize(rax *rax);
 unsigned long raxTouch(raxNode *n);
 void raxSetDebugMsg(int onoff);
 
+/* Child byte search levels for raxSetSimdLevel(). */
+#define RAX_SIMD_NONE 0
+#define RAX_SIMD_SSE2 1
+#define RAX_SIMD_AVX2 2
+int raxSetSimdLevel(int level);
+
 /* Internal API. May be used by the node callback in order to access rax nodes
  * in a low level way, so this function is exported as well. */
 void raxSetData(raxNode *n, void *data);
@@ -230,6 +272,7 @@ int raxSeekSubtreeRelative(raxIterator* it, uint8_t* key, size_t len);
 void raxShowHexKey(rax* rax);
 int raxRemoveSubtree(rax* tree, uint8_t* key, size_t len);
 raxIterator* raxIteratorDup(raxIterator* piter);
+int raxIteratorCopy(raxIterator* pdst, raxIterator* piter);
 int raxIsLeaf(rax *rax, unsigned char *s, size_t len);
 
 #endif
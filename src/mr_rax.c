@@ -1,11 +1,18 @@
 // mr_rax.c
 
+#define _DEFAULT_SOURCE // for arc4random_uniform in glibc's <stdlib.h> under strict ISO C
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "mr_rax/mr_rax.h"
 #include "mr_rax/rax.h"
@@ -68,130 +75,986 @@ int mr_next_client(raxIterator* piter, uint64_t* pu64) {
     return 1;
 }
 
-static int mr_tokenize_topic(char* topic, char** tokenv) {
-    int numtokens;
+// per-thread scratch for the topics too long or too deep for the stack buffers: a list of blocks kept for reuse, so a
+// thread only allocates while its high-water mark rises. A function takes a mark on entry & rewinds to it on exit, so
+// marks nest like the calls that take them - including a match calling back into mr_rax from its mr_client_fn
+#define MR_STACK_TOPIC_LEN 512 // a topic or key buffer on the stack: longer ones spill to scratch
+#define MR_STACK_LEVELS 32 // a token or match state array on the stack: deeper topics spill to scratch
+#define MR_SCRATCH_BLOCK_SIZE 65536
+
+typedef struct mr_scratch_block {
+    struct mr_scratch_block* next;
+    size_t size;
+    max_align_t data[];
+} mr_scratch_block;
+
+typedef struct mr_scratch {
+    mr_scratch_block* block; // being allocated from: NULL before the first
+    size_t used;
+} mr_scratch;
+
+static _Thread_local mr_scratch mr_thread_scratch;
+static _Thread_local mr_scratch_block* mr_thread_blocks;
+static pthread_key_t mr_scratch_key;
+static pthread_once_t mr_scratch_once = PTHREAD_ONCE_INIT;
+
+static void mr_scratch_free(void* pblocks) { // at thread exit
+    for (mr_scratch_block *pblock = pblocks, *pnext; pblock; pblock = pnext) {
+        pnext = pblock->next;
+        rax_free(pblock);
+    }
+}
+
+static void mr_scratch_init(void) {
+    pthread_key_create(&mr_scratch_key, mr_scratch_free);
+}
+
+static inline mr_scratch mr_scratch_mark(void) {
+    return mr_thread_scratch;
+}
+
+static inline void mr_scratch_release(mr_scratch mark) {
+    mr_thread_scratch = mark;
+}
+
+// NULL with errno ENOMEM - the blocks after the current one are free, so the next is reused or replaced if too small
+static void* mr_scratch_alloc(size_t len) {
+    mr_scratch* pscratch = &mr_thread_scratch;
+    len = (len + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    mr_scratch_block* pblock = pscratch->block;
+
+    if (pblock && pscratch->used + len <= pblock->size) {
+        void* p = (uint8_t*)pblock->data + pscratch->used;
+        pscratch->used += len;
+        return p;
+    }
+
+    mr_scratch_block** pnext = pblock ? &pblock->next : &mr_thread_blocks;
+
+    if (*pnext == NULL || (*pnext)->size < len) {
+        size_t size = pblock ? 2 * pblock->size : MR_SCRATCH_BLOCK_SIZE;
+        while (size < len) size *= 2;
+        mr_scratch_block* pnew = rax_malloc(sizeof(mr_scratch_block) + size);
+
+        if (pnew == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
 
-    for (numtokens = 0; numtokens < MAX_TOKENS; numtokens++, tokenv++) {
-        *tokenv = strsep(&topic, "/");
-        if (*tokenv == NULL) break;
-        if (*tokenv[0] == '\0') *tokenv = empty_tokenv;
+        pnew->size = size;
+        pnew->next = *pnext ? (*pnext)->next : NULL;
+        rax_free(*pnext);
+        *pnext = pnew;
+        pthread_once(&mr_scratch_once, mr_scratch_init);
+        pthread_setspecific(mr_scratch_key, mr_thread_blocks);
     }
 
-    return numtokens;
+    pscratch->block = *pnext;
+    pscratch->used = len;
+    return pscratch->block->data;
 }
 
-int mr_get_normalized_topic(const char* topic_in, char* topic, char* topic_key) {
-    size_t tlen = strlen(topic_in);
-    char topic2[tlen + 3];
+// len bytes: the caller's stack buffer when they fit else per-thread scratch - NULL with errno ENOMEM
+static inline void* mr_stack_or_scratch(void* stackbuf, size_t stacklen, size_t len) {
+    return len <= stacklen ? stackbuf : mr_scratch_alloc(len);
+}
+
+// a token of a topic: where it starts & its length
+typedef struct mr_token {
+    size_t offset;
+    size_t len;
+} mr_token;
+
+// SWAR: the high bit of each byte of a 64 bit word that is below n (1 to 0x80) or equal to c. Exact for every byte:
+// the low 7 bits of each plus 0x80 - n can't carry into the next, so the 1st flagged byte is right in either byte order
+#define MR_BYTES_BELOW(u64, n) \
+    (~((((u64) & 0x7f7f7f7f7f7f7f7fULL) + 0x0101010101010101ULL * (0x80 - (n))) | (u64) | 0x7f7f7f7f7f7f7f7fULL))
+#define MR_BYTES_EQUAL(u64, c) MR_BYTES_BELOW((u64) ^ 0x0101010101010101ULL * (c), 1)
+
+// the index of the 1st flagged byte in memory order
+static inline size_t mr_first_byte(uint64_t mask) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_ctzll(mask) >> 3;
+#else
+    return __builtin_clzll(mask) >> 3;
+#endif
+}
 
-    if (topic_in[0] == '$') {
-        snprintf(topic2, tlen + 3, "$/%s", topic_in);
+// the first separator in [pc, pend) or pend: 16 bytes a compare with SSE2 then 8 at a time as a 64 bit word
+static const char* mr_find_separator(const char* pc, const char* pend) {
+#ifdef __SSE2__
+    const __m128i separators = _mm_set1_epi8('/');
+
+    for (; pend - pc >= 16; pc += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)pc);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, separators));
+        if (mask) return pc + __builtin_ctz(mask);
     }
-    else {
-        snprintf(topic2, tlen + 3, "@/%s", topic_in);
+#endif
+
+    for (; pend - pc >= 8; pc += 8) {
+        uint64_t u64;
+        memcpy(&u64, pc, 8);
+        uint64_t mask = MR_BYTES_EQUAL(u64, '/');
+        if (mask) return pc + mr_first_byte(mask);
+    }
+
+    for (; pc < pend; pc++) if (*pc == '/') return pc;
+    return pend;
+}
+
+// the first byte in [pc, pend) that normalizing can't just copy, or pend: a separator, a wildcard, a control char or
+// part of a multibyte UTF-8 char - topics are mostly plain ASCII so these are found a vector or word at a time
+static const char* mr_find_special(const char* pc, const char* pend) {
+#ifdef __SSE2__
+    const __m128i controls = _mm_set1_epi8(0x20);
+    const __m128i separators = _mm_set1_epi8('/');
+    const __m128i pluses = _mm_set1_epi8('+');
+    const __m128i hashes = _mm_set1_epi8('#');
+
+    for (; pend - pc >= 16; pc += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)pc);
+        __m128i special = _mm_cmplt_epi8(bytes, controls); // signed so also every byte from 0x80
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, separators));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, pluses));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, hashes));
+        int mask = _mm_movemask_epi8(special);
+        if (mask) return pc + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; pend - pc >= 8; pc += 8) {
+        uint64_t u64;
+        memcpy(&u64, pc, 8);
+        uint64_t mask = (u64 & 0x8080808080808080ULL) | MR_BYTES_BELOW(u64, 0x20);
+        mask |= MR_BYTES_EQUAL(u64, '/') | MR_BYTES_EQUAL(u64, '+') | MR_BYTES_EQUAL(u64, '#');
+        if (mask) return pc + mr_first_byte(mask);
+    }
+
+    for (; pc < pend; pc++) {
+        uint8_t c = *pc;
+        if (c < 0x20 || c >= 0x80 || c == '/' || c == '+' || c == '#') return pc;
+    }
+
+    return pend;
+}
+
+// the length of the well-formed UTF-8 char starting with a byte from 0x80 at pc or 0 (RFC 3629): no overlong forms,
+// no surrogates & nothing above U+10FFFF
+static size_t mr_utf8_len(const char* pc, const char* pend) {
+    const uint8_t* pu8 = (const uint8_t*)pc;
+    size_t avail = pend - pc;
+    uint8_t c = pu8[0];
+    size_t len = c < 0xc2 ? 0 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : c < 0xf5 ? 4 : 0;
+    if (len == 0 || avail < len) return 0;
+    for (size_t i = 1; i < len; i++) if ((pu8[i] & 0xc0) != 0x80) return 0;
+    if (c == 0xe0 && pu8[1] < 0xa0) return 0; // overlong
+    if (c == 0xed && pu8[1] > 0x9f) return 0; // surrogate
+    if (c == 0xf0 && pu8[1] < 0x90) return 0; // overlong
+    if (c == 0xf4 && pu8[1] > 0x8f) return 0; // above U+10FFFF
+    return len;
+}
+
+// split a topic at its separators into tokenv, the caller's stack array of MR_STACK_LEVELS, or for a deeper topic into
+// scratch: returns the array used or NULL with errno ENOMEM. The topic is neither copied nor modified & an empty token
+// has len 0
+static mr_token* mr_tokenize_topic(const char* topic, size_t tlen, mr_token* tokenv, int* pnumtokens) {
+    const char* pc = topic;
+    const char* pend = topic + tlen;
+    int numtokens = 0;
+    int maxtokens = MR_STACK_LEVELS;
+
+    while (true) {
+        if (numtokens == maxtokens) { // count the rest to spill just once
+            int numrest = 1;
+            for (const char* psep = pc; (psep = mr_find_separator(psep, pend)) < pend; psep++) numrest++;
+            mr_token* tokenv2 = mr_scratch_alloc((numtokens + numrest) * sizeof(mr_token));
+            if (tokenv2 == NULL) return NULL;
+            memcpy(tokenv2, tokenv, numtokens * sizeof(mr_token));
+            tokenv = tokenv2;
+            maxtokens = numtokens + numrest;
+        }
+
+        const char* psep = mr_find_separator(pc, pend);
+        tokenv[numtokens].offset = pc - topic;
+        tokenv[numtokens].len = psep - pc;
+        numtokens++;
+        if (psep == pend) break;
+        pc = psep + 1;
+    }
+
+    *pnumtokens = numtokens;
+    return tokenv;
+}
+
+// validate an MQTT topic & write its normalized form, optionally its concatenated topic key & for a shared subscription
+// its share name, in one pass over its bytes: runs of plain bytes are copied whole & only the separators, wildcards,
+// control chars & multibyte chars found by mr_find_special are looked at one by one
+int mr_validate_and_normalize_topic(
+    const char* topic_in, size_t tlen, bool issubscribe, char* topic, char* share, char* topic_key
+) {
+    const char* pc = topic_in;
+    const char* pend = topic_in + tlen;
+    if (share) share[0] = '\0';
+    if (tlen == 0 || tlen > MR_MAX_TOPIC_BYTES) goto einval;
+
+    if (issubscribe && tlen >= 7 && !memcmp(topic_in, "$share/", 7)) {
+        const char* pshare = topic_in + 7;
+
+        for (pc = pshare; pc < pend && *pc != '/'; pc++) {
+            if (*pc == '+' || *pc == '#' || *pc == '\0') goto einval;
+            if ((uint8_t)*pc < 0x80) continue;
+            size_t len = mr_utf8_len(pc, pend);
+            if (len == 0) goto einval;
+            pc += len - 1;
+        }
+
+        if (pc == pshare || pend - pc < 2) goto einval; // a share name & a non-empty filter
+        memcpy(share, pshare, pc - pshare);
+        share[pc - pshare] = '\0';
+        pc++;
     }
 
-    char* tokenv[MAX_TOKENS];
-    int numtokens = mr_tokenize_topic(topic2, tokenv);
+    char* pt = topic;
+    char* pk = topic_key;
+    *pt++ = *pc == '$' ? '$' : '@';
+    if (pk) *pk++ = topic[0];
+    *pt++ = '/';
+    char* plevel = pt;
+
+    while (true) {
+        const char* pspecial = mr_find_special(pc, pend);
+        size_t len = pspecial - pc;
+        memcpy(pt, pc, len);
+        pt += len;
+
+        if (pk) {
+            memcpy(pk, pc, len);
+            pk += len;
+        }
+
+        pc = pspecial;
+        if (pc == pend) break;
+        uint8_t c = *pc;
+        len = 1;
 
-    topic[0] = '\0';
-    if (topic_key) topic_key[0] = '\0';
-    for (int i = 0; i < numtokens; i++) {
-        if (topic_key) strlcat(topic_key, tokenv[i], MAX_TOPIC_LEN);
-        strlcat(topic, tokenv[i], MAX_TOPIC_LEN);
-        strcat(topic, "/");
+        if (c == '/') {
+            if (pt == plevel) { // an empty level
+                *pt++ = empty_tokenv[0];
+                if (pk) *pk++ = empty_tokenv[0];
+            }
+
+            *pt++ = '/';
+            plevel = pt;
+            pc++;
+            continue;
+        }
+
+        if (c == '+' || c == '#') { // alone in its level, '#' as the last level & only in a subscribe topic
+            if (!issubscribe || pt != plevel) goto einval;
+            if (pc + 1 < pend && (c == '#' || pc[1] != '/')) goto einval;
+        }
+        else if (c == '\0' || c == (uint8_t)empty_tokenv[0]) { // U+0000 & the empty level's own char
+            goto einval;
+        }
+        else if (c >= 0x80 && (len = mr_utf8_len(pc, pend)) == 0) {
+            goto einval;
+        }
+
+        memcpy(pt, pc, len);
+        pt += len;
+
+        if (pk) {
+            memcpy(pk, pc, len);
+            pk += len;
+        }
+
+        pc += len;
+    }
+
+    if (pt == plevel) {
+        *pt++ = empty_tokenv[0];
+        if (pk) *pk++ = empty_tokenv[0];
     }
 
-    topic[strlen(topic) - 1] = '\0';
+    *pt = '\0';
+    if (pk) *pk = '\0';
     return 0;
+
+einval:
+    errno = EINVAL;
+    return -1;
+}
+
+int mr_get_normalized_topic(const char* topic_in, char* topic, char* topic_key) {
+    return mr_validate_and_normalize_topic(topic_in, strlen(topic_in), false, topic, NULL, topic_key);
 }
 
 int mr_get_subscribe_topic(const char* subtopic, char* topic, char* share, char* topic_key) {
-    size_t stlen = strlen(subtopic);
-    char subtopic2[stlen + 1];
+    return mr_validate_and_normalize_topic(subtopic, strlen(subtopic), true, topic, share, topic_key);
+}
+
+// a normalized publish topic in the caller's stack buffer while it fits else in scratch: NULL with errno EINVAL or
+// ENOMEM
+static char* mr_normalize_pubtopic(const char* pubtopic, char* stackbuf, size_t stacklen) {
+    char* topic = mr_stack_or_scratch(stackbuf, stacklen, MR_NORMALIZED_TOPIC_LEN(strlen(pubtopic)));
+    return topic == NULL || mr_get_normalized_topic(pubtopic, topic, NULL) ? NULL : topic;
+}
+
+// the value of a topic level key: its generation, the topic tree's clock value of the last change to the subscriptions
+// it scopes, above flags for the wildcard levels directly below it
+#define MR_LEVEL_HAS_HASH 1
+#define MR_LEVEL_HAS_PLUS 2
+#define MR_LEVEL_FLAG_BITS 2
+#define MR_LEVEL_FLAGS ((1 << MR_LEVEL_FLAG_BITS) - 1)
+
+static inline void* mr_make_level(uint64_t generation, uintptr_t flags) {
+    return (void*)(uintptr_t)(generation << MR_LEVEL_FLAG_BITS | flags);
+}
+
+static inline uint64_t mr_level_generation(void* level) {
+    return (uintptr_t)level >> MR_LEVEL_FLAG_BITS;
+}
+
+static int mr_wildcard_flag(const char* token, size_t len) {
+    if (len != 1) return 0;
+    if (token[0] == '#') return MR_LEVEL_HAS_HASH;
+    if (token[0] == '+') return MR_LEVEL_HAS_PLUS;
+    return 0;
+}
+
+// set or clear a flag on an existing level key keeping its generation
+static void mr_set_level_flag(rax* topic_tree, uint8_t* key, size_t len, uintptr_t flag, bool isset) {
+    void* level = raxFind(topic_tree, key, len);
+    if (level == raxNotFound) return;
+    uintptr_t flags = ((uintptr_t)level & MR_LEVEL_FLAGS & ~flag) | (isset ? flag : 0);
+    raxInsert(topic_tree, key, len, mr_make_level(mr_level_generation(level), flags), NULL);
+}
+
+// kept in the value slot of the topic tree's empty key: the key encoding chosen when the tree was made and a pre-filter
+// in front of matching for the publish topics no subscription can match. The filter holds, per hierarchy, the number
+// of subscriptions with a root wildcard level and a counting hash table of the other subscriptions by first level. It
+// counts each Client ID & subscribe topic once, as the client tree keeps them, rather than the first level keys, which
+// a concatenated key may share with a deeper level: a zero count means no match, anything else is checked by matching
+#define MR_FILTER_SLOTS 1024
+
+typedef struct mr_topic_tree_info {
+    mr_key_encoding encoding;
+    uint32_t wildv[2]; // by hierarchy: '@' then '$'
+    uint32_t countv[MR_FILTER_SLOTS];
+    rax* codes; // the token dictionary: a token to its code index + 1 - NULL without one
+    char** tokenv; // by code index, for decoding
+    uint64_t generation; // the clock stamped on level keys: per tree so that changing one leaves others' caches valid
+} mr_topic_tree_info;
+
+static inline size_t mr_filter_slot(char hierarchy, const char* token, size_t len) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    hash = (hash ^ (uint8_t)hierarchy) * 16777619u;
+    for (size_t i = 0; i < len; i++) hash = (hash ^ (uint8_t)token[i]) * 16777619u;
+    return hash & (MR_FILTER_SLOTS - 1);
+}
+
+static mr_topic_tree_info* mr_get_topic_tree_info(rax* topic_tree, mr_key_encoding encoding) {
+    mr_topic_tree_info* pinfo = raxFind(topic_tree, (uint8_t*)"", 0);
+    if (pinfo != raxNotFound) return pinfo;
+    pinfo = rax_malloc(sizeof(mr_topic_tree_info));
+    if (pinfo == NULL) return NULL;
+    memset(pinfo, 0, sizeof(mr_topic_tree_info));
+    pinfo->encoding = encoding;
+
+    if (!raxInsert(topic_tree, (uint8_t*)"", 0, pinfo, NULL) && errno == ENOMEM) {
+        rax_free(pinfo);
+        return NULL;
+    }
+
+    return pinfo;
+}
+
+// a tree made by raxNew gets the concatenated encoding on its first subscription. One made here keeps its nodes in
+// slabs: they are many & small, and freeing the tree drops the slabs rather than each node
+rax* mr_topic_tree_new(mr_key_encoding encoding) {
+    rax* topic_tree = raxNewWithSlabs();
+    if (topic_tree == NULL) goto oom;
+
+    if (mr_get_topic_tree_info(topic_tree, encoding) == NULL) {
+        raxFree(topic_tree);
+        goto oom;
+    }
+
+    return topic_tree;
+
+oom:
+    errno = ENOMEM;
+    return NULL;
+}
+
+// token dictionary codes: a lead byte alone for the first MR_CODE_LEADS tokens then a lead & a continuation byte. No
+// token of valid UTF-8 starts with either & neither is a mark, so a code can't be mistaken for text even where the
+// levels of a key are concatenated
+#define MR_CODE_LEADS 10
+#define MR_CODE_CONTS 64
+static const uint8_t mr_code_leadv[MR_CODE_LEADS] = {0xc0, 0xc1, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc};
+
+static inline size_t mr_code_len(size_t index) {
+    return index < MR_CODE_LEADS ? 1 : 2;
+}
+
+static size_t mr_make_code(size_t index, uint8_t* code) {
+    if (index < MR_CODE_LEADS) {
+        code[0] = mr_code_leadv[index];
+        return 1;
+    }
+
+    index -= MR_CODE_LEADS;
+    code[0] = mr_code_leadv[index / MR_CODE_CONTS];
+    code[1] = 0x80 | index % MR_CODE_CONTS;
+    return 2;
+}
+
+// the index of the code a token is or -1 for text
+static int mr_code_index(const uint8_t* token, size_t len) {
+    if (len == 0 || len > 2) return -1;
+    int lead = token[0] < 0xc2 ? token[0] - 0xc0 : token[0] - 0xf5 + 2;
+    if (lead < 0 || lead >= MR_CODE_LEADS) return -1;
+    return len == 1 ? lead : MR_CODE_LEADS + lead * MR_CODE_CONTS + (token[1] & 0x3f);
+}
+
+// a single level of a publish topic: no separator, wildcard, U+0000, empty level char or malformed UTF-8
+static bool mr_is_dictionary_token(const char* token, size_t len) {
+    const char* pend = token + len;
+    if (len == 0 || len > MR_MAX_TOPIC_BYTES) return false;
+
+    for (const char* pc = token; pc < pend; pc++) {
+        if (*pc == '/' || *pc == '+' || *pc == '#' || *pc == '\0' || *pc == empty_tokenv[0]) return false;
+        if ((uint8_t)*pc < 0x80) continue;
+        size_t clen = mr_utf8_len(pc, pend);
+        if (clen == 0) return false;
+        pc += clen - 1;
+    }
+
+    return true;
+}
+
+// the tokens are given codes in order, so the most frequent should come first: a token no longer than its code is
+// left as text. NULL with errno EINVAL for too many tokens or one that isn't a single level of a publish topic
+rax* mr_topic_tree_new_with_dictionary(mr_key_encoding encoding, const char* const* tokenv, size_t numtokens) {
+    if (numtokens > MR_MAX_DICTIONARY_TOKENS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    rax* topic_tree = mr_topic_tree_new(encoding);
+    if (topic_tree == NULL) return NULL;
+    mr_topic_tree_info* pinfo = raxFind(topic_tree, (uint8_t*)"", 0);
+    size_t size = numtokens * sizeof(char*);
+    for (size_t i = 0; i < numtokens; i++) size += strlen(tokenv[i]) + 1;
+    pinfo->tokenv = rax_malloc(size);
+    pinfo->codes = raxNew();
+    if ((pinfo->tokenv == NULL && size) || pinfo->codes == NULL) goto oom;
+    char* pc = (char*)(pinfo->tokenv + numtokens);
+
+    for (size_t i = 0; i < numtokens; i++) {
+        size_t len = strlen(tokenv[i]);
+        if (!mr_is_dictionary_token(tokenv[i], len)) goto einval;
+        pinfo->tokenv[i] = memcpy(pc, tokenv[i], len + 1);
+        pc += len + 1;
+        if (len <= mr_code_len(i)) continue;
+
+        if (!raxTryInsert(pinfo->codes, (uint8_t*)tokenv[i], len, (void*)(uintptr_t)(i + 1), NULL)) {
+            if (errno == ENOMEM) goto oom;
+            goto einval; // a duplicate
+        }
+    }
+
+    return topic_tree;
+
+einval:
+    mr_free_topic_tree(topic_tree);
+    errno = EINVAL;
+    return NULL;
+
+oom:
+    mr_free_topic_tree(topic_tree);
+    errno = ENOMEM;
+    return NULL;
+}
+
+// replace the dictionary's tokens in a '/' separated topic with their codes, leaving the first skip levels as text: the
+// result is no longer than the topic so it can be done in place. The first level of a normalized topic is left for
+// the first-level filter, which hashes the publish topic's text
+static size_t mr_encode_topic(const mr_topic_tree_info* pinfo, const char* topic, size_t tlen, char* coded, int skip) {
+    const char* pc = topic;
+    const char* pend = topic + tlen;
+    char* pout = coded;
+
+    for (int i = 0; ; i++) {
+        const char* psep = mr_find_separator(pc, pend);
+        size_t toklen = psep - pc;
+        void* code = i < skip || toklen == 0 ? raxNotFound : raxFind(pinfo->codes, (uint8_t*)pc, toklen);
+
+        if (code != raxNotFound) {
+            pout += mr_make_code((uintptr_t)code - 1, (uint8_t*)pout);
+        }
+        else {
+            memmove(pout, pc, toklen);
+            pout += toklen;
+        }
+
+        if (psep == pend) break;
+        *pout++ = '/';
+        pc = psep + 1;
+    }
+
+    *pout = '\0';
+    return pout - coded;
+}
+
+// the length of a coded topic with its codes replaced by their tokens & given topic, write it there
+static size_t mr_decode_topic(const mr_topic_tree_info* pinfo, const char* coded, size_t len, char* topic) {
+    const char* pc = coded;
+    const char* pend = coded + len;
+    size_t tlen = 0;
+
+    while (true) {
+        const char* psep = mr_find_separator(pc, pend);
+        size_t toklen = psep - pc;
+        int index = mr_code_index((const uint8_t*)pc, toklen);
+        const char* token = index < 0 ? pc : pinfo->tokenv[index];
+        if (index >= 0) toklen = strlen(token);
+        if (topic) memcpy(topic + tlen, token, toklen);
+        tlen += toklen;
+        if (psep == pend) break;
+        if (topic) topic[tlen] = '/';
+        tlen++;
+        pc = psep + 1;
+    }
+
+    if (topic) topic[tlen] = '\0';
+    return tlen;
+}
+
+// a topic for the tree's keys: the topic itself without a token dictionary else coded in the caller's stack buffer or
+// scratch - NULL with errno ENOMEM
+static const char* mr_encode_pubtopic(
+    rax* topic_tree, const char* topic, size_t tlen, char* stackbuf, size_t stacklen
+) {
+    mr_topic_tree_info* pinfo = raxFind(topic_tree, (uint8_t*)"", 0);
+    if (pinfo == raxNotFound || pinfo->codes == NULL) return topic;
+    char* coded = mr_stack_or_scratch(stackbuf, stacklen, tlen + 1);
+    if (coded) mr_encode_topic(pinfo, topic, tlen, coded, 2);
+    return coded;
+}
 
-    if (strncmp("$share/", subtopic, 7)) {
-        strlcpy(subtopic2, subtopic, stlen + 1);
+// the bytes between the levels of a topic key: a level mark when delimited
+static size_t mr_key_sep(rax* topic_tree) {
+    mr_topic_tree_info* pinfo = raxFind(topic_tree, (uint8_t*)"", 0);
+    return pinfo != raxNotFound && pinfo->encoding == MR_KEY_DELIMITED;
+}
+
+// add the next level to a topic key of length len returning its new length - the hierarchy is always the first
+static size_t mr_add_key_level(char* topic_key, size_t len, const char* token, size_t toklen, size_t sep) {
+    if (sep && len) topic_key[len++] = level_mark;
+    memcpy(topic_key + len, token, toklen);
+    return len + toklen;
+}
+
+// a normalized topic as a topic key: each separator dropped or when delimited, a level mark
+static void mr_make_topic_key(const char* topic, char* topic_key, size_t sep) {
+    for (; *topic; topic++) {
+        if (*topic != '/') *topic_key++ = *topic;
+        else if (sep) *topic_key++ = level_mark;
+    }
+
+    *topic_key = '\0';
+}
+
+// count a subscription in the filter by the hierarchy & first token of its normalized topic, left as text when coded
+static void mr_count_subscription(mr_topic_tree_info* pinfo, const char* topic, int delta) {
+    if (pinfo == raxNotFound) return;
+    const char* token = topic + 2;
+    size_t len = mr_find_separator(token, token + strlen(token)) - token;
+    if (mr_wildcard_flag(token, len)) pinfo->wildv[topic[0] == '$'] += delta;
+    else pinfo->countv[mr_filter_slot(topic[0], token, len)] += delta;
+}
+
+// false when no subscription can match a publish topic of the hierarchy & first token
+static inline bool mr_filter_passes(mr_topic_tree_info* pinfo, char hierarchy, const char* token, size_t len) {
+    if (pinfo == raxNotFound) return false; // never subscribed
+    if (pinfo->wildv[hierarchy == '$']) return true;
+    return pinfo->countv[mr_filter_slot(hierarchy, token, len)];
+}
+
+// false when no subscription can match the publish topic - a few loads & a hash of its first token, no normalizing
+bool mr_may_have_subscribers(rax* topic_tree, const char* pubtopic) {
+    mr_topic_tree_info* pinfo = raxFind(topic_tree, (uint8_t*)"", 0);
+    char hierarchy = pubtopic[0] == '$' ? '$' : '@';
+    const char* pend = strchr(pubtopic, '/');
+    size_t len = pend ? (size_t)(pend - pubtopic) : strlen(pubtopic);
+    if (len == 0) return mr_filter_passes(pinfo, hierarchy, empty_tokenv, 1);
+    return mr_filter_passes(pinfo, hierarchy, pubtopic, len);
+}
+
+// stamp the level key of the literal prefix of a subscribe topic (the levels before any wildcard) - any topic the
+// subscription can match passes through that key so the cache can tell which of its entries might have changed. The
+// level keys of a topic are all prefixes of its topic key. A key removed needs no stamp: the depth of those topics drops
+static void mr_bump_generation(rax* topic_tree, const char* topic, const char* topic_key) {
+    mr_topic_tree_info* pinfo = raxFind(topic_tree, (uint8_t*)"", 0);
+    if (pinfo == raxNotFound) return; // no level keys yet
+    const char* pc = topic;
+    const char* pend = topic + strlen(topic);
+    size_t sep = pinfo->encoding == MR_KEY_DELIMITED;
+    size_t len = 0;
+
+    while (true) {
+        const char* psep = mr_find_separator(pc, pend);
+        if (mr_wildcard_flag(pc, psep - pc)) break;
+        len += (len ? sep : 0) + (psep - pc);
+        if (psep == pend) break;
+        pc = psep + 1;
+    }
+
+    void* level = raxFind(topic_tree, (uint8_t*)topic_key, len);
+    if (level == raxNotFound) return;
+    uintptr_t flags = (uintptr_t)level & MR_LEVEL_FLAGS;
+    raxInsert(topic_tree, (uint8_t*)topic_key, len, mr_make_level(++pinfo->generation, flags), NULL);
+}
+
+// insert the level keys of a topic, each a prefix of its key, & then the keys of the numkeys lengths in lenv that go on
+// from it, in a single walk: datav holds their values, set to the old ones of those already there. Returns -1 with
+// errno ENOMEM, or whether the last key was inserted
+static int mr_insert_topic_tree(
+    rax* topic_tree, const char* topic, uint8_t* key, const size_t* lenv, void** datav, size_t numkeys
+) {
+    mr_topic_tree_info* pinfo = mr_get_topic_tree_info(topic_tree, MR_KEY_CONCATENATED);
+
+    if (pinfo == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t sep = pinfo->encoding == MR_KEY_DELIMITED;
+    const char* pc = topic;
+    const char* pend = topic + strlen(topic);
+    size_t numlevels = 1;
+    for (const char* p = topic; *p; p++) numlevels += *p == '/';
+    size_t n = numlevels + numkeys;
+    size_t stackbuf[MR_STACK_TOPIC_LEN / sizeof(size_t)];
+    size_t bytes = n * (sizeof(size_t) + sizeof(void*) + sizeof(int)); // the lengths, values & whether inserted
+    size_t* keylenv = mr_stack_or_scratch(stackbuf, sizeof(stackbuf), bytes);
+
+    if (keylenv == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    void** keydatav = (void**)(keylenv + n);
+    int* insertedv = (int*)(keydatav + n);
+    size_t len = 0;
+
+    for (size_t i = 0; i < numlevels; i++) {
+        const char* psep = mr_find_separator(pc, pend);
+        len += (i ? sep : 0) + (psep - pc);
+        keylenv[i] = len;
+        keydatav[i] = mr_make_level(++pinfo->generation, 0);
+        pc = psep + 1;
+    }
+
+    memcpy(keylenv + numlevels, lenv, numkeys * sizeof(size_t));
+    memcpy(keydatav + numlevels, datav, numkeys * sizeof(void*));
+    if (!raxTryInsertPrefixes(topic_tree, key, keylenv, keydatav, insertedv, n)) return -1;
+    memcpy(datav, keydatav + numlevels, numkeys * sizeof(void*));
+    pc = topic;
+
+    for (size_t i = 0; i < numlevels; i++) {
+        const char* psep = mr_find_separator(pc, pend);
+        size_t toklen = psep - pc;
+
+        if (insertedv[i]) {
+            int flag = mr_wildcard_flag(pc, toklen);
+            if (flag && i) mr_set_level_flag(topic_tree, key, keylenv[i - 1], flag, true);
+        }
+
+        pc = psep + 1;
+    }
+
+    return numkeys && insertedv[n - 1];
+}
+
+// the value of a <0xff> key: the number of regular clients beneath it
+static void mr_add_client_count(rax* topic_tree, uint8_t* key, size_t len, int delta) {
+    void* count = raxFind(topic_tree, key, len);
+    if (count == raxNotFound) return;
+    raxInsert(topic_tree, key, len, (void*)((uintptr_t)count + delta), NULL);
+}
+
+typedef struct mr_share_member {
+    uint64_t client;
+    uint32_t prev; // least recently picked order: index + 1 into members, 0 at either end
+    uint32_t next;
+} mr_share_member;
+
+// the value of a <0xfe>share<0xff> key: its members are the client keys beneath it, each of which holds its index + 1
+typedef struct mr_share_group {
+    struct mr_share_group* prev; // the other groups of the same topic, linked from its <0xfe> key
+    struct mr_share_group* next;
+    mr_share_member* members;
+    size_t nummembers;
+    size_t maxmembers;
+    uint32_t head; // least recently picked
+    uint32_t tail; // most recently picked
+    atomic_size_t cursor; // round robin: atomic so that concurrent publishes may pick
+    mr_share_strategy strategy;
+} mr_share_group;
+
+static void mr_share_unlink_member(mr_share_group* pgroup, size_t i) {
+    mr_share_member* pmember = &pgroup->members[i];
+    if (pmember->prev) pgroup->members[pmember->prev - 1].next = pmember->next;
+    else pgroup->head = pmember->next;
+    if (pmember->next) pgroup->members[pmember->next - 1].prev = pmember->prev;
+    else pgroup->tail = pmember->prev;
+}
+
+static void mr_share_link_member(mr_share_group* pgroup, size_t i, bool istail) {
+    mr_share_member* pmember = &pgroup->members[i];
+
+    if (istail) {
+        pmember->prev = pgroup->tail;
+        pmember->next = 0;
+        if (pgroup->tail) pgroup->members[pgroup->tail - 1].next = i + 1;
+        else pgroup->head = i + 1;
+        pgroup->tail = i + 1;
     }
     else {
-        char subtopic3[stlen + 1];
-        strlcpy(subtopic3, subtopic + 7, stlen + 1);
-        char* pc = strchr(subtopic3, '/');
-        *pc = '\0';
-        strlcpy(share, subtopic3, stlen + 1);
-        strlcpy(subtopic2, pc + 1, stlen + 1);
+        pmember->prev = 0;
+        pmember->next = pgroup->head;
+        if (pgroup->head) pgroup->members[pgroup->head - 1].prev = i + 1;
+        else pgroup->tail = i + 1;
+        pgroup->head = i + 1;
     }
+}
+
+// a new member has never been picked so it goes to the head of the least recently picked order
+static int mr_share_add_member(mr_share_group* pgroup, uint64_t client) {
+    if (pgroup->nummembers == pgroup->maxmembers) {
+        size_t maxmembers = pgroup->maxmembers ? pgroup->maxmembers * 2 : 8;
+        mr_share_member* members = rax_realloc(pgroup->members, maxmembers * sizeof(mr_share_member));
+
+        if (members == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
 
-    mr_get_normalized_topic(subtopic2, topic, topic_key);
+        pgroup->members = members;
+        pgroup->maxmembers = maxmembers;
+    }
+
+    pgroup->members[pgroup->nummembers].client = client;
+    mr_share_link_member(pgroup, pgroup->nummembers++, false);
     return 0;
 }
 
-static int mr_insert_topic_tree(rax* topic_tree, const char* topic) {
-    size_t tlen = strlen(topic);
-    char* tokenv[MAX_TOKENS];
-    char topic3[tlen + 1];
-    strlcpy(topic3, topic, tlen + 1);
-    size_t numtokens = mr_tokenize_topic(topic3, tokenv); // modifies topic3 and points into it from tokenv
-    char topic_key[tlen + 1];
-    topic_key[0] = '\0';
+// the last member fills the hole - returns 1 if it moved so that its client key can be given its new index
+static int mr_share_remove_member(mr_share_group* pgroup, size_t i) {
+    size_t last = pgroup->nummembers - 1;
+    mr_share_unlink_member(pgroup, i);
+    pgroup->nummembers--;
+    if (i == last) return 0;
+
+    mr_share_member* pmember = &pgroup->members[i];
+    *pmember = pgroup->members[last];
+    if (pmember->prev) pgroup->members[pmember->prev - 1].next = i + 1;
+    else pgroup->head = i + 1;
+    if (pmember->next) pgroup->members[pmember->next - 1].prev = i + 1;
+    else pgroup->tail = i + 1;
+    return 1;
+}
+
+static void mr_share_group_free(mr_share_group* pgroup) {
+    rax_free(pgroup->members);
+    rax_free(pgroup);
+}
+
+// push a new group onto the list held by the topic's shared mark key
+static void mr_share_link_group(rax* topic_tree, uint8_t* key, size_t key_len, mr_share_group* pgroup) {
+    mr_share_group* phead = raxFind(topic_tree, key, key_len);
+    if (phead == raxNotFound) phead = NULL;
+    pgroup->prev = NULL;
+    pgroup->next = phead;
+    if (phead) phead->prev = pgroup;
+    raxInsert(topic_tree, key, key_len, pgroup, NULL);
+}
+
+static void mr_share_unlink_group(rax* topic_tree, uint8_t* key, size_t key_len, mr_share_group* pgroup) {
+    if (pgroup->prev) pgroup->prev->next = pgroup->next;
+    else raxInsert(topic_tree, key, key_len, pgroup->next, NULL);
+    if (pgroup->next) pgroup->next->prev = pgroup->prev;
+}
+
+// a subscribe topic as it is kept in the client tree, written to inverted with room for stlen + 1 bytes: coded with the
+// topic tree's token dictionary after its first level. Returns its length, at most stlen
+static size_t mr_invert_subscribe_topic(rax* topic_tree, const char* subtopic, size_t stlen, uint8_t* inverted) {
+    mr_topic_tree_info* pinfo = raxFind(topic_tree, (uint8_t*)"", 0);
+    if (pinfo != raxNotFound && pinfo->codes) return mr_encode_topic(pinfo, subtopic, stlen, (char*)inverted, 1);
+    memcpy(inverted, subtopic, stlen);
+    return stlen;
+}
 
-    for (int i = 0; i < numtokens; i++) {
-        strlcat(topic_key, tokenv[i], tlen + 1);
-        raxTryInsert(topic_tree, (uint8_t*)topic_key, strlen(topic_key), NULL, NULL);
+// a subscribe topic normalized & coded for the topic tree, in its stack buffer while short & in scratch otherwise
+typedef struct mr_subscribe_topic {
+    char* topic;
+    char* share;
+    char* topic_key; // in the topic tree's encoding
+    size_t slen;
+    size_t tklen;
+    char stackbuf[3 * MR_STACK_TOPIC_LEN];
+} mr_subscribe_topic;
+
+// -1 with errno EINVAL or ENOMEM
+static int mr_normalize_subscribe_topic(rax* topic_tree, const char* subtopic, mr_subscribe_topic* psub) {
+    size_t stlen = strlen(subtopic);
+    size_t len = MR_NORMALIZED_TOPIC_LEN(stlen);
+    char* buf = mr_stack_or_scratch(psub->stackbuf, sizeof(psub->stackbuf), 2 * len + stlen + 1);
+    if (buf == NULL) return -1;
+    psub->topic = buf;
+    psub->topic_key = buf + len;
+    psub->share = buf + 2 * len;
+    if (mr_get_subscribe_topic(subtopic, psub->topic, psub->share, psub->topic_key)) return -1;
+    mr_topic_tree_info* pinfo = raxFind(topic_tree, (uint8_t*)"", 0);
+
+    if (pinfo != raxNotFound && (pinfo->codes || pinfo->encoding == MR_KEY_DELIMITED)) {
+        if (pinfo->codes) mr_encode_topic(pinfo, psub->topic, strlen(psub->topic), psub->topic, 2);
+        mr_make_topic_key(psub->topic, psub->topic_key, pinfo->encoding == MR_KEY_DELIMITED);
     }
 
+    psub->slen = strlen(psub->share);
+    psub->tklen = strlen(psub->topic_key);
     return 0;
 }
 
 int mr_insert_subscription(rax* topic_tree, rax* client_tree, const char* subtopic, const uint64_t client) {
+    mr_scratch mark = mr_scratch_mark();
+    int rc = -1;
+    mr_subscribe_topic sub;
+    if (mr_normalize_subscribe_topic(topic_tree, subtopic, &sub)) goto done;
     size_t stlen = strlen(subtopic);
-    char topic[stlen + 3];
-    char share[stlen + 1];
-    share[0] = '\0';
-    char topic_key[stlen + 3];
-    mr_get_subscribe_topic(subtopic, topic, share, topic_key);
-    size_t tlen = strlen(topic);
-    size_t slen = strlen(share);
-    size_t tklen = strlen(topic_key);
+    char* topic = sub.topic;
+    char* share = sub.share;
+    char* topic_key = sub.topic_key;
+    size_t slen = sub.slen;
+    size_t tklen = sub.tklen;
 
     // get the client bytes in network order (big endian) as a Variable Byte Integer (VBI)
     uint8_t clientv[NUMBYTES];
     size_t clen = mr_make_BEVBI(client, clientv);
 
-    mr_insert_topic_tree(topic_tree, topic);
-
-    // insert sub/client in subscription subtree
+    // <topic><Client Mark><Client ID>, or <topic><Shared Mark><share><Client Mark><Client ID>
     size_t tklen2 = tklen + 1 + slen + (slen ? 1 : 0);
-    uint8_t topic_key2[tklen2 + clen];
+    uint8_t keybuf[MR_STACK_TOPIC_LEN];
+    uint8_t* topic_key2 = mr_stack_or_scratch(keybuf, sizeof(keybuf), tklen2 + clen);
+    if (topic_key2 == NULL) goto done;
     memcpy(topic_key2, topic_key, tklen);
 
-    if (slen) { // shared subscription sub-hierarchy
-        memcpy(topic_key2 + tklen, &shared_mark, 1);
-        raxTryInsert(topic_tree, topic_key2, tklen + 1, NULL, NULL);
+    if (slen) {
+        topic_key2[tklen] = shared_mark;
         memcpy(topic_key2 + tklen + 1, (void*)share, slen);
-        raxTryInsert(topic_tree, topic_key2, tklen + 1 + slen, NULL, NULL);
         topic_key2[tklen + 1 + slen] = client_mark;
-        raxTryInsert(topic_tree, topic_key2, tklen2, NULL, NULL);
-    }
-    else { // regular subscription sub-hierarchy
-        memcpy(topic_key2 + tklen, &client_mark, 1);
-        raxTryInsert(topic_tree, topic_key2, tklen + 1, NULL, NULL);
     }
+    else topic_key2[tklen] = client_mark;
 
     memcpy(topic_key2 + tklen2, clientv, clen);
-    raxInsert(topic_tree, topic_key2, tklen2 + clen, NULL, NULL); // insert the client
+
+    // the levels & the keys beneath in one walk, but for a shared client key, which waits for its group
+    size_t lenv[] = {tklen + 1, slen ? tklen + 1 + slen : tklen2 + clen};
+    void* datav[] = {NULL, NULL}; // a new <Client Mark> key's count is 0
+    int isnew = mr_insert_topic_tree(topic_tree, topic, topic_key2, lenv, datav, 2);
+    if (isnew < 0) goto done;
+    mr_share_group* pgroup = NULL;
+
+    if (slen) { // shared subscription sub-hierarchy
+        pgroup = raxFind(topic_tree, topic_key2, tklen2);
+
+        if (pgroup == raxNotFound || pgroup == NULL) {
+            pgroup = rax_malloc(sizeof(mr_share_group));
+
+            if (pgroup == NULL) {
+                errno = ENOMEM;
+                goto done;
+            }
+
+            memset(pgroup, 0, sizeof(mr_share_group));
+            raxInsert(topic_tree, topic_key2, tklen2, pgroup, NULL);
+            mr_share_link_group(topic_tree, topic_key2, tklen + 1, pgroup);
+            // cached results hold share groups not their members so only a new group changes them
+            mr_bump_generation(topic_tree, topic, topic_key);
+        }
+    }
+
+    // insert the client
+    if (pgroup) {
+        if (raxFind(topic_tree, topic_key2, tklen2 + clen) == raxNotFound) {
+            if (mr_share_add_member(pgroup, client)) goto done;
+            raxInsert(topic_tree, topic_key2, tklen2 + clen, (void*)(uintptr_t)pgroup->nummembers, NULL);
+        }
+    }
+    else if (isnew) {
+        raxInsert(topic_tree, topic_key2, tklen2, (void*)((uintptr_t)datav[0] + 1), NULL);
+        mr_bump_generation(topic_tree, topic, topic_key);
+    }
 
     // invert
-    uint8_t topic3[clen + 1 + 4 + stlen]; // <Client ID><Client Mark>"subs"<Subscribe Topic>
+    // <Client ID><Client Mark>"subs"<Subscribe Topic>, reusing keybuf now topic_key2 is done with
+    uint8_t* topic3 = mr_stack_or_scratch(keybuf, sizeof(keybuf), clen + 1 + 4 + stlen + 1);
+    if (topic3 == NULL) goto done;
     memcpy(topic3, clientv, clen);
     memcpy(topic3 + clen, &client_mark, 1);
-    raxTryInsert(client_tree, topic3, clen + 1, NULL, NULL);
     memcpy(topic3 + clen + 1, "subs", 4);
-    raxTryInsert(client_tree, topic3, clen + 1 + 4, NULL, NULL);
-    memcpy(topic3 + clen + 1 + 4, subtopic, stlen);
-    raxTryInsert(client_tree, topic3, clen + 1 + 4 + stlen, NULL, NULL);
+    size_t itlen = mr_invert_subscribe_topic(topic_tree, subtopic, stlen, topic3 + clen + 1 + 4);
+    size_t inversionlenv[] = {clen + 1, clen + 1 + 4, clen + 1 + 4 + itlen};
+    void* inversiondatav[] = {NULL, NULL, NULL};
+    int insertedv[3];
+    if (!raxTryInsertPrefixes(client_tree, topic3, inversionlenv, inversiondatav, insertedv, 3)) goto done;
+    if (insertedv[2]) mr_count_subscription(raxFind(topic_tree, (uint8_t*)"", 0), topic, 1);
+    rc = 0;
+
+done:
+    mr_scratch_release(mark);
+    return rc;
+}
 
-    return 0;
+int mr_set_share_strategy(rax* topic_tree, const char* subtopic, mr_share_strategy strategy) {
+    mr_scratch mark = mr_scratch_mark();
+    int rc = -1;
+    mr_subscribe_topic sub;
+    if (mr_normalize_subscribe_topic(topic_tree, subtopic, &sub)) goto done;
+    size_t slen = sub.slen;
+    size_t tklen = sub.tklen;
+
+    if (!slen) {
+        errno = EINVAL;
+        goto done;
+    }
+
+    uint8_t keybuf[MR_STACK_TOPIC_LEN];
+    // <topic><Shared Mark><share><Client Mark>
+    uint8_t* topic_key2 = mr_stack_or_scratch(keybuf, sizeof(keybuf), tklen + 1 + slen + 1);
+    if (topic_key2 == NULL) goto done;
+    memcpy(topic_key2, sub.topic_key, tklen);
+    topic_key2[tklen] = shared_mark;
+    memcpy(topic_key2 + tklen + 1, sub.share, slen);
+    topic_key2[tklen + 1 + slen] = client_mark;
+    mr_share_group* pgroup = raxFind(topic_tree, topic_key2, tklen + 1 + slen + 1);
+
+    if (pgroup == raxNotFound || pgroup == NULL) {
+        errno = ENOENT;
+        goto done;
+    }
+
+    pgroup->strategy = strategy;
+    rc = 0;
+
+done:
+    mr_scratch_release(mark);
+    return rc;
 }
 
 static int mr_trim_leaf(rax* tree, raxIterator* piter, uint8_t* key, size_t len) {
@@ -200,242 +1063,1863 @@ static int mr_trim_leaf(rax* tree, raxIterator* piter, uint8_t* key, size_t len)
     return 1;
 }
 
-static int mr_trim_topic_tree(rax* topic_tree, raxIterator* piter, const char* topic, char* topic_key) {
-    size_t tlen = strlen(topic);
-    char topic3[tlen + 1];
-    strlcpy(topic3, topic, tlen + 1);
-    char* tokenv[MAX_TOKENS];
-    int numtokens = mr_tokenize_topic(topic3, tokenv);
-    int count = 0;
-    size_t len = strlen(topic_key);
+// whether a delimited tree has keys under a level's marks: <level><0xfd> for the levels below it, <0xfe> & <0xff>. Its
+// other children are longer first tokens - 'ab' of 'a' - that don't need it. Kept on ENOMEM
+static bool mr_level_in_use(rax* topic_tree, uint8_t* key, size_t len) {
+    uint8_t c = key[len];
+    key[len] = level_mark; // the least of the marks
+    raxIterator iter;
+    raxStart(&iter, topic_tree);
+    bool inuse = true;
+
+    if (raxSeek(&iter, ">=", key, len + 1)) {
+        if (raxNext(&iter)) inuse = iter.key_len > len && !memcmp(iter.key, key, len);
+        else inuse = errno != 0;
+    }
+
+    raxStop(&iter);
+    key[len] = c;
+    return inuse;
+}
+
+// remove a client key of a topic & in the same ascent the keys above it while each is left without children: the
+// nummarks keys of the lengths in markv, then the topic's levels from the last up - on through delimited levels left
+// with no keys under their marks. Returns -1 with errno ENOMEM, 0 if the client key wasn't there, or 1 with its value
+// in *pdata & the number of marks removed in *pmarks
+static int mr_remove_topic_tree(
+    rax* topic_tree, const char* topic, uint8_t* key, size_t len, const size_t* markv, size_t nummarks, void** pdata,
+    size_t* pmarks
+) {
+    size_t sep = mr_key_sep(topic_tree);
+    const char* pc = topic;
+    const char* pend = topic + strlen(topic);
+    size_t numlevels = 1;
+    for (const char* p = topic; *p; p++) numlevels += *p == '/';
+    size_t stackbuf[MR_STACK_TOPIC_LEN / sizeof(size_t)];
+    size_t* lenv = mr_stack_or_scratch(stackbuf, sizeof(stackbuf), (numlevels + nummarks) * sizeof(size_t));
+
+    if (lenv == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t klen = 0;
+
+    for (size_t i = 0; i < numlevels; i++) {
+        const char* psep = mr_find_separator(pc, pend);
+        klen += (i ? sep : 0) + (psep - pc);
+        lenv[i] = klen;
+        pc = psep + 1;
+    }
+
+    memcpy(lenv + numlevels, markv, nummarks * sizeof(size_t));
+    size_t pruned;
+    if (!raxRemoveWithPrune(topic_tree, key, len, pdata, lenv, numlevels + nummarks, &pruned)) return errno ? -1 : 0;
+    *pmarks = pruned < nummarks ? pruned : nummarks;
+    if (pruned < nummarks) return 1;
+    size_t first = numlevels + nummarks - pruned; // the highest level removed
+
+    for (; sep && first && !mr_level_in_use(topic_tree, key, lenv[first - 1]); first--) {
+        raxRemove(topic_tree, key, lenv[first - 1], NULL);
+    }
+
+    if (first == numlevels) return 1;
+    pc = topic;
+
+    // a wildcard level removed takes its flag off the level above, unless that went too
+    for (size_t i = 0; i < numlevels; i++) {
+        const char* psep = mr_find_separator(pc, pend);
+        int flag = mr_wildcard_flag(pc, psep - pc);
+        if (flag && i && i == first) mr_set_level_flag(topic_tree, key, lenv[i - 1], flag, false);
+        pc = psep + 1;
+    }
+
+    return 1;
+}
+
+// the client tree held the subscription when wassubscribed: it is uncounted from the filter
+static int mr_remove_subscription_topic_tree(
+    rax* topic_tree, const char* subtopic, const uint8_t* clientv, const size_t clen, bool wassubscribed
+) {
+    mr_scratch mark = mr_scratch_mark();
+    int rc = -1;
+    mr_subscribe_topic sub;
+    if (mr_normalize_subscribe_topic(topic_tree, subtopic, &sub)) goto done;
+    char* topic = sub.topic;
+    char* share = sub.share;
+    char* topic_key = sub.topic_key;
+    size_t slen = sub.slen;
+    size_t tklen = sub.tklen;
+    size_t tklen2 = tklen + 1 + slen + (slen ? 1 : 0);
+    uint8_t keybuf[MR_STACK_TOPIC_LEN];
+    uint8_t* topic_key2 = mr_stack_or_scratch(keybuf, sizeof(keybuf), tklen2 + NUMBYTES); // a moved member's too
+    if (topic_key2 == NULL) goto done;
+    memcpy(topic_key2, topic_key, tklen);
+
+    if (slen) { // shared subscription sub-hierarchy
+        memcpy(topic_key2 + tklen, &shared_mark, 1);
+        memcpy(topic_key2 + tklen + 1, (void*)share, slen);
+        memcpy(topic_key2 + tklen + 1 + slen, &client_mark, 1);
+    }
+    else { // regular subscription sub-hierarchy
+        memcpy(topic_key2 + tklen, &client_mark, 1);
+    }
+
+    memcpy(topic_key2 + tklen2, clientv, clen);
+
+    // the group outlives its client mark key, which goes with its last member
+    mr_share_group* pgroup = slen ? raxFind(topic_tree, topic_key2, tklen2) : NULL;
+    size_t markv[] = {tklen + 1, tklen + 1 + slen, tklen2}; // shared mark, share & client mark, or the client mark
+    size_t nummarks = slen ? 3 : 1;
+    void* data;
+    size_t marks;
+    int removed = mr_remove_topic_tree(
+        topic_tree, topic, topic_key2, tklen2 + clen, markv + 3 - nummarks, nummarks, &data, &marks
+    );
+    if (removed < 0) goto done;
+
+    if (removed && slen) { // share client
+        if (mr_share_remove_member(pgroup, (uintptr_t)data - 1)) { // re-index the member that moved
+            size_t mclen = mr_make_BEVBI(pgroup->members[(uintptr_t)data - 1].client, topic_key2 + tklen2);
+            raxInsert(topic_tree, topic_key2, tklen2 + mclen, data, NULL);
+        }
+
+        if (marks) {
+            // with the shared mark key gone, so is every other group on its list
+            if (marks < 3) mr_share_unlink_group(topic_tree, topic_key2, tklen + 1, pgroup);
+            mr_share_group_free(pgroup);
+            mr_bump_generation(topic_tree, topic, topic_key); // the share group is gone
+        }
+    }
+    else if (removed) { // regular client
+        if (!marks) mr_add_client_count(topic_tree, topic_key2, tklen2, -1);
+        mr_bump_generation(topic_tree, topic, topic_key);
+    }
+
+    if (wassubscribed) mr_count_subscription(raxFind(topic_tree, (uint8_t*)"", 0), topic, -1);
+    rc = 0;
+
+done:
+    mr_scratch_release(mark);
+    return rc;
+}
+
+// -1 with errno ENOMEM, or whether the client tree held the subscription
+static int mr_remove_subscription_client_tree(
+    rax* topic_tree, rax* client_tree, const char* subtopic, const uint8_t* clientv, size_t clen
+) {
+    size_t stlen = strlen(subtopic);
+    mr_scratch mark = mr_scratch_mark();
+    uint8_t keybuf[MR_STACK_TOPIC_LEN];
+    uint8_t* inversion = mr_stack_or_scratch(keybuf, sizeof(keybuf), clen + 1 + 4 + stlen + 1);
+    if (inversion == NULL) return -1;
+    memcpy(inversion, clientv, clen);
+    memcpy(inversion + clen, &client_mark, 1);
+    memcpy(inversion + 1 + clen, "subs", 4);
+    size_t itlen = mr_invert_subscribe_topic(topic_tree, subtopic, stlen, inversion + 1 + clen + 4);
+    // with "subs" & the <Client Mark> when they are left without children
+    size_t lenv[] = {clen + 1, clen + 1 + 4};
+    int rc = raxRemoveWithPrune(client_tree, inversion, clen + 1 + 4 + itlen, NULL, lenv, 2, NULL);
+    if (!rc && errno) rc = -1;
+    mr_scratch_release(mark);
+    return rc;
+}
+
+int mr_remove_subscription(rax* topic_tree, rax* client_tree, const char* subtopic, const uint64_t client) {
+    // get the client bytes in network order (big endian) as a Variable Byte Integer (VBI)
+    uint8_t clientv[NUMBYTES];
+    size_t clen = mr_make_BEVBI(client, clientv);
+    // the client tree first: the filter counts a subscription while it is there
+    int wassubscribed = mr_remove_subscription_client_tree(topic_tree, client_tree, subtopic, clientv, clen);
+    if (wassubscribed < 0) return -1;
+    return mr_remove_subscription_topic_tree(topic_tree, subtopic, clientv, clen, wassubscribed);
+}
+
+// each subscription leaves the client tree & then the topic tree, as by mr_remove_subscription, so on ENOMEM those not
+// yet reached are still in both
+int mr_remove_client_subscriptions(rax* topic_tree, rax* client_tree, const uint64_t client) {
+    rax* srax = raxNewWithSlabs();
+
+    if (srax == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int rc = -1;
+    raxIterator iter;
+    raxStart(&iter, client_tree);
+
+    // get the client bytes in network order (big endian) as a Variable Byte Integer (VBI)
+    uint8_t clientv[NUMBYTES];
+    size_t clen = mr_make_BEVBI(client, clientv);
+
+    uint8_t inversion[NUMBYTES + 1 + 4];
+    memcpy(inversion, clientv, clen);
+    memcpy(inversion + clen, &client_mark, 1);
+    memcpy(inversion + 1 + clen, "subs", 4);
+    raxSeekSubtree(&iter, inversion, clen + 1 + 4);
+    raxNext(&iter); // skip 1st key
+
+    while(raxNext(&iter)) {
+        if (!raxInsert(srax, iter.key, iter.key_len, NULL, NULL) && errno == ENOMEM) goto done;
+    }
+
+    if (errno == ENOMEM) goto done;
+    raxStop(&iter);
+    raxStart(&iter, srax);
+    raxSeek(&iter, "^", NULL, 0);
+    mr_topic_tree_info* pinfo = raxFind(topic_tree, (uint8_t*)"", 0);
+    bool iscoded = pinfo != raxNotFound && pinfo->codes;
+    size_t lenv[] = {clen + 1, clen + 1 + 4};
+
+    while(raxNext(&iter)) {
+        mr_scratch mark = mr_scratch_mark();
+        char* inverted = (char*)iter.key + clen + 1 + 4;
+        size_t itlen = iter.key_len - (clen + 1 + 4);
+        size_t stlen = iscoded ? mr_decode_topic(pinfo, inverted, itlen, NULL) : itlen;
+        char subtopicbuf[MR_STACK_TOPIC_LEN];
+        char* subtopic = mr_stack_or_scratch(subtopicbuf, sizeof(subtopicbuf), stlen + 1);
+        bool failed = subtopic == NULL;
+
+        if (subtopic) {
+            if (iscoded) {
+                mr_decode_topic(pinfo, inverted, itlen, subtopic);
+            }
+            else {
+                memcpy(subtopic, inverted, itlen);
+                subtopic[itlen] = '\0';
+            }
+
+            int wassubscribed = raxRemoveWithPrune(client_tree, iter.key, iter.key_len, NULL, lenv, 2, NULL);
+            failed = (!wassubscribed && errno) ||
+                mr_remove_subscription_topic_tree(topic_tree, subtopic, clientv, clen, wassubscribed);
+        }
+
+        mr_scratch_release(mark);
+        if (failed) goto done;
+    }
+
+    if (errno == ENOMEM) goto done;
+    raxRemoveSubtree(client_tree, inversion, clen + 1 + 4);
+    mr_trim_leaf(client_tree, &iter, inversion, clen + 1);
+    rc = 0;
+
+done:
+    raxStop(&iter);
+    raxFree(srax);
+    return rc;
+}
+
+// share groups live in the value slots of the topic tree so it has to be freed here rather than by raxFree
+void mr_free_topic_tree(rax* topic_tree) {
+    raxIterator iter;
+    raxStart(&iter, topic_tree);
+    raxSeek(&iter, "^", NULL, 0);
+
+    while (raxNext(&iter)) { // only <0xfe>share<0xff> keys hold a group
+        if (!memchr(iter.key, 0xfe, iter.key_len) || iter.key[iter.key_len - 1] != 0xff) continue;
+        if (iter.data) mr_share_group_free(iter.data);
+    }
+
+    raxStop(&iter);
+    mr_topic_tree_info* pinfo = raxFind(topic_tree, (uint8_t*)"", 0);
+
+    if (pinfo != raxNotFound) {
+        if (pinfo->codes) raxFree(pinfo->codes);
+        rax_free(pinfo->tokenv);
+        rax_free(pinfo);
+    }
+
+    raxFree(topic_tree);
+}
+
+// a destination for matched clients: each is offered as its VBI-encoded Client ID from the topic tree
+typedef struct mr_sink {
+    int (*add_client)(struct mr_sink* psink, uint8_t* clientv, size_t clen);
+    // optional: offered each matching share group in place of picking one of its members
+    int (*add_share)(struct mr_sink* psink, mr_share_group* pgroup);
+    void* ctx;
+    uint64_t topichash; // of the normalized publish topic, for sticky share picks
+    // optional: offered each matching subscribe topic key in place of gathering its clients
+    int (*add_topic)(struct mr_sink* psink, raxIterator* piter, uint8_t* key, size_t key_len);
+} mr_sink;
+
+static int mr_rax_add_client(mr_sink* psink, uint8_t* clientv, size_t clen) {
+    raxTryInsert((rax*)psink->ctx, clientv, clen, NULL, NULL);
+    return 0;
+}
+
+static uint64_t mr_hash_topic(const char* topic) {
+    uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+
+    for (const uint8_t* pu8 = (const uint8_t*)topic; *pu8; pu8++) {
+        hash ^= *pu8;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// pick one member of a share group by its strategy. Only a least recently picked pick writes to the group, moving the
+// member to the most recently picked end, so only those need serializing with other publishes
+static int mr_pick_share_client(mr_sink* psink, mr_share_group* pgroup) {
+    if (!pgroup->nummembers) return 0;
+    size_t i;
+
+    switch (pgroup->strategy) {
+    case MR_SHARE_ROUND_ROBIN:
+        i = atomic_fetch_add(&pgroup->cursor, 1) % pgroup->nummembers;
+        break;
+    case MR_SHARE_STICKY:
+        i = psink->topichash % pgroup->nummembers;
+        break;
+    case MR_SHARE_LEAST_RECENT:
+        i = pgroup->head - 1;
+        mr_share_unlink_member(pgroup, i);
+        mr_share_link_member(pgroup, i, true);
+        break;
+    default:
+        i = arc4random_uniform(pgroup->nummembers);
+    }
+
+    uint8_t clientv[NUMBYTES];
+    size_t clen = mr_make_BEVBI(pgroup->members[i].client, clientv);
+    return psink->add_client(psink, clientv, clen);
+}
+
+static int mr_get_regular_clients(raxIterator* iter, mr_sink* psink, uint8_t* key, size_t key_len) {
+    key[key_len] = client_mark;
+    raxSeekSubtreeRelative(iter, key, key_len + 1);
+
+    if (raxNext(iter)) { // subtree exists? Skip 1st key if it does
+        while(raxNext(iter)) {
+            size_t clen = iter->key_len - (key_len + 1);
+            psink->add_client(psink, iter->key + key_len + 1, clen);
+        }
+    }
+
+    return 0;
+}
+
+// the shared mark key holds the list of the topic's share groups
+static int mr_get_share_clients(raxIterator* iter, mr_sink* psink, uint8_t* key, size_t key_len) {
+    key[key_len] = shared_mark;
+    mr_share_group* pgroup = raxFindRelative(iter, key, key_len + 1);
+    if (pgroup == raxNotFound) return 0;
+
+    for (; pgroup; pgroup = pgroup->next) { // pick one client per share
+        if (psink->add_share) psink->add_share(psink, pgroup);
+        else mr_pick_share_client(psink, pgroup);
+    }
+
+    return 0;
+}
+
+static int mr_get_topic_clients(raxIterator* iter, mr_sink* psink, uint8_t* key, size_t key_len) {
+    mr_get_regular_clients(iter, psink, key, key_len);
+    return mr_get_share_clients(iter, psink, key, key_len);
+}
+
+// a pending probe: the key through this level is the parent's key plus either the topic's token or '+'
+typedef struct mr_match_state {
+    int level;
+    size_t len;
+    bool iswild;
+} mr_match_state;
+
+// depth first over one key buffer: a popped state rewrites only its own last token since every state pushed after
+// it wrote beyond its parent's key - each level leaves at most one sibling pending so the stack holds numtokens + 1.
+// Both live on the stack for a short, shallow topic & in scratch otherwise: -1 with errno ENOMEM
+static int mr_match_tokens(
+    raxIterator* piter, mr_sink* psink, const char* topic, const mr_token* tokenv, int numtokens, size_t tlen
+) {
+    mr_scratch mark = mr_scratch_mark();
+    uint8_t keybuf[MR_STACK_TOPIC_LEN];
+    // room for a level mark, '#' & the mark that follow the longest key
+    uint8_t* key = mr_stack_or_scratch(keybuf, sizeof(keybuf), tlen + 3);
+    mr_match_state stackbuf[MR_STACK_LEVELS + 1];
+    mr_match_state* stackv = mr_stack_or_scratch(stackbuf, sizeof(stackbuf), (numtokens + 1) * sizeof(mr_match_state));
+
+    if (key == NULL || stackv == NULL) {
+        mr_scratch_release(mark);
+        return -1;
+    }
+
+    size_t sep = mr_key_sep(piter->rt);
+    int top = 0;
+    stackv[top++] = (mr_match_state){0, tokenv[0].len, false};
+
+    while (top) {
+        mr_match_state state = stackv[--top];
+        size_t toklen = state.iswild ? 1 : tokenv[state.level].len;
+        if (sep && state.level) key[state.len - toklen - 1] = level_mark;
+
+        if (state.iswild) key[state.len - 1] = '+';
+        else memcpy(key + state.len - toklen, topic + tokenv[state.level].offset, toklen);
+
+        void* level = raxFindRelative(piter, key, state.len);
+        if (level == raxNotFound) continue; // no more possible matches
+
+        if ((uintptr_t)level & MR_LEVEL_HAS_HASH) { // matches this level and all below
+            if (sep) key[state.len] = level_mark;
+            key[state.len + sep] = '#';
+            if (psink->add_topic) psink->add_topic(psink, piter, key, state.len + sep + 1);
+            else mr_get_topic_clients(piter, psink, key, state.len + sep + 1);
+        }
+
+        if (state.level == numtokens - 1) {
+            if (psink->add_topic) psink->add_topic(psink, piter, key, state.len);
+            else mr_get_topic_clients(piter, psink, key, state.len);
+            continue;
+        }
+
+        size_t len = state.len + sep;
+        stackv[top++] = (mr_match_state){state.level + 1, len + tokenv[state.level + 1].len, false};
+        if ((uintptr_t)level & MR_LEVEL_HAS_PLUS) stackv[top++] = (mr_match_state){state.level + 1, len + 1, true};
+    }
+
+    mr_scratch_release(mark);
+    return 0;
+}
+
+// match a normalized topic relative to wherever the iterator was left by the previous match
+static int mr_match_topic(raxIterator* piter, mr_sink* psink, const char* topic) {
+    psink->topichash = mr_hash_topic(topic);
+    size_t tlen = strlen(topic);
+    mr_scratch mark = mr_scratch_mark();
+    char codedbuf[MR_STACK_TOPIC_LEN];
+    const char* coded = mr_encode_pubtopic(piter->rt, topic, tlen, codedbuf, sizeof(codedbuf));
+    int rc = -1;
+
+    if (coded) {
+        size_t clen = coded == topic ? tlen : strlen(coded);
+        mr_token tokenbuf[MR_STACK_LEVELS];
+        int numtokens;
+        mr_token* tokenv = mr_tokenize_topic(coded, clen, tokenbuf, &numtokens);
+        if (tokenv) rc = mr_match_tokens(piter, psink, coded, tokenv, numtokens, clen);
+    }
+
+    mr_scratch_release(mark);
+    return rc;
+}
+
+int mr_get_subscribed_clients(rax* topic_tree, rax* srax, const char* pubtopic) {
+    mr_scratch mark = mr_scratch_mark();
+    int rc = -1;
+    char topicbuf[MR_STACK_TOPIC_LEN];
+    char* topic = mr_normalize_pubtopic(pubtopic, topicbuf, sizeof(topicbuf));
+    if (topic == NULL) goto done;
+    rc = 0;
+    if (!mr_may_have_subscribers(topic_tree, pubtopic)) goto done;
+    mr_sink sink = {mr_rax_add_client, NULL, srax};
+    raxIterator iter;
+    raxStart(&iter, topic_tree);
+    rc = mr_match_topic(&iter, &sink, topic);
+    raxStop(&iter);
+
+done:
+    mr_scratch_release(mark);
+    return rc;
+}
+
+void mr_client_list_init(mr_client_list* plist) {
+    memset(plist, 0, sizeof(mr_client_list));
+}
+
+void mr_client_list_free(mr_client_list* plist) {
+    rax_free(plist->clients);
+    rax_free(plist->slots);
+    mr_client_list_init(plist);
+}
+
+static inline size_t mr_client_slot(uint64_t client, size_t numslots) {
+    return (client * 0x9e3779b97f4a7c15ULL) >> 32 & (numslots - 1); // Fibonacci hashing
+}
+
+// empty the list keeping its allocations: clear just the occupied slots unless most of them are in use
+static void mr_client_list_reset(mr_client_list* plist) {
+    if (plist->numclients * 8 >= plist->numslots) {
+        if (plist->numslots) memset(plist->slots, 0, plist->numslots * sizeof(uint32_t));
+    }
+    else {
+        for (size_t i = 0; i < plist->numclients; i++) {
+            size_t slot = mr_client_slot(plist->clients[i], plist->numslots);
+            while (plist->slots[slot] != i + 1) slot = (slot + 1) & (plist->numslots - 1);
+            plist->slots[slot] = 0;
+        }
+    }
+
+    plist->numclients = 0;
+}
+
+// keep the load factor at or below 1/2 - the only allocations are here and only on growth
+static int mr_client_list_grow(mr_client_list* plist) {
+    if (plist->numclients == plist->maxclients) {
+        size_t maxclients = plist->maxclients ? plist->maxclients * 2 : 64;
+        uint64_t* clients = rax_realloc(plist->clients, maxclients * sizeof(uint64_t));
+        if (clients == NULL) goto oom;
+        plist->clients = clients;
+        plist->maxclients = maxclients;
+    }
+
+    if ((plist->numclients + 1) * 2 > plist->numslots) {
+        size_t numslots = plist->numslots ? plist->numslots * 2 : 128;
+        uint32_t* slots = rax_malloc(numslots * sizeof(uint32_t));
+        if (slots == NULL) goto oom;
+        memset(slots, 0, numslots * sizeof(uint32_t));
+
+        for (size_t i = 0; i < plist->numclients; i++) { // rehash
+            size_t slot = mr_client_slot(plist->clients[i], numslots);
+            while (slots[slot]) slot = (slot + 1) & (numslots - 1);
+            slots[slot] = i + 1;
+        }
+
+        rax_free(plist->slots);
+        plist->slots = slots;
+        plist->numslots = numslots;
+    }
+
+    return 0;
+
+oom:
+    errno = ENOMEM;
+    return -1;
+}
+
+// returns 1 if the client was added, 0 if it was already present, -1 on out of memory
+static int mr_client_list_add(mr_client_list* plist, uint64_t client) {
+    if (plist->numslots) {
+        size_t slot = mr_client_slot(client, plist->numslots);
+
+        for (uint32_t i; (i = plist->slots[slot]); slot = (slot + 1) & (plist->numslots - 1)) {
+            if (plist->clients[i - 1] == client) return 0;
+        }
+    }
+
+    if (mr_client_list_grow(plist)) return -1;
+    size_t slot = mr_client_slot(client, plist->numslots);
+    while (plist->slots[slot]) slot = (slot + 1) & (plist->numslots - 1);
+    plist->clients[plist->numclients++] = client;
+    plist->slots[slot] = plist->numclients;
+    return 1;
+}
+
+typedef struct mr_client_fn_ctx {
+    mr_client_list* plist;
+    mr_client_fn fn;
+    void* ctx;
+} mr_client_fn_ctx;
+
+static int mr_list_add_client(mr_sink* psink, uint8_t* clientv, size_t clen) {
+    mr_client_fn_ctx* pfnctx = psink->ctx;
+    uint64_t client;
+    mr_extract_BEVBI(clientv, clen, &client);
+    if (mr_client_list_add(pfnctx->plist, client) == 1 && pfnctx->fn) pfnctx->fn(pfnctx->ctx, client);
+    return 0;
+}
+
+int mr_get_subscribed_clients_fn(
+    rax* topic_tree, mr_client_list* plist, const char* pubtopic, mr_client_fn fn, void* ctx
+) {
+    mr_scratch mark = mr_scratch_mark();
+    int rc = -1;
+    char topicbuf[MR_STACK_TOPIC_LEN];
+    char* topic = mr_normalize_pubtopic(pubtopic, topicbuf, sizeof(topicbuf));
+    if (topic == NULL) goto done;
+    mr_client_list_reset(plist);
+    rc = 0;
+    if (!mr_may_have_subscribers(topic_tree, pubtopic)) goto done;
+    mr_client_fn_ctx fnctx = {plist, fn, ctx};
+    mr_sink sink = {mr_list_add_client, NULL, &fnctx};
+    raxIterator iter;
+    raxStart(&iter, topic_tree);
+    rc = mr_match_topic(&iter, &sink, topic);
+    raxStop(&iter);
+
+done:
+    mr_scratch_release(mark);
+    return rc;
+}
+
+int mr_get_subscribed_client_list(rax* topic_tree, mr_client_list* plist, const char* pubtopic) {
+    return mr_get_subscribed_clients_fn(topic_tree, plist, pubtopic, NULL, NULL);
+}
+
+#define MR_BITMAP_ARRAY_MAX 4096 // an array container beyond this is larger than a bitmap
+#define MR_BITMAP_WORDS (65536 / 64)
+
+// the Client IDs sharing their high 48 bits: a sorted array of the low 16 bits while sparse, then a bitmap
+struct mr_bitmap_container {
+    uint64_t high;
+    size_t cardinality;
+    uint16_t* values; // array form
+    size_t maxvalues;
+    uint64_t* bits; // bitmap form
+};
+
+void mr_client_bitmap_init(mr_client_bitmap* pbitmap) {
+    memset(pbitmap, 0, sizeof(mr_client_bitmap));
+    pbitmap->issorted = true;
+}
+
+void mr_client_bitmap_free(mr_client_bitmap* pbitmap) {
+    for (size_t i = 0; i < pbitmap->maxcontainers; i++) {
+        rax_free(pbitmap->containers[i].values);
+        rax_free(pbitmap->containers[i].bits);
+    }
+
+    rax_free(pbitmap->containers);
+    rax_free(pbitmap->slots);
+    mr_client_bitmap_init(pbitmap);
+}
+
+// containers past numcontainers are spares whose allocations are reused
+static void mr_client_bitmap_reset(mr_client_bitmap* pbitmap) {
+    for (size_t i = 0; i < pbitmap->numcontainers; i++) {
+        mr_bitmap_container* pcontainer = &pbitmap->containers[i];
+        size_t slot = mr_client_slot(pcontainer->high, pbitmap->numslots);
+        while (pbitmap->slots[slot] != i + 1) slot = (slot + 1) & (pbitmap->numslots - 1);
+        pbitmap->slots[slot] = 0;
+
+        if (pcontainer->cardinality > MR_BITMAP_ARRAY_MAX) {
+            memset(pcontainer->bits, 0, MR_BITMAP_WORDS * sizeof(uint64_t));
+        }
+
+        pcontainer->cardinality = 0;
+    }
+
+    pbitmap->numcontainers = 0;
+    pbitmap->numclients = 0;
+    pbitmap->issorted = true;
+}
+
+static void mr_client_bitmap_index(mr_client_bitmap* pbitmap) {
+    memset(pbitmap->slots, 0, pbitmap->numslots * sizeof(uint32_t));
+
+    for (size_t i = 0; i < pbitmap->numcontainers; i++) {
+        size_t slot = mr_client_slot(pbitmap->containers[i].high, pbitmap->numslots);
+        while (pbitmap->slots[slot]) slot = (slot + 1) & (pbitmap->numslots - 1);
+        pbitmap->slots[slot] = i + 1;
+    }
+}
+
+static int mr_compare_containers(const void* pa, const void* pb) {
+    uint64_t a = ((mr_bitmap_container*)pa)->high, b = ((mr_bitmap_container*)pb)->high;
+    return a < b ? -1 : a > b;
+}
+
+// containers are appended as found and only put in Client ID order when the set is read
+static void mr_client_bitmap_sort(mr_client_bitmap* pbitmap) {
+    if (pbitmap->issorted) return;
+    qsort(pbitmap->containers, pbitmap->numcontainers, sizeof(mr_bitmap_container), mr_compare_containers);
+    mr_client_bitmap_index(pbitmap);
+    pbitmap->issorted = true;
+}
+
+static mr_bitmap_container* mr_client_bitmap_container(mr_client_bitmap* pbitmap, uint64_t high) {
+    // dense Client IDs mostly land in the same container as the last one
+    if (pbitmap->last < pbitmap->numcontainers && pbitmap->containers[pbitmap->last].high == high) {
+        return &pbitmap->containers[pbitmap->last];
+    }
+
+    if (pbitmap->numslots) {
+        size_t slot = mr_client_slot(high, pbitmap->numslots);
+
+        for (uint32_t i; (i = pbitmap->slots[slot]); slot = (slot + 1) & (pbitmap->numslots - 1)) {
+            if (pbitmap->containers[i - 1].high == high) {
+                pbitmap->last = i - 1;
+                return &pbitmap->containers[i - 1];
+            }
+        }
+    }
+
+    if (pbitmap->numcontainers == pbitmap->maxcontainers) {
+        size_t maxcontainers = pbitmap->maxcontainers ? pbitmap->maxcontainers * 2 : 4;
+        mr_bitmap_container* containers = rax_realloc(pbitmap->containers, maxcontainers * sizeof(mr_bitmap_container));
+        if (containers == NULL) return NULL;
+        memset(containers + pbitmap->maxcontainers, 0, (maxcontainers - pbitmap->maxcontainers) * sizeof(mr_bitmap_container));
+        pbitmap->containers = containers;
+        pbitmap->maxcontainers = maxcontainers;
+    }
+
+    if ((pbitmap->numcontainers + 1) * 2 > pbitmap->numslots) { // keep the load factor at or below 1/2
+        size_t numslots = pbitmap->numslots ? pbitmap->numslots * 2 : 16;
+        uint32_t* slots = rax_realloc(pbitmap->slots, numslots * sizeof(uint32_t));
+        if (slots == NULL) return NULL;
+        pbitmap->slots = slots;
+        pbitmap->numslots = numslots;
+        mr_client_bitmap_index(pbitmap);
+    }
+
+    size_t i = pbitmap->numcontainers++;
+    pbitmap->containers[i].high = high;
+    pbitmap->containers[i].cardinality = 0;
+    if (i && pbitmap->containers[i - 1].high > high) pbitmap->issorted = false;
+    size_t slot = mr_client_slot(high, pbitmap->numslots);
+    while (pbitmap->slots[slot]) slot = (slot + 1) & (pbitmap->numslots - 1);
+    pbitmap->slots[slot] = i + 1;
+    pbitmap->last = i;
+    return &pbitmap->containers[i];
+}
+
+// returns 1 if the client was added, 0 if it was already present, -1 on out of memory
+int mr_client_bitmap_add(mr_client_bitmap* pbitmap, uint64_t client) {
+    mr_bitmap_container* pcontainer = mr_client_bitmap_container(pbitmap, client >> 16);
+    if (pcontainer == NULL) goto oom;
+    uint16_t low = client & 0xffff;
+
+    if (pcontainer->cardinality > MR_BITMAP_ARRAY_MAX) {
+        uint64_t bit = 1ULL << (low & 63);
+        if (pcontainer->bits[low >> 6] & bit) return 0;
+        pcontainer->bits[low >> 6] |= bit;
+    }
+    else {
+        size_t lo = 0, hi = pcontainer->cardinality;
+
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (pcontainer->values[mid] < low) lo = mid + 1;
+            else hi = mid;
+        }
+
+        if (lo < pcontainer->cardinality && pcontainer->values[lo] == low) return 0;
+
+        if (pcontainer->cardinality == MR_BITMAP_ARRAY_MAX) { // convert
+            if (pcontainer->bits == NULL) pcontainer->bits = rax_malloc(MR_BITMAP_WORDS * sizeof(uint64_t));
+            if (pcontainer->bits == NULL) goto oom;
+            memset(pcontainer->bits, 0, MR_BITMAP_WORDS * sizeof(uint64_t));
+
+            for (size_t i = 0; i < pcontainer->cardinality; i++) {
+                pcontainer->bits[pcontainer->values[i] >> 6] |= 1ULL << (pcontainer->values[i] & 63);
+            }
+
+            pcontainer->bits[low >> 6] |= 1ULL << (low & 63);
+        }
+        else {
+            if (pcontainer->cardinality == pcontainer->maxvalues) {
+                size_t maxvalues = pcontainer->maxvalues ? pcontainer->maxvalues * 2 : 4;
+                uint16_t* values = rax_realloc(pcontainer->values, maxvalues * sizeof(uint16_t));
+                if (values == NULL) goto oom;
+                pcontainer->values = values;
+                pcontainer->maxvalues = maxvalues;
+            }
+
+            memmove(&pcontainer->values[lo + 1], &pcontainer->values[lo], (pcontainer->cardinality - lo) * sizeof(uint16_t));
+            pcontainer->values[lo] = low;
+        }
+    }
+
+    pcontainer->cardinality++;
+    pbitmap->numclients++;
+    return 1;
+
+oom:
+    errno = ENOMEM;
+    return -1;
+}
+
+// in ascending order - start with a zeroed cursor and add no Client IDs until done
+int mr_client_bitmap_next(mr_client_bitmap* pbitmap, mr_client_bitmap_cursor* pcursor, uint64_t* pclient) {
+    if (pcursor->container == 0 && pcursor->pos == 0) mr_client_bitmap_sort(pbitmap);
+
+    while (pcursor->container < pbitmap->numcontainers) {
+        mr_bitmap_container* pcontainer = &pbitmap->containers[pcursor->container];
+
+        if (pcontainer->cardinality > MR_BITMAP_ARRAY_MAX) {
+            while (pcursor->pos < 65536) {
+                uint64_t word = pcontainer->bits[pcursor->pos >> 6] >> (pcursor->pos & 63);
+
+                if (word) {
+                    pcursor->pos += __builtin_ctzll(word);
+                    *pclient = pcontainer->high << 16 | pcursor->pos++;
+                    return 1;
+                }
+
+                pcursor->pos = (pcursor->pos | 63) + 1; // next word
+            }
+        }
+        else if (pcursor->pos < pcontainer->cardinality) {
+            *pclient = pcontainer->high << 16 | pcontainer->values[pcursor->pos++];
+            return 1;
+        }
+
+        pcursor->container++;
+        pcursor->pos = 0;
+    }
+
+    return 0;
+}
+
+// in ascending order: clientv must hold numclients - returns the number written
+size_t mr_client_bitmap_extract(mr_client_bitmap* pbitmap, uint64_t* clientv) {
+    uint64_t* pclient = clientv;
+    mr_client_bitmap_sort(pbitmap);
+
+    for (size_t i = 0; i < pbitmap->numcontainers; i++) {
+        mr_bitmap_container* pcontainer = &pbitmap->containers[i];
+        uint64_t high = pcontainer->high << 16;
+
+        if (pcontainer->cardinality > MR_BITMAP_ARRAY_MAX) {
+            for (size_t w = 0; w < MR_BITMAP_WORDS; w++) {
+                for (uint64_t word = pcontainer->bits[w]; word; word &= word - 1) {
+                    *pclient++ = high | (w << 6) | __builtin_ctzll(word);
+                }
+            }
+        }
+        else {
+            for (size_t j = 0; j < pcontainer->cardinality; j++) *pclient++ = high | pcontainer->values[j];
+        }
+    }
+
+    return pclient - clientv;
+}
+
+static int mr_bitmap_add_client(mr_sink* psink, uint8_t* clientv, size_t clen) {
+    uint64_t client;
+    mr_extract_BEVBI(clientv, clen, &client);
+    return mr_client_bitmap_add(psink->ctx, client) < 0 ? -1 : 0;
+}
+
+int mr_get_subscribed_client_bitmap(rax* topic_tree, mr_client_bitmap* pbitmap, const char* pubtopic) {
+    mr_scratch mark = mr_scratch_mark();
+    int rc = -1;
+    char topicbuf[MR_STACK_TOPIC_LEN];
+    char* topic = mr_normalize_pubtopic(pubtopic, topicbuf, sizeof(topicbuf));
+    if (topic == NULL) goto done;
+    mr_client_bitmap_reset(pbitmap);
+    rc = 0;
+    if (!mr_may_have_subscribers(topic_tree, pubtopic)) goto done;
+    mr_sink sink = {mr_bitmap_add_client, NULL, pbitmap};
+    raxIterator iter;
+    raxStart(&iter, topic_tree);
+    rc = mr_match_topic(&iter, &sink, topic);
+    raxStop(&iter);
+
+done:
+    mr_scratch_release(mark);
+    return rc;
+}
+
+struct mr_pubtopic {
+    uint64_t topichash;
+    int numtokens;
+    size_t tlen;
+    mr_token* tokenv;
+    char topic[]; // normalized, followed by tokenv
+};
+
+// normalize & tokenize a publish topic once, independent of any topic tree so that one handle serves every tree &
+// thread. Its tokens are the text's: on a tree with a token dictionary the topic is coded & tokenized again on each
+// match, only the normalizing is saved
+mr_pubtopic* mr_compile_pubtopic(const char* pubtopic) {
+    mr_scratch mark = mr_scratch_mark();
+    mr_pubtopic* ppub = NULL;
+    char topicbuf[MR_STACK_TOPIC_LEN];
+    char* topic = mr_normalize_pubtopic(pubtopic, topicbuf, sizeof(topicbuf));
+    if (topic == NULL) goto done;
+    size_t tlen = strlen(topic);
+    mr_token tokenbuf[MR_STACK_LEVELS];
+    int numtokens;
+    mr_token* tokenv = mr_tokenize_topic(topic, tlen, tokenbuf, &numtokens);
+    if (tokenv == NULL) goto done;
+    size_t offset = (tlen + 1 + _Alignof(mr_token) - 1) & ~(_Alignof(mr_token) - 1);
+    ppub = rax_malloc(sizeof(mr_pubtopic) + offset + numtokens * sizeof(mr_token));
+
+    if (ppub == NULL) {
+        errno = ENOMEM;
+        goto done;
+    }
+
+    ppub->topichash = mr_hash_topic(topic);
+    ppub->numtokens = numtokens;
+    ppub->tlen = tlen;
+    ppub->tokenv = (mr_token*)(ppub->topic + offset);
+    memcpy(ppub->topic, topic, tlen + 1);
+    memcpy(ppub->tokenv, tokenv, numtokens * sizeof(mr_token));
+
+done:
+    mr_scratch_release(mark);
+    return ppub;
+}
+
+void mr_pubtopic_free(mr_pubtopic* ppub) {
+    rax_free(ppub);
+}
+
+// filtered as mr_may_have_subscribers would the text it was compiled from: the normalized topic's 1st token is the
+// hierarchy & its 2nd the first level, an empty one already 0x1f
+static int mr_match_pubtopic(raxIterator* piter, mr_sink* psink, const mr_pubtopic* ppub) {
+    mr_topic_tree_info* pinfo = raxFind(piter->rt, (uint8_t*)"", 0);
+    const mr_token* ptoken = &ppub->tokenv[1];
+    if (!mr_filter_passes(pinfo, ppub->topic[0], ppub->topic + ptoken->offset, ptoken->len)) return 0;
+    if (pinfo->codes) return mr_match_topic(piter, psink, ppub->topic); // compiled as text, so coded per match
+    psink->topichash = ppub->topichash;
+    return mr_match_tokens(piter, psink, ppub->topic, ppub->tokenv, ppub->numtokens, ppub->tlen);
+}
+
+int mr_get_subscribed_clients_compiled(rax* topic_tree, rax* srax, const mr_pubtopic* ppub) {
+    mr_sink sink = {mr_rax_add_client, NULL, srax};
+    raxIterator iter;
+    raxStart(&iter, topic_tree);
+    int rc = mr_match_pubtopic(&iter, &sink, ppub);
+    raxStop(&iter);
+    return rc;
+}
+
+int mr_get_subscribed_clients_fn_compiled(
+    rax* topic_tree, mr_client_list* plist, const mr_pubtopic* ppub, mr_client_fn fn, void* ctx
+) {
+    mr_client_list_reset(plist);
+    mr_client_fn_ctx fnctx = {plist, fn, ctx};
+    mr_sink sink = {mr_list_add_client, NULL, &fnctx};
+    raxIterator iter;
+    raxStart(&iter, topic_tree);
+    int rc = mr_match_pubtopic(&iter, &sink, ppub);
+    raxStop(&iter);
+    return rc;
+}
+
+// dense 32 bit IDs for a bounded set of publish topics, each compiled once when interned
+struct mr_topic_table {
+    rax* ids; // normalized topic -> ID + 1
+    mr_pubtopic** pubtopicv; // by ID
+    size_t numtopics;
+    size_t maxtopics;
+};
+
+mr_topic_table* mr_topic_table_new(void) {
+    mr_topic_table* ptable = rax_malloc(sizeof(mr_topic_table));
+    if (ptable == NULL) goto oom;
+    memset(ptable, 0, sizeof(mr_topic_table));
+    ptable->ids = raxNewWithSlabs();
+
+    if (ptable->ids == NULL) {
+        rax_free(ptable);
+        goto oom;
+    }
+
+    return ptable;
+
+oom:
+    errno = ENOMEM;
+    return NULL;
+}
+
+void mr_topic_table_free(mr_topic_table* ptable) {
+    if (ptable == NULL) return;
+    for (size_t i = 0; i < ptable->numtopics; i++) mr_pubtopic_free(ptable->pubtopicv[i]);
+    rax_free(ptable->pubtopicv);
+    raxFree(ptable->ids);
+    rax_free(ptable);
+}
+
+// the ID of a publish topic, interning it if it is new
+int mr_intern_topic(mr_topic_table* ptable, const char* pubtopic, uint32_t* pid) {
+    mr_scratch mark = mr_scratch_mark();
+    int rc = -1;
+    char topicbuf[MR_STACK_TOPIC_LEN];
+    char* topic = mr_normalize_pubtopic(pubtopic, topicbuf, sizeof(topicbuf));
+    if (topic == NULL) goto done;
+    size_t tlen = strlen(topic);
+    void* id = raxFind(ptable->ids, (uint8_t*)topic, tlen);
+
+    if (id != raxNotFound) {
+        *pid = (uintptr_t)id - 1;
+        rc = 0;
+        goto done;
+    }
+
+    if (ptable->numtopics == UINT32_MAX) {
+        errno = ENOSPC;
+        goto done;
+    }
+
+    if (ptable->numtopics == ptable->maxtopics) {
+        size_t maxtopics = ptable->maxtopics ? ptable->maxtopics * 2 : 64;
+        mr_pubtopic** pubtopicv = rax_realloc(ptable->pubtopicv, maxtopics * sizeof(mr_pubtopic*));
+        if (pubtopicv == NULL) goto oom;
+        ptable->pubtopicv = pubtopicv;
+        ptable->maxtopics = maxtopics;
+    }
+
+    mr_pubtopic* ppub = mr_compile_pubtopic(pubtopic);
+    if (ppub == NULL) goto done;
+
+    if (!raxInsert(ptable->ids, (uint8_t*)topic, tlen, (void*)(uintptr_t)(ptable->numtopics + 1), NULL) && errno == ENOMEM) {
+        mr_pubtopic_free(ppub);
+        goto oom;
+    }
+
+    *pid = ptable->numtopics;
+    ptable->pubtopicv[ptable->numtopics++] = ppub;
+    rc = 0;
+    goto done;
+
+oom:
+    errno = ENOMEM;
+
+done:
+    mr_scratch_release(mark);
+    return rc;
+}
+
+// the ID of an already interned publish topic: -1 with errno ENOENT if it isn't
+int mr_find_topic_id(mr_topic_table* ptable, const char* pubtopic, uint32_t* pid) {
+    mr_scratch mark = mr_scratch_mark();
+    int rc = -1;
+    char topicbuf[MR_STACK_TOPIC_LEN];
+    char* topic = mr_normalize_pubtopic(pubtopic, topicbuf, sizeof(topicbuf));
+    if (topic == NULL) goto done;
+    void* id = raxFind(ptable->ids, (uint8_t*)topic, strlen(topic));
+
+    if (id == raxNotFound) {
+        errno = ENOENT;
+        goto done;
+    }
+
+    *pid = (uintptr_t)id - 1;
+    rc = 0;
+
+done:
+    mr_scratch_release(mark);
+    return rc;
+}
+
+// NULL if the ID was never handed out
+const mr_pubtopic* mr_get_interned_pubtopic(mr_topic_table* ptable, uint32_t id) {
+    return id < ptable->numtopics ? ptable->pubtopicv[id] : NULL;
+}
+
+// the publish topic as it was interned: the normalized topic without its hierarchy & with empty tokens restored
+// - pubtopic must hold the topic's length + 1 bytes, at most MR_MAX_TOPIC_BYTES + 1
+int mr_get_interned_topic(mr_topic_table* ptable, uint32_t id, char* pubtopic) {
+    if (id >= ptable->numtopics) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    const mr_pubtopic* ppub = ptable->pubtopicv[id];
+    char* pc = pubtopic;
+
+    for (int i = 1; i < ppub->numtokens; i++) { // token 0 is the hierarchy
+        const char* token = ppub->topic + ppub->tokenv[i].offset;
+        size_t len = ppub->tokenv[i].len;
+        if (i > 1) *pc++ = '/';
+        if (len == 1 && token[0] == empty_tokenv[0]) continue;
+        memcpy(pc, token, len);
+        pc += len;
+    }
+
+    *pc = '\0';
+    return 0;
+}
+
+int mr_get_subscribed_clients_by_id(rax* topic_tree, mr_topic_table* ptable, rax* srax, uint32_t id) {
+    const mr_pubtopic* ppub = mr_get_interned_pubtopic(ptable, id);
+
+    if (ppub == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return mr_get_subscribed_clients_compiled(topic_tree, srax, ppub);
+}
+
+typedef struct mr_count_ctx {
+    size_t count;
+    size_t numsources; // matching subscribe topics with regular clients plus matching share groups
+} mr_count_ctx;
+
+// one lookup per matching subscribe topic: its regular client count plus one client per share group
+static int mr_count_topic_clients(mr_sink* psink, raxIterator* piter, uint8_t* key, size_t key_len) {
+    mr_count_ctx* pctx = psink->ctx;
+    key[key_len] = client_mark;
+    void* count = raxFindRelative(piter, key, key_len + 1);
+
+    if (count != raxNotFound && (uintptr_t)count) {
+        pctx->count += (uintptr_t)count;
+        pctx->numsources++;
+    }
+
+    key[key_len] = shared_mark;
+    mr_share_group* pgroup = raxFindRelative(piter, key, key_len + 1);
+    if (pgroup == raxNotFound) return 0;
+
+    for (; pgroup; pgroup = pgroup->next) {
+        pctx->count++;
+        pctx->numsources++;
+    }
+
+    return 0;
+}
+
+// the count is exact unless more than one source matched since a client may be in several - then it is an upper bound
+int mr_count_subscribed_clients(rax* topic_tree, const char* pubtopic, size_t* pcount, bool* pisexact) {
+    *pcount = 0;
+    if (pisexact) *pisexact = true;
+    mr_scratch mark = mr_scratch_mark();
+    int rc = -1;
+    char topicbuf[MR_STACK_TOPIC_LEN];
+    char* topic = mr_normalize_pubtopic(pubtopic, topicbuf, sizeof(topicbuf));
+    if (topic == NULL) goto done;
+    rc = 0;
+    if (!mr_may_have_subscribers(topic_tree, pubtopic)) goto done;
+    mr_count_ctx ctx = {0, 0};
+    mr_sink sink = {NULL, NULL, &ctx, 0, mr_count_topic_clients};
+    raxIterator iter;
+    raxStart(&iter, topic_tree);
+    rc = mr_match_topic(&iter, &sink, topic);
+    raxStop(&iter);
+    *pcount = ctx.count;
+    if (pisexact) *pisexact = ctx.numsources <= 1;
+
+done:
+    mr_scratch_release(mark);
+    return rc;
+}
+
+typedef struct mr_batch_topic {
+    const char* topic; // normalized
+    size_t index; // into the caller's vectors
+} mr_batch_topic;
+
+static int mr_compare_batch_topics(const void* pa, const void* pb) {
+    return strcmp(((mr_batch_topic*)pa)->topic, ((mr_batch_topic*)pb)->topic);
+}
+
+// sorting the normalized topics lets each match resume from the levels it shares with the previous one
+int mr_get_subscribed_clients_batch(rax* topic_tree, rax** client_setv, const char** pubtopicv, size_t numtopics) {
+    size_t buflen = 0;
+    for (size_t i = 0; i < numtopics; i++) buflen += MR_NORMALIZED_TOPIC_LEN(strlen(pubtopicv[i]));
+    char* topicbuf = rax_malloc(buflen ? buflen : 1);
+    mr_batch_topic* batchv = rax_malloc(numtopics ? numtopics * sizeof(mr_batch_topic) : 1);
+
+    if (topicbuf == NULL || batchv == NULL) {
+        rax_free(topicbuf);
+        rax_free(batchv);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    char* topic = topicbuf;
+
+    for (size_t i = 0; i < numtopics; i++) { // all or nothing: no topic is matched if any is invalid
+        if (mr_get_normalized_topic(pubtopicv[i], topic, NULL)) {
+            rax_free(batchv);
+            rax_free(topicbuf);
+            return -1;
+        }
+
+        batchv[i].topic = topic;
+        batchv[i].index = i;
+        topic += strlen(topic) + 1;
+    }
+
+    qsort(batchv, numtopics, sizeof(mr_batch_topic), mr_compare_batch_topics);
+    int rc = 0;
+    raxIterator iter;
+    raxStart(&iter, topic_tree);
+
+    for (size_t i = 0; i < numtopics && rc == 0; i++) { // stop at the first failure: its result set is incomplete
+        mr_sink sink = {mr_rax_add_client, NULL, client_setv[batchv[i].index]};
+        rc = mr_match_topic(&iter, &sink, batchv[i].topic);
+    }
+
+    raxStop(&iter);
+
+    rax_free(batchv);
+    rax_free(topicbuf);
+    return rc;
+}
+
+// a growable byte buffer
+typedef struct mr_buf {
+    uint8_t* data;
+    size_t len;
+    size_t max;
+} mr_buf;
+
+static int mr_buf_append(mr_buf* pbuf, const void* data, size_t len) {
+    if (pbuf->len + len > pbuf->max) {
+        size_t max = pbuf->max ? pbuf->max : 256;
+        while (pbuf->len + len > max) max *= 2;
+        uint8_t* data2 = rax_realloc(pbuf->data, max);
+        if (data2 == NULL) return -1;
+        pbuf->data = data2;
+        pbuf->max = max;
+    }
+
+    memcpy(pbuf->data + pbuf->len, data, len);
+    pbuf->len += len;
+    return 0;
+}
+
+// a cached match: the regular clients and the share groups found for one normalized topic
+typedef struct mr_cache_entry {
+    uint64_t stamp; // the topic tree's clock when filled
+    size_t depth; // number of topic levels present in the topic tree when filled
+    size_t numshares; // share groups, ahead of the clients in data
+    size_t clientslen; // bytes of <VBI length><VBI> per regular client
+    uint8_t data[];
+} mr_cache_entry;
+
+struct mr_match_cache {
+    rax* topic_tree;
+    rax* entries; // normalized topic -> mr_cache_entry*
+    size_t maxentries;
+    mr_buf clients; // fill scratch reused across misses
+    mr_buf shares;
+};
+
+// a miss: record what the match finds while passing it on to the caller's sink
+typedef struct mr_cache_fill {
+    mr_match_cache* pcache;
+    mr_sink* presult;
+    bool isoom;
+} mr_cache_fill;
+
+static int mr_cache_add_client(mr_sink* psink, uint8_t* clientv, size_t clen) {
+    mr_cache_fill* pfill = psink->ctx;
+    uint8_t len = clen;
+    if (mr_buf_append(&pfill->pcache->clients, &len, 1)) pfill->isoom = true;
+    else if (mr_buf_append(&pfill->pcache->clients, clientv, clen)) pfill->isoom = true;
+    return pfill->presult->add_client(pfill->presult, clientv, clen);
+}
+
+// a group can only be freed by an unsubscribe which also invalidates every entry that holds it
+static int mr_cache_add_share(mr_sink* psink, mr_share_group* pgroup) {
+    mr_cache_fill* pfill = psink->ctx;
+    if (mr_buf_append(&pfill->pcache->shares, &pgroup, sizeof(mr_share_group*))) pfill->isoom = true;
+    return mr_pick_share_client(pfill->presult, pgroup);
+}
+
+// count the levels of a normalized topic present in the topic tree & find the newest generation among them, building
+// its topic key in topic_key, which has room for the topic's length: (size_t)-1 with errno ENOMEM
+static size_t mr_get_topic_generation(raxIterator* piter, const char* topic, char* topic_key, uint64_t* pgeneration) {
+    size_t tlen = strlen(topic);
+    mr_scratch mark = mr_scratch_mark();
+    char codedbuf[MR_STACK_TOPIC_LEN];
+    const char* pc = mr_encode_pubtopic(piter->rt, topic, tlen, codedbuf, sizeof(codedbuf));
+    if (pc == NULL) return (size_t)-1;
+    const char* pend = pc + (pc == topic ? tlen : strlen(pc));
+    size_t len = 0;
+    size_t depth = 0;
+    *pgeneration = 0;
+
+    size_t sep = mr_key_sep(piter->rt);
+
+    while (true) {
+        const char* psep = mr_find_separator(pc, pend);
+        len = mr_add_key_level(topic_key, len, pc, psep - pc, sep);
+        void* data = raxFindRelative(piter, (uint8_t*)topic_key, len);
+        if (data == raxNotFound) break;
+        if (mr_level_generation(data) > *pgeneration) *pgeneration = mr_level_generation(data);
+        depth++;
+        if (psep == pend) break;
+        pc = psep + 1;
+    }
+
+    mr_scratch_release(mark);
+    return depth;
+}
+
+static void mr_replay_cache_entry(mr_sink* psink, mr_cache_entry* pentry) {
+    mr_share_group** pgroupv = (mr_share_group**)pentry->data;
+    for (size_t i = 0; i < pentry->numshares; i++) mr_pick_share_client(psink, pgroupv[i]); // re-pick every publish
+    uint8_t* pu8 = pentry->data + pentry->numshares * sizeof(mr_share_group*);
+    uint8_t* pend = pu8 + pentry->clientslen;
+
+    while (pu8 < pend) {
+        psink->add_client(psink, pu8 + 1, *pu8);
+        pu8 += 1 + *pu8;
+    }
+}
+
+static void mr_evict_cache_entry(mr_match_cache* pcache) {
+    raxIterator iter;
+    raxStart(&iter, pcache->entries);
+    raxSeek(&iter, "^", NULL, 0);
+
+    if (raxRandomWalk(&iter, 0)) {
+        rax_free(iter.data);
+        raxRemove(pcache->entries, iter.key, iter.key_len, NULL);
+    }
+
+    raxStop(&iter);
+}
+
+mr_match_cache* mr_match_cache_new(rax* topic_tree, size_t maxentries) {
+    mr_match_cache* pcache = rax_malloc(sizeof(mr_match_cache));
+    if (pcache == NULL) goto oom;
+    memset(pcache, 0, sizeof(mr_match_cache));
+    pcache->entries = raxNewWithSlabs();
+
+    if (pcache->entries == NULL) {
+        rax_free(pcache);
+        goto oom;
+    }
+
+    pcache->topic_tree = topic_tree;
+    pcache->maxentries = maxentries;
+    return pcache;
+
+oom:
+    errno = ENOMEM;
+    return NULL;
+}
+
+void mr_match_cache_free(mr_match_cache* pcache) {
+    if (pcache == NULL) return;
+    raxFreeWithCallback(pcache->entries, rax_free);
+    rax_free(pcache->clients.data);
+    rax_free(pcache->shares.data);
+    rax_free(pcache);
+}
+
+// an entry stays valid while no level on its topic's path has been stamped since it was filled
+// and the same number of levels are present - subscribe & unsubscribe stamp exactly those levels
+int mr_get_subscribed_clients_cached(mr_match_cache* pcache, rax* srax, const char* pubtopic) {
+    mr_scratch mark = mr_scratch_mark();
+    int rc = -1;
+    char topicbuf[MR_STACK_TOPIC_LEN];
+    char* topic = mr_normalize_pubtopic(pubtopic, topicbuf, sizeof(topicbuf));
+    if (topic == NULL) goto done;
+    size_t tlen = strlen(topic);
+    char keybuf[MR_STACK_TOPIC_LEN];
+    char* topic_key = mr_stack_or_scratch(keybuf, sizeof(keybuf), tlen + 1);
+    if (topic_key == NULL) goto done;
+    mr_sink sink = {mr_rax_add_client, NULL, srax, mr_hash_topic(topic)};
+    raxIterator iter;
+    raxStart(&iter, pcache->topic_tree);
+    uint64_t generation;
+    size_t depth = mr_get_topic_generation(&iter, topic, topic_key, &generation);
+
+    if (depth == (size_t)-1) {
+        raxStop(&iter);
+        goto done;
+    }
+
+    rc = 0;
+    mr_cache_entry* pentry = raxFind(pcache->entries, (uint8_t*)topic, tlen);
+
+    if (pentry != raxNotFound && pentry->depth == depth && generation <= pentry->stamp) {
+        mr_replay_cache_entry(&sink, pentry);
+        raxStop(&iter);
+        goto done;
+    }
+
+    if (pentry != raxNotFound) {
+        raxRemove(pcache->entries, (uint8_t*)topic, tlen, NULL);
+        rax_free(pentry);
+    }
+
+    pcache->clients.len = 0;
+    pcache->shares.len = 0;
+    mr_cache_fill fill = {pcache, &sink, false};
+    mr_sink fill_sink = {mr_cache_add_client, mr_cache_add_share, &fill};
+    rc = mr_match_topic(&iter, &fill_sink, topic);
+    raxStop(&iter);
+
+    if (rc || fill.isoom || pcache->maxentries == 0) goto done; // the result is complete, just not cached
+    if (raxSize(pcache->entries) >= pcache->maxentries) mr_evict_cache_entry(pcache);
+    size_t datalen = pcache->shares.len + pcache->clients.len;
+    pentry = rax_malloc(sizeof(mr_cache_entry) + datalen);
+    if (pentry == NULL) goto done;
+    mr_topic_tree_info* pinfo = raxFind(pcache->topic_tree, (uint8_t*)"", 0);
+    pentry->stamp = pinfo == raxNotFound ? 0 : pinfo->generation;
+    pentry->depth = depth;
+    pentry->numshares = pcache->shares.len / sizeof(mr_share_group*);
+    pentry->clientslen = pcache->clients.len;
+    if (pcache->shares.len) memcpy(pentry->data, pcache->shares.data, pcache->shares.len);
+    if (pcache->clients.len) memcpy(pentry->data + pcache->shares.len, pcache->clients.data, pcache->clients.len);
+    if (!raxInsert(pcache->entries, (uint8_t*)topic, tlen, pentry, NULL) && errno == ENOMEM) rax_free(pentry);
+
+done:
+    mr_scratch_release(mark);
+    return rc;
+}
+
+// add a Client ID set's containers to another's: bitmaps are OR'd a word at a time & arrays added value by value
+static int mr_client_bitmap_merge(mr_client_bitmap* pdst, mr_client_bitmap* psrc) {
+    for (size_t i = 0; i < psrc->numcontainers; i++) {
+        mr_bitmap_container* psc = &psrc->containers[i];
 
-    for (int i = (numtokens - 1); i >= 0; i--, count++) {
-        if (!mr_trim_leaf(topic_tree, piter, (uint8_t*)topic_key, len)) return count;
-        len -= strlen(tokenv[i]);
-    }
+        if (psc->cardinality <= MR_BITMAP_ARRAY_MAX) {
+            for (size_t j = 0; j < psc->cardinality; j++) {
+                if (mr_client_bitmap_add(pdst, psc->high << 16 | psc->values[j]) < 0) return -1;
+            }
 
-    return count;
-}
+            continue;
+        }
 
-static int mr_remove_subscription_topic_tree(rax* topic_tree, const char* subtopic, const uint8_t* clientv, const size_t clen) {
-    size_t stlen = strlen(subtopic);
-    char topic[stlen + 3];
-    char share[stlen + 1];
-    share[0] = '\0';
-    char topic_key[stlen + 3];
+        mr_bitmap_container* pdc = mr_client_bitmap_container(pdst, psc->high);
+        if (pdc == NULL) goto oom;
 
-    mr_get_subscribe_topic(subtopic, topic, share, topic_key);
-    size_t tlen = strlen(topic);
-    size_t slen = strlen(share);
-    size_t tklen = strlen(topic_key);
-    size_t tklen2 = tklen + 1 + slen + (slen ? 1 : 0);
-    uint8_t topic_key2[tklen2 + clen];
-    memcpy(topic_key2, topic_key, tklen);
+        if (pdc->cardinality > MR_BITMAP_ARRAY_MAX) {
+            for (size_t w = 0; w < MR_BITMAP_WORDS; w++) pdc->bits[w] |= psc->bits[w];
+        }
+        else { // convert: the source's bits plus this container's values
+            if (pdc->bits == NULL) pdc->bits = rax_malloc(MR_BITMAP_WORDS * sizeof(uint64_t));
+            if (pdc->bits == NULL) goto oom;
+            memcpy(pdc->bits, psc->bits, MR_BITMAP_WORDS * sizeof(uint64_t));
 
-    if (slen) { // shared subscription sub-hierarchy
-        memcpy(topic_key2 + tklen, &shared_mark, 1);
-        memcpy(topic_key2 + tklen + 1, (void*)share, slen);
-        memcpy(topic_key2 + tklen + 1 + slen, &client_mark, 1);
-    }
-    else { // regular subscription sub-hierarchy
-        memcpy(topic_key2 + tklen, &client_mark, 1);
+            for (size_t j = 0; j < pdc->cardinality; j++) {
+                pdc->bits[pdc->values[j] >> 6] |= 1ULL << (pdc->values[j] & 63);
+            }
+        }
+
+        size_t cardinality = 0;
+        for (size_t w = 0; w < MR_BITMAP_WORDS; w++) cardinality += __builtin_popcountll(pdc->bits[w]);
+        pdst->numclients += cardinality - pdc->cardinality;
+        pdc->cardinality = cardinality;
     }
 
-    memcpy(topic_key2 + tklen2, clientv, clen);
+    return 0;
+
+oom:
+    errno = ENOMEM;
+    return -1;
+}
 
-    if (raxRemove(topic_tree, topic_key2, tklen2 + clen, NULL)) { // regular or share client
-        raxIterator iter;
-        raxStart(&iter, topic_tree);
+#define MR_FANOUT_EDGES 128 // client keys are VBIs: every byte is 7 bits
+#define MR_FANOUT_JOBS_PER_THREAD 4
+
+// the clients whose key starts with key: a wide <topic><0xff> prefix plus one or two child edge bytes
+typedef struct mr_fanout_job {
+    size_t offset; // of the key in the pool's keys
+    size_t len;
+    size_t prefixlen; // of <topic><0xff>: the client's VBI follows
+} mr_fanout_job;
+
+typedef struct mr_match_worker {
+    mr_match_pool* ppool;
+    pthread_t thread;
+    mr_client_bitmap bitmap; // thread-local result, merged into the caller's when the fan-out is done
+} mr_match_worker;
+
+struct mr_match_pool {
+    size_t numworkers; // besides the calling thread
+    size_t minclients; // the regular client count at which a subscribe topic is fanned out
+    mr_match_worker* workerv;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t round; // bumped to start the workers on a fan-out
+    size_t numbusy;
+    bool isstopping;
+    // the current fan-out
+    rax* topic_tree;
+    mr_client_bitmap* pbitmap; // the caller's
+    mr_buf keys; // job keys end to end
+    mr_buf jobs;
+    mr_buf splitjobs; // scratch for splitting jobs by their child edges
+    atomic_size_t nextjob;
+    atomic_bool isoom;
+};
+
+static int mr_add_fanout_job(mr_match_pool* ppool, mr_buf* pjobs, uint8_t* key, size_t len, size_t prefixlen) {
+    mr_fanout_job job = {ppool->keys.len, len, prefixlen};
+    if (mr_buf_append(&ppool->keys, key, len) || mr_buf_append(pjobs, &job, sizeof(mr_fanout_job))) return -1;
+    return 0;
+}
+
+// replace each job by one per child edge byte below its key: only the edges present when isseek since finding them
+// costs a seek each, otherwise every possible edge with the empty ones left for the workers to skip
+static int mr_split_fanout_jobs(mr_match_pool* ppool, raxIterator* piter, bool isseek) {
+    size_t numjobs = ppool->jobs.len / sizeof(mr_fanout_job);
+    ppool->splitjobs.len = 0;
+
+    for (size_t i = 0; i < numjobs; i++) {
+        mr_fanout_job job = ((mr_fanout_job*)ppool->jobs.data)[i];
+        uint8_t key[job.len + 1];
+        memcpy(key, ppool->keys.data + job.offset, job.len);
+
+        if (job.len > job.prefixlen && raxFind(ppool->topic_tree, key, job.len) != raxNotFound) { // a client
+            uint64_t client;
+            mr_extract_BEVBI(key + job.prefixlen, job.len - job.prefixlen, &client);
+            if (mr_client_bitmap_add(ppool->pbitmap, client) < 0) return -1;
+        }
 
-        // trim hierarchy as long as there are no more child keys
-        if (mr_trim_leaf(topic_tree, &iter, topic_key2, tklen2)) { // regular or share client mark
-            int trimmed = 1;
+        for (int edge = 0; edge < MR_FANOUT_EDGES; edge++) {
+            key[job.len] = edge;
 
-            if (slen) {
-                trimmed = mr_trim_leaf(topic_tree, &iter, topic_key2, tlen + 1 + slen); // share
-                if (trimmed) trimmed = mr_trim_leaf(topic_tree, &iter, topic_key2, tlen + 1); // shared mark
+            if (isseek) {
+                raxSeek(piter, ">=", key, job.len + 1);
+                if (!raxNext(piter) || piter->key_len <= job.len || memcmp(piter->key, key, job.len)) break;
+                edge = key[job.len] = piter->key[job.len];
             }
 
-            if (trimmed) mr_trim_topic_tree(topic_tree, &iter, topic, topic_key); // topic
+            if (mr_add_fanout_job(ppool, &ppool->splitjobs, key, job.len + 1, job.prefixlen)) return -1;
         }
-
-        raxStop(&iter);
     }
 
+    mr_buf jobs = ppool->jobs;
+    ppool->jobs = ppool->splitjobs;
+    ppool->splitjobs = jobs;
     return 0;
 }
 
-static int mr_remove_subscription_client_tree(rax* client_tree, const char* subtopic, const uint8_t* clientv, size_t clen) {
-    size_t stlen = strlen(subtopic);
+// take jobs until none are left
+static void mr_run_fanout_jobs(mr_match_pool* ppool, mr_client_bitmap* pbitmap) {
+    size_t numjobs = ppool->jobs.len / sizeof(mr_fanout_job);
     raxIterator iter;
-    raxStart(&iter, client_tree);
-    uint8_t inversion[clen + 4 + stlen];
-    memcpy(inversion, clientv, clen);
-    memcpy(inversion + clen, &client_mark, 1);
-    memcpy(inversion + 1 + clen, "subs", 4);
-    memcpy(inversion + 1 + clen + 4, subtopic, stlen);
+    raxStart(&iter, ppool->topic_tree);
+
+    for (size_t i; (i = atomic_fetch_add(&ppool->nextjob, 1)) < numjobs;) {
+        mr_fanout_job* pjob = &((mr_fanout_job*)ppool->jobs.data)[i];
+        uint8_t* key = ppool->keys.data + pjob->offset;
+        raxSeek(&iter, ">=", key, pjob->len);
 
-    if (raxRemove(client_tree, (uint8_t*)inversion, clen + 1 + 4 + stlen, NULL)) { // found
-        if (mr_trim_leaf(client_tree, &iter, inversion, clen + 1 + 4)) {
-            mr_trim_leaf(client_tree, &iter, inversion, clen + 1);
+        while (raxNext(&iter) && iter.key_len >= pjob->len && !memcmp(iter.key, key, pjob->len)) {
+            uint64_t client;
+            mr_extract_BEVBI(iter.key + pjob->prefixlen, iter.key_len - pjob->prefixlen, &client);
+            if (mr_client_bitmap_add(pbitmap, client) < 0) atomic_store(&ppool->isoom, true);
         }
     }
 
     raxStop(&iter);
-    return 0;
 }
 
-int mr_remove_subscription(rax* topic_tree, rax* client_tree, const char* subtopic, const uint64_t client) {
-    // get the client bytes in network order (big endian) as a Variable Byte Integer (VBI)
-    uint8_t clientv[NUMBYTES];
-    size_t clen = mr_make_BEVBI(client, clientv);
-    mr_remove_subscription_topic_tree(topic_tree, subtopic, clientv, clen);
-    mr_remove_subscription_client_tree(client_tree, subtopic, clientv, clen);
-    return 0;
+static void* mr_match_worker_run(void* arg) {
+    mr_match_worker* pworker = arg;
+    mr_match_pool* ppool = pworker->ppool;
+    uint64_t round = 0;
+    pthread_mutex_lock(&ppool->lock);
+
+    while (true) {
+        while (ppool->round == round && !ppool->isstopping) pthread_cond_wait(&ppool->start, &ppool->lock);
+        if (ppool->isstopping) break;
+        round = ppool->round;
+        pthread_mutex_unlock(&ppool->lock);
+        mr_client_bitmap_reset(&pworker->bitmap);
+        mr_run_fanout_jobs(ppool, &pworker->bitmap);
+        pthread_mutex_lock(&ppool->lock);
+        if (--ppool->numbusy == 0) pthread_cond_signal(&ppool->done);
+    }
+
+    pthread_mutex_unlock(&ppool->lock);
+    return NULL;
 }
 
-int mr_remove_client_subscriptions(rax* topic_tree, rax* client_tree, const uint64_t client) {
-    rax* srax = raxNew();
-    raxIterator iter;
-    raxStart(&iter, client_tree);
+static void mr_match_pool_stop(mr_match_pool* ppool, size_t numstarted) {
+    pthread_mutex_lock(&ppool->lock);
+    ppool->isstopping = true;
+    pthread_cond_broadcast(&ppool->start);
+    pthread_mutex_unlock(&ppool->lock);
+    for (size_t i = 0; i < numstarted; i++) pthread_join(ppool->workerv[i].thread, NULL);
+}
 
-    // get the client bytes in network order (big endian) as a Variable Byte Integer (VBI)
-    uint8_t clientv[NUMBYTES];
-    size_t clen = mr_make_BEVBI(client, clientv);
+// numthreads includes the calling thread - subscribe topics with fewer than minclients regular clients are
+// gathered by the calling thread alone
+mr_match_pool* mr_match_pool_new(size_t numthreads, size_t minclients) {
+    mr_match_pool* ppool = rax_malloc(sizeof(mr_match_pool));
+    if (ppool == NULL) goto oom;
+    memset(ppool, 0, sizeof(mr_match_pool));
+    ppool->numworkers = numthreads > 1 ? numthreads - 1 : 0;
+    ppool->minclients = minclients;
+    ppool->workerv = ppool->numworkers ? rax_malloc(ppool->numworkers * sizeof(mr_match_worker)) : NULL;
+
+    if (ppool->numworkers && ppool->workerv == NULL) {
+        rax_free(ppool);
+        goto oom;
+    }
 
-    uint8_t inversion[clen + 1 + 4];
-    memcpy(inversion, clientv, clen);
-    memcpy(inversion + clen, &client_mark, 1);
-    memcpy(inversion + 1 + clen, "subs", 4);
-    raxSeekSubtree(&iter, inversion, clen + 1 + 4);
-    raxNext(&iter); // skip 1st key
-    while(raxNext(&iter)) raxInsert(srax, iter.key + 1 + clen + 4, iter.key_len - (clen + 1 + 4), NULL, NULL);
-    raxStart(&iter, srax);
-    raxSeek(&iter, "^", NULL, 0);
+    pthread_mutex_init(&ppool->lock, NULL);
+    pthread_cond_init(&ppool->start, NULL);
+    pthread_cond_init(&ppool->done, NULL);
 
-    while(raxNext(&iter)) {
-        char subtopic[iter.key_len + 1];
-        memcpy(subtopic, iter.key, iter.key_len);
-        subtopic[iter.key_len] = '\0';
-        mr_remove_subscription_topic_tree(topic_tree, subtopic, clientv, clen);
+    for (size_t i = 0; i < ppool->numworkers; i++) {
+        ppool->workerv[i].ppool = ppool;
+        mr_client_bitmap_init(&ppool->workerv[i].bitmap);
+
+        if (pthread_create(&ppool->workerv[i].thread, NULL, mr_match_worker_run, &ppool->workerv[i])) {
+            ppool->numworkers = i;
+            mr_match_pool_free(ppool);
+            errno = EAGAIN;
+            return NULL;
+        }
     }
 
-    raxFree(srax);
-    raxRemoveSubtree(client_tree, inversion, clen + 1 + 4);
-    raxStart(&iter, client_tree);
-    mr_trim_leaf(client_tree, &iter, inversion, clen);
-    raxStop(&iter);
+    return ppool;
+
+oom:
+    errno = ENOMEM;
+    return NULL;
+}
+
+void mr_match_pool_free(mr_match_pool* ppool) {
+    if (ppool == NULL) return;
+    mr_match_pool_stop(ppool, ppool->numworkers);
+    for (size_t i = 0; i < ppool->numworkers; i++) mr_client_bitmap_free(&ppool->workerv[i].bitmap);
+    pthread_mutex_destroy(&ppool->lock);
+    pthread_cond_destroy(&ppool->start);
+    pthread_cond_destroy(&ppool->done);
+    rax_free(ppool->workerv);
+    rax_free(ppool->keys.data);
+    rax_free(ppool->jobs.data);
+    rax_free(ppool->splitjobs.data);
+    rax_free(ppool);
+}
+
+static int mr_fanout_add_client(mr_sink* psink, uint8_t* clientv, size_t clen) {
+    mr_match_pool* ppool = psink->ctx;
+    uint64_t client;
+    mr_extract_BEVBI(clientv, clen, &client);
+    if (mr_client_bitmap_add(ppool->pbitmap, client) < 0) atomic_store(&ppool->isoom, true);
     return 0;
 }
 
-static int mr_get_topic_clients(raxIterator* iter, rax* srax, uint8_t* key, size_t key_len) {
-    // get regular subs
+// wide client subtrees are put aside for the fan-out - share groups are always picked by the calling thread
+static int mr_fanout_topic_clients(mr_sink* psink, raxIterator* piter, uint8_t* key, size_t key_len) {
+    mr_match_pool* ppool = psink->ctx;
     key[key_len] = client_mark;
-    raxSeekSubtreeRelative(iter, key, key_len + 1);
+    void* count = raxFindRelative(piter, key, key_len + 1);
 
-    if (raxNext(iter)) { // subtree exists? Skip 1st key if it does
-        while(raxNext(iter)) {
-            size_t clen = iter->key_len - (key_len + 1);
-            raxTryInsert(srax, iter->key + key_len + 1, clen, NULL, NULL);
-        }
+    if (ppool->numworkers && count != raxNotFound && (uintptr_t)count && (uintptr_t)count >= ppool->minclients) {
+        if (mr_add_fanout_job(ppool, &ppool->jobs, key, key_len + 1, key_len + 1)) atomic_store(&ppool->isoom, true);
     }
+    else mr_get_regular_clients(piter, psink, key, key_len);
 
-    // get shared subs
-    key[key_len] = shared_mark;
+    return mr_get_share_clients(piter, psink, key, key_len);
+}
 
-    raxSeekSubtreeRelative(iter, key, key_len + 1);
+// as mr_get_subscribed_client_bitmap but the regular clients of wide subscribe topics are split by child edge byte
+// between the pool's threads, each gathering into its own set - one call at a time per pool & the topic tree must
+// not change until it returns
+int mr_get_subscribed_client_bitmap_parallel(
+    rax* topic_tree, mr_match_pool* ppool, mr_client_bitmap* pbitmap, const char* pubtopic
+) {
+    mr_scratch mark = mr_scratch_mark();
+    char topicbuf[MR_STACK_TOPIC_LEN];
+    char* topic = mr_normalize_pubtopic(pubtopic, topicbuf, sizeof(topicbuf));
 
-    if (raxNext(iter)) { // same
-        raxIterator* piter2 = raxIteratorDup(iter);
+    if (topic == NULL) {
+        mr_scratch_release(mark);
+        return -1;
+    }
 
-        while(raxNext(iter)) { // randomly pick one client per share - only keys w/client marks
-            if (!memchr(iter->key, 0xfe, iter->key_len) || iter->key[iter->key_len - 1] != 0xff) continue;
-            raxSeekSubtreeRelative(piter2, iter->key, iter->key_len);
+    mr_client_bitmap_reset(pbitmap);
+    ppool->topic_tree = topic_tree;
+    ppool->pbitmap = pbitmap;
+    ppool->keys.len = 0;
+    ppool->jobs.len = 0;
+    atomic_store(&ppool->nextjob, 0);
+    atomic_store(&ppool->isoom, false);
+    mr_sink sink = {mr_fanout_add_client, NULL, ppool, 0, mr_fanout_topic_clients};
+    raxIterator iter;
+    raxStart(&iter, topic_tree);
+    if (mr_match_topic(&iter, &sink, topic)) atomic_store(&ppool->isoom, true);
+    raxStop(&iter);
+    mr_scratch_release(mark);
+    raxStart(&iter, topic_tree); // without the subtree stop left by the match
 
-            if (raxNext(piter2)) { // same - should succeed tho
-                size_t count = 0;
-                while (raxNext(piter2)) count++;
+    // by the edges below each <0xff> then, while too few to keep every thread busy, by all those one byte deeper
+    size_t minjobs = (ppool->numworkers + 1) * MR_FANOUT_JOBS_PER_THREAD;
 
-                if (count) {
-                    int choice = arc4random() % count;
-                    raxSeekSubtreeRelative(piter2, iter->key, iter->key_len);
+    if (ppool->jobs.len && !atomic_load(&ppool->isoom) && mr_split_fanout_jobs(ppool, &iter, true)) {
+        atomic_store(&ppool->isoom, true);
+    }
 
-                    if (raxNext(piter2)) { // same
-                        for (int i = 0; i < (choice + 1); i++) raxNext(piter2);
-                        size_t clen = piter2->key_len - iter->key_len;
-                        raxTryInsert(srax, piter2->key + iter->key_len, clen, NULL, NULL);
-                    }
-                }
-            }
+    if (ppool->jobs.len && ppool->jobs.len / sizeof(mr_fanout_job) < minjobs && !atomic_load(&ppool->isoom)) {
+        if (mr_split_fanout_jobs(ppool, &iter, false)) atomic_store(&ppool->isoom, true);
+    }
+
+    raxStop(&iter);
+
+    if (ppool->jobs.len && !atomic_load(&ppool->isoom)) {
+        pthread_mutex_lock(&ppool->lock);
+        ppool->numbusy = ppool->numworkers;
+        ppool->round++;
+        pthread_cond_broadcast(&ppool->start);
+        pthread_mutex_unlock(&ppool->lock);
+        mr_run_fanout_jobs(ppool, pbitmap);
+        pthread_mutex_lock(&ppool->lock);
+        while (ppool->numbusy) pthread_cond_wait(&ppool->done, &ppool->lock);
+        pthread_mutex_unlock(&ppool->lock);
+
+        for (size_t i = 0; i < ppool->numworkers; i++) {
+            if (mr_client_bitmap_merge(pbitmap, &ppool->workerv[i].bitmap)) atomic_store(&ppool->isoom, true);
         }
+    }
 
-        raxStop(piter2);
+    if (atomic_load(&ppool->isoom)) {
+        errno = ENOMEM;
+        return -1;
     }
 
     return 0;
 }
 
-static int mr_probe_subscriptions(
-    raxIterator* iter, rax* srax, const size_t max_len, char* topic, int level, char** tokenv, size_t numtokens
-) {
-    char test_key[max_len];
-    char* token;
+// one matching subscribe topic's client subtree, or the rax of picked share members
+typedef struct mr_match_source {
+    raxIterator iter;
+    size_t prefixlen; // the client's VBI follows
+} mr_match_source;
+
+struct mr_match_cursor {
+    mr_match_source* sourcev;
+    size_t numsources;
+    size_t* heapv; // sources with a current client: a min heap by their client key
+    size_t numheap;
+    rax* shares; // the picked member of each matching share group, keyed by VBI
+    uint8_t lastv[NUMBYTES]; // the last client yielded
+    size_t lastlen;
+    // while matching
+    mr_buf keys; // <topic><0xff> prefixes end to end
+    mr_buf offsets; // size_t offset of each prefix in keys
+    bool isoom;
+};
+
+static inline uint8_t* mr_match_source_client(mr_match_source* psource, size_t* plen) {
+    *plen = psource->iter.key_len - psource->prefixlen;
+    return psource->iter.key + psource->prefixlen;
+}
 
-    while (level < numtokens) {
-        snprintf(test_key, max_len, "%s#", topic);
-        if (raxFindRelative(iter, (uint8_t*)test_key, strlen(test_key)) != raxNotFound) {
-            mr_get_topic_clients(iter, srax, (uint8_t*)test_key, strlen(test_key));
-        }
+// rax order: bytewise with a prefix before the keys it starts
+static int mr_compare_sources(mr_match_cursor* pcursor, size_t a, size_t b) {
+    size_t alen, blen;
+    uint8_t* pa = mr_match_source_client(&pcursor->sourcev[a], &alen);
+    uint8_t* pb = mr_match_source_client(&pcursor->sourcev[b], &blen);
+    int cmp = memcmp(pa, pb, alen < blen ? alen : blen);
+    return cmp ? cmp : (alen > blen) - (alen < blen);
+}
 
-        if (level == (numtokens - 1)) break; // only '#' is valid at this level
+static void mr_sift_down_source(mr_match_cursor* pcursor, size_t i) {
+    size_t* heapv = pcursor->heapv;
+
+    while (true) {
+        size_t min = i, left = 2 * i + 1, right = left + 1;
+        if (left < pcursor->numheap && mr_compare_sources(pcursor, heapv[left], heapv[min]) < 0) min = left;
+        if (right < pcursor->numheap && mr_compare_sources(pcursor, heapv[right], heapv[min]) < 0) min = right;
+        if (min == i) break;
+        size_t tmp = heapv[i];
+        heapv[i] = heapv[min];
+        heapv[min] = tmp;
+        i = min;
+    }
+}
 
-        snprintf(test_key, max_len, "%s+", topic);
-        if (raxFindRelative(iter, (uint8_t*)test_key, strlen(test_key)) != raxNotFound) {
-            if (level == (numtokens - 2)) {
-                mr_get_topic_clients(iter, srax, (uint8_t*)test_key, strlen(test_key));
-            }
-            else {
-                char *token2v[numtokens];
-                for (int i = 0; i < numtokens; i++) token2v[i] = tokenv[i];
-                token2v[level + 1] = "+";
-                mr_probe_subscriptions(iter, srax, max_len, test_key, level + 1, token2v, numtokens);
-            }
-        }
+static int mr_cursor_add_client(mr_sink* psink, uint8_t* clientv, size_t clen) {
+    mr_match_cursor* pcursor = psink->ctx;
+    if (!raxTryInsert(pcursor->shares, clientv, clen, NULL, NULL) && errno == ENOMEM) pcursor->isoom = true;
+    return 0;
+}
 
-        token = tokenv[level + 1];
-        strlcat(topic, token, max_len);
-        strlcpy(test_key, topic, max_len);
-        if (raxFindRelative(iter, (uint8_t*)test_key, strlen(test_key)) != raxNotFound) {
-            if (level == (numtokens - 2)) {
-                mr_get_topic_clients(iter, srax, (uint8_t*)test_key, strlen(topic));
-            }
-        }
-        else break; // no more possible matches
+// note where each client subtree starts: its iterator can't be started until the sources stop moving
+static int mr_cursor_topic_clients(mr_sink* psink, raxIterator* piter, uint8_t* key, size_t key_len) {
+    mr_match_cursor* pcursor = psink->ctx;
+    key[key_len] = client_mark;
+    void* count = raxFindRelative(piter, key, key_len + 1);
 
-        level++;
+    if (count != raxNotFound && (uintptr_t)count) {
+        size_t offset = pcursor->keys.len;
+
+        if (mr_buf_append(&pcursor->keys, key, key_len + 1) || mr_buf_append(&pcursor->offsets, &offset, sizeof(size_t))) {
+            pcursor->isoom = true;
+        }
     }
 
-    return 0;
+    return mr_get_share_clients(piter, psink, key, key_len);
 }
 
-int mr_get_subscribed_clients(rax* topic_tree, rax* srax, const char* pubtopic) {
-    char* tokenv[MAX_TOKENS];
-    size_t ptlen = strlen(pubtopic);
-    char topic[ptlen + 3];
-    mr_get_normalized_topic(pubtopic, topic, NULL);
-    size_t tlen = strlen(topic);
-    char topic3[tlen + 1];
-    strlcpy(topic3, topic, tlen + 1);
-    size_t numtokens = mr_tokenize_topic(topic3, tokenv); // modifies topic3 and points into it from tokenv
+void mr_match_cursor_free(mr_match_cursor* pcursor) {
+    if (pcursor == NULL) return;
+    for (size_t i = 0; i < pcursor->numsources; i++) raxStop(&pcursor->sourcev[i].iter);
+    rax_free(pcursor->sourcev);
+    rax_free(pcursor->heapv);
+    if (pcursor->shares) raxFree(pcursor->shares);
+    rax_free(pcursor->keys.data);
+    rax_free(pcursor->offsets.data);
+    rax_free(pcursor);
+}
+
+// the matching clients without gathering them: a k-way merge of the matching subscribe topics' client subtrees,
+// each already in order, that drops duplicates as they meet - memory is per matching subscribe topic, not per client,
+// & share members are picked when the cursor is made. The topic tree must not change until the cursor is freed
+mr_match_cursor* mr_match_cursor_new(rax* topic_tree, const char* pubtopic) {
+    mr_scratch mark = mr_scratch_mark();
+    char topicbuf[MR_STACK_TOPIC_LEN];
+    char* topic = mr_normalize_pubtopic(pubtopic, topicbuf, sizeof(topicbuf));
+    mr_match_cursor* pcursor = NULL;
+
+    if (topic == NULL) {
+        mr_scratch_release(mark);
+        return NULL;
+    }
+
+    pcursor = rax_malloc(sizeof(mr_match_cursor));
+    if (pcursor == NULL) goto oom;
+    memset(pcursor, 0, sizeof(mr_match_cursor));
+    pcursor->shares = raxNewWithSlabs();
+    if (pcursor->shares == NULL) goto fail;
+    mr_sink sink = {mr_cursor_add_client, NULL, pcursor, 0, mr_cursor_topic_clients};
     raxIterator iter;
     raxStart(&iter, topic_tree);
-    strlcpy(topic, tokenv[0], tlen + 1);
+    if (mr_match_topic(&iter, &sink, topic)) pcursor->isoom = true;
+    raxStop(&iter);
+    mr_scratch_release(mark);
+    if (pcursor->isoom) goto fail;
+
+    size_t numkeys = pcursor->offsets.len / sizeof(size_t);
+    pcursor->sourcev = rax_malloc((numkeys + 1) * sizeof(mr_match_source));
+    pcursor->heapv = rax_malloc((numkeys + 1) * sizeof(size_t));
+    if (pcursor->sourcev == NULL || pcursor->heapv == NULL) goto fail;
+    size_t* offsetv = (size_t*)pcursor->offsets.data;
+
+    for (size_t i = 0; i <= numkeys; i++) {
+        mr_match_source* psource = &pcursor->sourcev[pcursor->numsources++];
+
+        if (i < numkeys) {
+            uint8_t* key = pcursor->keys.data + offsetv[i];
+            psource->prefixlen = (i + 1 < numkeys ? offsetv[i + 1] : pcursor->keys.len) - offsetv[i];
+            raxStart(&psource->iter, topic_tree);
+            raxSeekSubtree(&psource->iter, key, psource->prefixlen);
+            raxNext(&psource->iter); // skip the client count
+        }
+        else {
+            psource->prefixlen = 0;
+            raxStart(&psource->iter, pcursor->shares);
+            raxSeek(&psource->iter, "^", NULL, 0);
+        }
 
-    if (raxFindRelative(&iter, (uint8_t*)topic, strlen(topic)) != raxNotFound) {
-        mr_probe_subscriptions(&iter, srax, tlen + 1, topic, 0, tokenv, numtokens);
+        if (raxNext(&psource->iter)) pcursor->heapv[pcursor->numheap++] = i;
+    }
+
+    for (size_t i = pcursor->numheap / 2; i-- > 0;) mr_sift_down_source(pcursor, i);
+    rax_free(pcursor->keys.data);
+    rax_free(pcursor->offsets.data);
+    memset(&pcursor->keys, 0, sizeof(mr_buf));
+    memset(&pcursor->offsets, 0, sizeof(mr_buf));
+    return pcursor;
+
+fail:
+    mr_match_cursor_free(pcursor);
+
+oom:
+    mr_scratch_release(mark);
+    errno = ENOMEM;
+    return NULL;
+}
+
+// in the order of the subscribe topics' client keys - ascending for Client IDs of the same VBI length
+int mr_match_cursor_next(mr_match_cursor* pcursor, uint64_t* pclient) {
+    while (pcursor->numheap) {
+        mr_match_source* psource = &pcursor->sourcev[pcursor->heapv[0]];
+        size_t clen;
+        uint8_t* clientv = mr_match_source_client(psource, &clen);
+        bool isdup = clen == pcursor->lastlen && !memcmp(clientv, pcursor->lastv, clen);
+
+        if (!isdup) {
+            memcpy(pcursor->lastv, clientv, clen);
+            pcursor->lastlen = clen;
+            mr_extract_BEVBI(clientv, clen, pclient);
+        }
+
+        if (!raxNext(&psource->iter)) pcursor->heapv[0] = pcursor->heapv[--pcursor->numheap];
+        mr_sift_down_source(pcursor, 0);
+        if (!isdup) return 1;
     }
 
-    raxStop(&iter);
     return 0;
 }
 
@@ -576,6 +3060,90 @@ int mr_get_topic_by_alias(rax* client_tree, const uint64_t client, const bool is
     return 0;
 }
 
+// topic aliases by interned topic ID: <Client ID><Client Mark>"aliases"<source>"ita"<ID> holds the alias and
+// <Client ID><Client Mark>"aliases"<source>"ati"<alias> holds the ID + 1 - both in the value slot, so a lookup is
+// one raxFind & the inversion pair holds 4 bytes instead of 2 copies of the topic
+static size_t mr_make_alias_id_key(uint8_t* key, const uint64_t client, const bool isclient, const char* kind) {
+    size_t clen = mr_make_BEVBI(client, key);
+    key[clen] = client_mark;
+    memcpy(key + clen + 1, "aliases", 7);
+    memcpy(key + clen + 1 + 7, isclient ? "client" : "server", 6);
+    memcpy(key + clen + 1 + 7 + 6, kind, 3);
+    return clen + 17;
+}
+
+static size_t mr_make_ita_key(uint8_t* key, const uint64_t client, const bool isclient, const uint32_t id) {
+    size_t len = mr_make_alias_id_key(key, client, isclient, "ita");
+    for (int i = 0; i < 4; i++) key[len + i] = id >> (8 * (3 - i)); // big endian
+    return len + 4;
+}
+
+static size_t mr_make_ati_key(uint8_t* key, const uint64_t client, const bool isclient, const uint8_t alias) {
+    size_t len = mr_make_alias_id_key(key, client, isclient, "ati");
+    key[len] = alias;
+    return len + 1;
+}
+
+int mr_upsert_client_topic_alias_id(
+    rax* client_tree, const uint64_t client, const bool isclient, const uint32_t id, const uint8_t alias
+) {
+    uint8_t ita[NUMBYTES + 17 + 4];
+    size_t italen = mr_make_ita_key(ita, client, isclient, id);
+    uint8_t ati[NUMBYTES + 17 + 1];
+    size_t atilen = mr_make_ati_key(ati, client, isclient, alias);
+    size_t clen = atilen - 17 - 1;
+
+    // common - the subtree keys mr_remove_client_topic_aliases removes from
+    raxTryInsert(client_tree, ita, clen + 1, NULL, NULL);
+    raxTryInsert(client_tree, ita, clen + 1 + 7, NULL, NULL);
+    raxTryInsert(client_tree, ita, clen + 1 + 7 + 6, NULL, NULL);
+
+    // drop the pairs this one replaces: the alias's old topic & the topic's old alias
+    void* oldid = raxFind(client_tree, ati, atilen);
+
+    if (oldid != raxNotFound) {
+        uint8_t ita2[NUMBYTES + 17 + 4];
+        raxRemove(client_tree, ita2, mr_make_ita_key(ita2, client, isclient, (uintptr_t)oldid - 1), NULL);
+    }
+
+    void* oldalias = raxFind(client_tree, ita, italen);
+
+    if (oldalias != raxNotFound) {
+        uint8_t ati2[NUMBYTES + 17 + 1];
+        raxRemove(client_tree, ati2, mr_make_ati_key(ati2, client, isclient, (uintptr_t)oldalias), NULL);
+    }
+
+    if (!raxInsert(client_tree, ita, italen, (void*)(uintptr_t)alias, NULL) && errno == ENOMEM) return -1;
+
+    if (!raxInsert(client_tree, ati, atilen, (void*)((uintptr_t)id + 1), NULL) && errno == ENOMEM) {
+        raxRemove(client_tree, ita, italen, NULL);
+        return -1;
+    }
+
+    return 0;
+}
+
+int mr_get_alias_by_topic_id(rax* client_tree, const uint64_t client, const bool isclient, const uint32_t id, uint8_t* palias) {
+    uint8_t ita[NUMBYTES + 17 + 4];
+    void* alias = raxFind(client_tree, ita, mr_make_ita_key(ita, client, isclient, id));
+    *palias = alias == raxNotFound ? 0 : (uintptr_t)alias;
+    return 0;
+}
+
+// -1 with errno ENOENT if the alias isn't set
+int mr_get_topic_id_by_alias(rax* client_tree, const uint64_t client, const bool isclient, const uint8_t alias, uint32_t* pid) {
+    uint8_t ati[NUMBYTES + 17 + 1];
+    void* id = raxFind(client_tree, ati, mr_make_ati_key(ati, client, isclient, alias));
+
+    if (id == raxNotFound) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *pid = (uintptr_t)id - 1;
+    return 0;
+}
+
 int mr_remove_client_data(rax* topic_tree, rax* client_tree, uint64_t client) {
     mr_remove_client_subscriptions(topic_tree, client_tree, client);
     uint8_t clientv[NUMBYTES] = {0};
@@ -583,3 +3151,400 @@ int mr_remove_client_data(rax* topic_tree, rax* client_tree, uint64_t client) {
     raxRemoveSubtree(client_tree, clientv, clen);
     return 0;
 }
+
+// a subscription restored by mr_restore_subscriptions: its client key in the topic or client tree, each of whose other
+// keys is a prefix of it. Offsets into the restore's bytes until they are all in, pointers after
+typedef struct mr_restore_key {
+    uint8_t* key;
+    size_t len;
+    size_t tklen; // topic tree: the topic key's length, client tree: the Client ID's
+    size_t marklen; // topic tree: the length up to the <0xff> before the Client ID
+    uint64_t client;
+    char* topic; // the normalized topic: for the topic tree's levels & the client tree's filter counts
+} mr_restore_key;
+
+// a topic level key, a prefix of a topic tree client key: the level keys of all the subscriptions are sorted apart as
+// with concatenated keys, the level keys of a topic can't be told from its topic key
+typedef struct mr_restore_level {
+    uint8_t* key;
+    size_t len;
+    uintptr_t flags; // the wildcard levels directly below it
+} mr_restore_level;
+
+typedef struct mr_restore {
+    mr_buf bytes;
+    mr_buf topicv; // mr_restore_key
+    mr_buf clientv; // mr_restore_key
+    mr_buf levelv; // mr_restore_level
+    mr_buf groupv; // mr_share_group*, in the order of their keys
+    // the keys being loaded: those of the client keys & levels, merged in order
+    mr_topic_tree_info* pinfo; // NULL for the client tree
+    mr_restore_key* keyv;
+    size_t numkeys;
+    size_t cur; // the current client key
+    size_t lcp; // the length of the current client key shared with the last one
+    size_t numprefixes; // of the current client key's prefixes, those loaded or shared with the last one
+    mr_restore_level* levelp;
+    mr_restore_level* levelend;
+    size_t nextgroup;
+    mr_share_group* pgroup; // of the current shared client key
+} mr_restore;
+
+static int mr_compare_restore_keys(const void* pa, const void* pb) {
+    const mr_restore_key* a = pa;
+    const mr_restore_key* b = pb;
+    int cmp = memcmp(a->key, b->key, a->len < b->len ? a->len : b->len);
+    return cmp ? cmp : (a->len > b->len) - (a->len < b->len);
+}
+
+static int mr_compare_restore_levels(const void* pa, const void* pb) {
+    const mr_restore_level* a = pa;
+    const mr_restore_level* b = pb;
+    int cmp = memcmp(a->key, b->key, a->len < b->len ? a->len : b->len);
+    return cmp ? cmp : (a->len > b->len) - (a->len < b->len);
+}
+
+// sort keys with their offsets made pointers
+static void mr_sort_restore_keys(mr_restore* prs, mr_buf* pkeys) {
+    mr_restore_key* keyv = (mr_restore_key*)pkeys->data;
+    size_t numkeys = pkeys->len / sizeof(mr_restore_key);
+
+    for (size_t i = 0; i < numkeys; i++) {
+        keyv[i].key = prs->bytes.data + (uintptr_t)keyv[i].key;
+        if (keyv[i].topic) keyv[i].topic = (char*)prs->bytes.data + (uintptr_t)keyv[i].topic - 1;
+    }
+
+    if (numkeys) qsort(keyv, numkeys, sizeof(mr_restore_key), mr_compare_restore_keys);
+}
+
+// drop repeats from sorted keys
+static void mr_drop_restore_repeats(mr_buf* pkeys) {
+    mr_restore_key* keyv = (mr_restore_key*)pkeys->data;
+    size_t numkeys = pkeys->len / sizeof(mr_restore_key);
+    size_t n = 0;
+
+    for (size_t i = 0; i < numkeys; i++) {
+        if (n && !mr_compare_restore_keys(&keyv[n - 1], &keyv[i])) continue;
+        keyv[n++] = keyv[i];
+    }
+
+    pkeys->len = n * sizeof(mr_restore_key);
+}
+
+// the level keys of each topic, sorted & merged: each is a prefix of a topic tree client key. Run before repeats are
+// dropped, as topics whose keys concatenate the same - foo/bar & foob/ar - each add their own levels
+static int mr_make_restore_levels(mr_restore* prs, size_t sep) {
+    mr_restore_key* keyv = (mr_restore_key*)prs->topicv.data;
+    size_t numkeys = prs->topicv.len / sizeof(mr_restore_key);
+
+    for (size_t i = 0; i < numkeys; i++) {
+        if (i && !strcmp(keyv[i].topic, keyv[i - 1].topic)) continue;
+        const char* pc = keyv[i].topic;
+        const char* pend = pc + strlen(pc);
+        size_t len = 0;
+
+        for (int j = 0; ; j++) {
+            const char* psep = mr_find_separator(pc, pend);
+            size_t toklen = psep - pc;
+            int flag = mr_wildcard_flag(pc, toklen);
+
+            if (flag && j) { // the level above was the last one added
+                mr_restore_level* plevel = (mr_restore_level*)(prs->levelv.data + prs->levelv.len) - 1;
+                plevel->flags |= flag;
+            }
+
+            len += (j ? sep : 0) + toklen;
+            mr_restore_level level = {keyv[i].key, len, 0};
+            if (mr_buf_append(&prs->levelv, &level, sizeof(level))) return -1;
+            if (psep == pend) break;
+            pc = psep + 1;
+        }
+    }
+
+    mr_restore_level* levelv = (mr_restore_level*)prs->levelv.data;
+    size_t numlevels = prs->levelv.len / sizeof(mr_restore_level);
+    if (numlevels) qsort(levelv, numlevels, sizeof(mr_restore_level), mr_compare_restore_levels);
+    size_t n = 0;
+
+    for (size_t i = 0; i < numlevels; i++) {
+        if (n && !mr_compare_restore_levels(&levelv[n - 1], &levelv[i])) {
+            levelv[n - 1].flags |= levelv[i].flags;
+            continue;
+        }
+
+        levelv[n++] = levelv[i];
+    }
+
+    prs->levelv.len = n * sizeof(mr_restore_level);
+    return 0;
+}
+
+// the lengths of the keys a client key is the last of: for the client tree <Client ID><0xff> & <Client ID><0xff>"subs",
+// for the topic tree <0xff>, or <0xfe>, <0xfe>share & <0xfe>share<0xff>. Returns how many
+static size_t mr_restore_prefixes(mr_restore* prs, mr_restore_key* pkey, size_t* lenv) {
+    size_t n = 0;
+
+    if (prs->pinfo == NULL) {
+        lenv[n++] = pkey->tklen + 1;
+        lenv[n++] = pkey->tklen + 1 + 4;
+    }
+    else if (pkey->key[pkey->tklen] == shared_mark) {
+        lenv[n++] = pkey->tklen + 1;
+        lenv[n++] = pkey->marklen - 1;
+        lenv[n++] = pkey->marklen;
+    }
+    else lenv[n++] = pkey->marklen;
+
+    lenv[n++] = pkey->len;
+    return n;
+}
+
+// the groups of the shared subscriptions to a topic, made when its <0xfe> key is loaded: one for each share name in the
+// client keys from the current one that have its prefix. Returns the first, linked to the others
+static mr_share_group* mr_restore_share_groups(mr_restore* prs, size_t prefixlen) {
+    mr_share_group* phead = NULL;
+    mr_share_group* plast = NULL;
+
+    for (size_t i = prs->cur; i < prs->numkeys; i++) {
+        mr_restore_key* pkey = &prs->keyv[i];
+        if (pkey->len < prefixlen || memcmp(pkey->key, prs->keyv[prs->cur].key, prefixlen)) break;
+        mr_restore_key* plastkey = i > prs->cur ? pkey - 1 : NULL;
+        if (plastkey && plastkey->marklen == pkey->marklen && !memcmp(plastkey->key, pkey->key, pkey->marklen)) continue;
+        mr_share_group* pgroup = rax_malloc(sizeof(mr_share_group));
+        if (pgroup == NULL || mr_buf_append(&prs->groupv, &pgroup, sizeof(pgroup))) {
+            rax_free(pgroup);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        memset(pgroup, 0, sizeof(mr_share_group));
+        pgroup->prev = plast;
+        if (plast) plast->next = pgroup;
+        else phead = pgroup;
+        plast = pgroup;
+    }
+
+    return phead;
+}
+
+// the value of the prefix of the current client key at position n of its prefixes
+static int mr_restore_value(mr_restore* prs, size_t n, size_t numprefixes, void** pdata) {
+    mr_restore_key* pkey = &prs->keyv[prs->cur];
+    *pdata = NULL;
+    if (prs->pinfo == NULL) return 0; // client tree
+    bool isshared = pkey->key[pkey->tklen] == shared_mark;
+
+    if (n == numprefixes - 1) { // the client key
+        if (!isshared) return 0;
+        if (mr_share_add_member(prs->pgroup, pkey->client)) return -1;
+        *pdata = (void*)(uintptr_t)prs->pgroup->nummembers;
+    }
+    else if (!isshared) { // <0xff>: the number of regular clients beneath it
+        size_t count = 0;
+
+        for (size_t i = prs->cur; i < prs->numkeys; i++, count++) {
+            mr_restore_key* pnext = &prs->keyv[i];
+            if (pnext->len < pkey->marklen || memcmp(pnext->key, pkey->key, pkey->marklen)) break;
+        }
+
+        *pdata = (void*)(uintptr_t)count;
+    }
+    else if (n == 0) { // <0xfe>
+        mr_share_group* phead = mr_restore_share_groups(prs, pkey->tklen + 1);
+        if (phead == NULL) return -1;
+        *pdata = phead;
+    }
+    else if (n == 2) { // <0xfe>share<0xff>
+        prs->pgroup = ((mr_share_group**)prs->groupv.data)[prs->nextgroup++];
+        *pdata = prs->pgroup;
+    }
+
+    return 0;
+}
+
+// the prefixes of the current client key, moving on to the next one once those it doesn't share with the last one are
+// loaded: sets their lengths & returns how many, 0 at the end
+static size_t mr_restore_current(mr_restore* prs, size_t* lenv) {
+    while (prs->cur < prs->numkeys) {
+        size_t numprefixes = mr_restore_prefixes(prs, &prs->keyv[prs->cur], lenv);
+        while (prs->numprefixes < numprefixes && lenv[prs->numprefixes] <= prs->lcp) prs->numprefixes++;
+        if (prs->numprefixes < numprefixes) return numprefixes;
+        mr_restore_key* plast = &prs->keyv[prs->cur++];
+        mr_restore_key* pnext = plast + 1;
+        prs->numprefixes = 0;
+        prs->lcp = 0;
+        if (prs->cur == prs->numkeys) break;
+        while (prs->lcp < plast->len && prs->lcp < pnext->len && plast->key[prs->lcp] == pnext->key[prs->lcp]) prs->lcp++;
+    }
+
+    return 0;
+}
+
+// raxBulkNextFunc: the client keys with their prefixes merged with the level keys, all in order
+static int mr_restore_next(void* privdata, unsigned char** pkey, size_t* plen, void** pdata) {
+    mr_restore* prs = privdata;
+    size_t lenv[4];
+    size_t numprefixes = mr_restore_current(prs, lenv);
+    bool haskey = numprefixes != 0;
+    mr_restore_key* pcur = haskey ? &prs->keyv[prs->cur] : NULL;
+    size_t curlen = haskey ? lenv[prs->numprefixes] : 0;
+
+    if (prs->levelp < prs->levelend) {
+        mr_restore_level* plevel = prs->levelp;
+        int cmp = 0;
+
+        if (haskey) {
+            cmp = memcmp(plevel->key, pcur->key, plevel->len < curlen ? plevel->len : curlen);
+            if (!cmp) cmp = plevel->len < curlen ? -1 : 1; // a level key has no mark so they're never equal
+        }
+
+        if (!haskey || cmp < 0) {
+            *pkey = plevel->key;
+            *plen = plevel->len;
+            *pdata = mr_make_level(++prs->pinfo->generation, plevel->flags);
+            prs->levelp++;
+            return 1;
+        }
+    }
+
+    if (!haskey) return 0;
+    *pkey = pcur->key;
+    *plen = curlen;
+    if (mr_restore_value(prs, prs->numprefixes, numprefixes, pdata)) return -1;
+    prs->numprefixes++;
+    return 1;
+}
+
+// load the sorted client keys, & the levels for the topic tree whose info is given, into an empty tree
+static int mr_restore_load(mr_restore* prs, rax* tree, mr_buf* pkeys, mr_topic_tree_info* pinfo) {
+    prs->pinfo = pinfo;
+    prs->keyv = (mr_restore_key*)pkeys->data;
+    prs->numkeys = pkeys->len / sizeof(mr_restore_key);
+    prs->cur = 0;
+    prs->lcp = 0;
+    prs->numprefixes = 0;
+    prs->levelp = pinfo ? (mr_restore_level*)prs->levelv.data : NULL;
+    prs->levelend = pinfo ? prs->levelp + prs->levelv.len / sizeof(mr_restore_level) : NULL;
+    prs->nextgroup = 0;
+    return raxBulkLoadWithCallback(tree, mr_restore_next, prs) ? 0 : -1;
+}
+
+static void mr_restore_free(mr_restore* prs) {
+    rax_free(prs->bytes.data);
+    rax_free(prs->topicv.data);
+    rax_free(prs->clientv.data);
+    rax_free(prs->levelv.data);
+    rax_free(prs->groupv.data);
+}
+
+// add a subscription's client keys: <topic key>[<0xfe>share]<0xff><Client ID> for the topic tree & <Client ID><0xff>
+// "subs"<Subscribe Topic> for the client tree. Key & topic pointers are offsets for now, the topic's one past it
+static int mr_restore_subscription(mr_restore* prs, rax* topic_tree, const char* subtopic, const uint64_t client) {
+    mr_scratch mark = mr_scratch_mark();
+    int rc = -1;
+    mr_subscribe_topic sub;
+    if (mr_normalize_subscribe_topic(topic_tree, subtopic, &sub)) goto done;
+    uint8_t clientv[NUMBYTES];
+    size_t clen = mr_make_BEVBI(client, clientv);
+
+    mr_restore_key topic_key = {(uint8_t*)prs->bytes.len, 0, sub.tklen, 0, client, NULL};
+    if (mr_buf_append(&prs->bytes, sub.topic_key, sub.tklen)) goto oom;
+
+    if (sub.slen) {
+        if (mr_buf_append(&prs->bytes, &shared_mark, 1) || mr_buf_append(&prs->bytes, sub.share, sub.slen)) goto oom;
+    }
+
+    if (mr_buf_append(&prs->bytes, &client_mark, 1)) goto oom;
+    topic_key.marklen = prs->bytes.len - (uintptr_t)topic_key.key;
+    if (mr_buf_append(&prs->bytes, clientv, clen)) goto oom;
+    topic_key.len = prs->bytes.len - (uintptr_t)topic_key.key;
+    topic_key.topic = (char*)(prs->bytes.len + 1);
+    if (mr_buf_append(&prs->bytes, sub.topic, strlen(sub.topic) + 1)) goto oom;
+    if (mr_buf_append(&prs->topicv, &topic_key, sizeof(topic_key))) goto oom;
+
+    size_t stlen = strlen(subtopic);
+    mr_restore_key client_key = {(uint8_t*)prs->bytes.len, 0, clen, 0, client, topic_key.topic};
+    if (mr_buf_append(&prs->bytes, clientv, clen) || mr_buf_append(&prs->bytes, &client_mark, 1)) goto oom;
+    if (mr_buf_append(&prs->bytes, "subs", 4)) goto oom;
+    uint8_t topicbuf[MR_STACK_TOPIC_LEN];
+    uint8_t* inverted = mr_stack_or_scratch(topicbuf, sizeof(topicbuf), stlen + 1);
+    if (inverted == NULL) goto done;
+    size_t itlen = mr_invert_subscribe_topic(topic_tree, subtopic, stlen, inverted);
+    if (mr_buf_append(&prs->bytes, inverted, itlen)) goto oom;
+    client_key.len = prs->bytes.len - (uintptr_t)client_key.key;
+    if (mr_buf_append(&prs->clientv, &client_key, sizeof(client_key))) goto oom;
+    rc = 0;
+    goto done;
+
+oom:
+    errno = ENOMEM;
+done:
+    mr_scratch_release(mark);
+    return rc;
+}
+
+// as mr_insert_subscription for each subscribe topic & client of the arrays, into a topic tree & client tree holding no
+// subscriptions, for a broker restart: the keys of all the subscriptions are sorted & each tree is built in one pass by
+// raxBulkLoad. -1 with errno EINVAL if a subscribe topic is invalid or a tree isn't empty, or ENOMEM, with both unchanged
+int mr_restore_subscriptions(
+    rax* topic_tree, rax* client_tree, const char* const* subtopicv, const uint64_t* clientv, size_t numsubs
+) {
+    bool hadinfo = raxFind(topic_tree, (uint8_t*)"", 0) != raxNotFound; // else it goes again on failure
+    mr_topic_tree_info* pinfo = mr_get_topic_tree_info(topic_tree, MR_KEY_CONCATENATED);
+
+    if (pinfo == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    mr_restore rs = {0};
+    int rc = -1;
+
+    if (topic_tree->numele != 1 || client_tree->numele != 0) {
+        errno = EINVAL;
+        goto done;
+    }
+
+    for (size_t i = 0; i < numsubs; i++) {
+        if (mr_restore_subscription(&rs, topic_tree, subtopicv[i], clientv[i])) goto done;
+    }
+
+    mr_sort_restore_keys(&rs, &rs.topicv);
+    mr_sort_restore_keys(&rs, &rs.clientv);
+
+    if (mr_make_restore_levels(&rs, pinfo->encoding == MR_KEY_DELIMITED)) {
+        errno = ENOMEM;
+        goto done;
+    }
+
+    mr_drop_restore_repeats(&rs.topicv);
+    mr_drop_restore_repeats(&rs.clientv);
+
+    if (mr_restore_load(&rs, client_tree, &rs.clientv, NULL)) goto done;
+
+    if (mr_restore_load(&rs, topic_tree, &rs.topicv, pinfo)) { // the topic tree keeps its info in the empty key
+        int err = errno;
+        mr_share_group** groupv = (mr_share_group**)rs.groupv.data;
+        for (size_t i = 0; i < rs.groupv.len / sizeof(mr_share_group*); i++) mr_share_group_free(groupv[i]);
+        raxRemoveSubtree(client_tree, (uint8_t*)"", 0);
+        errno = err;
+        goto done;
+    }
+
+    // the filter counts each Client ID & subscribe topic once, as the client tree holds them
+    mr_restore_key* keyv = (mr_restore_key*)rs.clientv.data;
+    for (size_t i = 0; i < rs.clientv.len / sizeof(mr_restore_key); i++) mr_count_subscription(pinfo, keyv[i].topic, 1);
+    rc = 0;
+
+done:
+    mr_restore_free(&rs);
+
+    if (rc && !hadinfo) {
+        int err = errno;
+        raxRemove(topic_tree, (uint8_t*)"", 0, NULL);
+        rax_free(pinfo);
+        errno = err;
+    }
+
+    return rc;
+}
@@ -39,6 +39,10 @@
 #include <ctype.h>
 #include "mr_rax/rax.h"
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #ifndef RAX_MALLOC_INCLUDE
 #define RAX_MALLOC_INCLUDE "mr_rax/rax_malloc.h"
 #endif
@@ -147,6 +151,275 @@ static inline void raxStackFree(raxStack *ts) {
     if (ts->stack != ts->static_items) rax_free(ts->stack);
 }
 
+/* ------------------------- Child byte search ---------------------------
+ * The child bytes of a non compressed node are sorted, so both looking a
+ * byte up and finding where it would go are finding the first child byte
+ * that is >= it. Small nodes are scanned one byte at a time; larger ones,
+ * like the client ID fan-out nodes of mr_rax, are compared 16 bytes at a
+ * time with SSE2 or 32 with AVX2. The level is the best the CPU supports,
+ * detected when the library is loaded, and raxSetSimdLevel() can lower it.
+ *
+ * The last block of a node is loaded so that it ends with the node's last
+ * byte, overlapping the block before: the bytes compared twice are all
+ * known to be < the searched byte so they can't match again.
+ * ------------------------------------------------------------------------- */
+
+#define RAX_SIMD_MIN_SIZE 16 /* Smaller nodes are scanned one byte at a time. */
+
+static int raxSimdLevel = RAX_SIMD_NONE;
+
+static int raxSimdSupported(void) {
+#if defined(__SSE2__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return RAX_SIMD_AVX2;
+    return RAX_SIMD_SSE2;
+#else
+    return RAX_SIMD_NONE;
+#endif
+}
+
+__attribute__((constructor)) static void raxSimdInit(void) {
+    raxSimdLevel = raxSimdSupported();
+}
+
+/* Use at most 'level' of RAX_SIMD_NONE, RAX_SIMD_SSE2 or RAX_SIMD_AVX2 for
+ * child byte search, returning the level in effect since it can't be more
+ * than the CPU supports. Not thread safe: set it before using any rax. */
+int raxSetSimdLevel(int level) {
+    int supported = raxSimdSupported();
+    raxSimdLevel = level < supported ? level : supported;
+    return raxSimdLevel;
+}
+
+static inline int raxChildGEScalar(unsigned char *v, int size, unsigned char c) {
+    int j;
+    for (j = 0; j < size; j++) {
+        if (v[j] >= c) break;
+    }
+    return j;
+}
+
+#if defined(__SSE2__)
+/* v[j] >= c as the max of the two being v[j], in unsigned bytes. */
+static inline int raxChildGESSE2(unsigned char *v, int size, unsigned char c) {
+    __m128i cv = _mm_set1_epi8((char)c);
+    int j = 0;
+
+    while (1) {
+        if (j > size - 16) j = size - 16;
+        __m128i bytes = _mm_loadu_si128((__m128i*)(v + j));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(bytes, cv), bytes));
+        if (mask) return j + __builtin_ctz(mask);
+        if (j == size - 16) return size;
+        j += 16;
+    }
+}
+
+__attribute__((target("avx2")))
+static int raxChildGEAVX2(unsigned char *v, int size, unsigned char c) {
+    __m256i cv = _mm256_set1_epi8((char)c);
+    int j = 0;
+
+    while (1) {
+        if (j > size - 32) j = size - 32;
+        __m256i bytes = _mm256_loadu_si256((__m256i*)(v + j));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(bytes, cv), bytes));
+        if (mask) return j + __builtin_ctz(mask);
+        if (j == size - 32) return size;
+        j += 32;
+    }
+}
+#endif
+
+/* The index of the first child byte of the sorted node 'n' that is >= 'c',
+ * or n->size if there is none. */
+static inline int raxChildGE(raxNode *n, unsigned char c) {
+    int size = n->size;
+#if defined(__SSE2__)
+    if (size >= RAX_SIMD_MIN_SIZE && raxSimdLevel != RAX_SIMD_NONE) {
+        if (size >= 32 && raxSimdLevel == RAX_SIMD_AVX2) return raxChildGEAVX2(n->data, size, c);
+        return raxChildGESSE2(n->data, size, c);
+    }
+#endif
+    return raxChildGEScalar(n->data, size, c);
+}
+
+/* ----------------------------------------------------------------------------
+ * Node allocation
+ * ----------------------------------------------------------------------------
+ *
+ * Nodes are allocated with rax_malloc() unless the tree has its own
+ * raxAllocator. The built-in one is a slab allocator: blocks are carved
+ * from slabs that double in size up to RAX_SLAB_MAX_LEN, in size classes
+ * of 8 bytes (node lengths are always a multiple of 8) up to the length of
+ * a direct node, with a free list per class. Longer nodes, that is long
+ * compressed nodes, are allocated one by one with a header linking them so
+ * that they can be released as well. Freed blocks are only reused by the
+ * same tree, and its memory goes back when the whole tree is freed, in one
+ * step per slab instead of one per node.
+ * ------------------------------------------------------------------------- */
+
+#define RAX_SLAB_MIN_LEN 4096
+#define RAX_SLAB_MAX_LEN (1<<20)
+#define RAX_SLAB_MAX_BLOCK (8+sizeof(void*)*257) /* Direct node with data. */
+#define RAX_SLAB_CLASSES (RAX_SLAB_MAX_BLOCK/8)
+
+typedef struct raxSlab {
+    struct raxSlab *next;
+    size_t len;
+} raxSlab;
+
+typedef struct raxLargeBlock {
+    struct raxLargeBlock *prev, *next;
+} raxLargeBlock;
+
+typedef struct raxSlabAllocator {
+    raxAllocator alloc;   /* Its ctx points back to this structure. */
+    void *freelist[RAX_SLAB_CLASSES];
+    char *cur, *end;      /* Unused part of the current slab. */
+    size_t nextlen;       /* Length of the next slab. */
+    raxSlab *slabs;
+    raxLargeBlock large;  /* List head of the blocks too long for a class. */
+} raxSlabAllocator;
+
+#define raxSlabRound(size) (((size)+7) & ~(size_t)7)
+
+static void *raxSlabMalloc(void *ctx, size_t size) {
+    raxSlabAllocator *sa = ctx;
+    size = size ? raxSlabRound(size) : 8;
+
+    if (size > RAX_SLAB_MAX_BLOCK) {
+        raxLargeBlock *lb = rax_malloc(sizeof(raxLargeBlock)+size);
+        if (lb == NULL) return NULL;
+        lb->prev = &sa->large;
+        lb->next = sa->large.next;
+        lb->next->prev = lb;
+        sa->large.next = lb;
+        return lb+1;
+    }
+
+    void **head = &sa->freelist[size/8-1];
+    if (*head) {
+        void *ptr = *head;
+        memcpy(head,ptr,sizeof(void*));
+        return ptr;
+    }
+
+    if ((size_t)(sa->end - sa->cur) < size) {
+        /* Keep what is left of the current slab as a free block. */
+        size_t left = sa->end - sa->cur;
+        if (left) {
+            memcpy(sa->cur,&sa->freelist[left/8-1],sizeof(void*));
+            sa->freelist[left/8-1] = sa->cur;
+        }
+
+        raxSlab *slab = rax_malloc(sa->nextlen);
+        if (slab == NULL) return NULL;
+        slab->next = sa->slabs;
+        slab->len = sa->nextlen;
+        sa->slabs = slab;
+        sa->cur = (char*)(slab+1);
+        sa->end = (char*)slab + slab->len;
+        if (sa->nextlen < RAX_SLAB_MAX_LEN) sa->nextlen *= 2;
+    }
+
+    void *ptr = sa->cur;
+    sa->cur += size;
+    return ptr;
+}
+
+/* A block freed with a size shorter than it was allocated with just goes to
+ * the free list of the shorter class, and a long block freed as a short one
+ * stays linked as long until the release. */
+static void raxSlabFree(void *ctx, void *ptr, size_t size) {
+    raxSlabAllocator *sa = ctx;
+    if (ptr == NULL) return;
+    size = size ? raxSlabRound(size) : 8;
+
+    if (size > RAX_SLAB_MAX_BLOCK) {
+        raxLargeBlock *lb = (raxLargeBlock*)ptr - 1;
+        lb->prev->next = lb->next;
+        lb->next->prev = lb->prev;
+        rax_free(lb);
+        return;
+    }
+
+    void **head = &sa->freelist[size/8-1];
+    memcpy(ptr,head,sizeof(void*));
+    *head = ptr;
+}
+
+static void *raxSlabRealloc(void *ctx, void *ptr, size_t oldsize, size_t size) {
+    if (ptr == NULL) return raxSlabMalloc(ctx,size);
+    size_t oldround = oldsize ? raxSlabRound(oldsize) : 8;
+    size_t round = size ? raxSlabRound(size) : 8;
+
+    if (oldround > RAX_SLAB_MAX_BLOCK && round > RAX_SLAB_MAX_BLOCK) {
+        raxLargeBlock *lb = (raxLargeBlock*)ptr - 1;
+        raxLargeBlock *newlb = rax_realloc(lb,sizeof(raxLargeBlock)+round);
+        if (newlb == NULL) return NULL;
+        newlb->prev->next = newlb;
+        newlb->next->prev = newlb;
+        return newlb+1;
+    }
+
+    if (oldround == round) return ptr;
+    void *newptr = raxSlabMalloc(ctx,size);
+    if (newptr == NULL) return NULL;
+    memcpy(newptr,ptr,oldsize < size ? oldsize : size);
+    raxSlabFree(ctx,ptr,oldsize);
+    return newptr;
+}
+
+static void raxSlabRelease(void *ctx) {
+    raxSlabAllocator *sa = ctx;
+
+    while (sa->slabs) {
+        raxSlab *next = sa->slabs->next;
+        rax_free(sa->slabs);
+        sa->slabs = next;
+    }
+
+    while (sa->large.next != &sa->large) {
+        raxLargeBlock *next = sa->large.next->next;
+        rax_free(sa->large.next);
+        sa->large.next = next;
+    }
+
+    rax_free(sa);
+}
+
+/* Create a slab allocator for the nodes of a single tree, that frees it
+ * with the tree. Returns NULL on out of memory. */
+raxAllocator *raxSlabAllocatorNew(void) {
+    raxSlabAllocator *sa = rax_malloc(sizeof(raxSlabAllocator));
+    if (sa == NULL) return NULL;
+    memset(sa,0,sizeof(*sa));
+    sa->alloc.malloc = raxSlabMalloc;
+    sa->alloc.realloc = raxSlabRealloc;
+    sa->alloc.free = raxSlabFree;
+    sa->alloc.release = raxSlabRelease;
+    sa->alloc.ctx = sa;
+    sa->nextlen = RAX_SLAB_MIN_LEN;
+    sa->large.prev = sa->large.next = &sa->large;
+    return &sa->alloc;
+}
+
+static inline void *raxNodeMalloc(rax *rax, size_t size) {
+    if (rax->alloc) return rax->alloc->malloc(rax->alloc->ctx,size);
+    return rax_malloc(size);
+}
+
+static inline void *raxNodeRealloc(rax *rax, void *ptr, size_t oldsize, size_t size) {
+    if (rax->alloc) return rax->alloc->realloc(rax->alloc->ctx,ptr,oldsize,size);
+    return rax_realloc(ptr,size);
+}
+
+static inline void raxNodeFree(rax *rax, void *ptr, size_t size) {
+    if (rax->alloc) rax->alloc->free(rax->alloc->ctx,ptr,size);
+    else rax_free(ptr);
+}
+
 /* ----------------------------------------------------------------------------
  * Radix tree implementation
  * --------------------------------------------------------------------------*/
@@ -166,31 +439,83 @@ static inline void raxStackFree(raxStack *ts) {
     (((n)->iskey && !(n)->isnull) ? sizeof(void*) : 0) \
 ))
 
+/* A direct node has a child pointer slot for each byte and no characters
+ * section, see the raxNode layout in rax.h. */
+#define RAX_DIRECT_SLOTS 256
+#define raxNodeIsDirect(n) (!(n)->iscompr && (n)->size > RAX_NODE_MAX_SORTED)
+
+/* Return the number of characters stored in the node, and the number of
+ * child pointer slots that follow them. */
+#define raxNodeCharsLen(n) (raxNodeIsDirect(n) ? 0 : (n)->size)
+#define raxNodeNumSlots(n) \
+    ((n)->iscompr ? 1 : raxNodeIsDirect(n) ? RAX_DIRECT_SLOTS : (n)->size)
+
 /* Return the pointer to the first child pointer. */
 #define raxNodeFirstChildPtr(n) ((raxNode**) ( \
     (n)->data + \
-    (n)->size + \
-    raxPadding((n)->size)))
+    raxNodeCharsLen(n) + \
+    raxPadding(raxNodeCharsLen(n))))
 
 /* Return the current total size of the node. Note that the second line
  * computes the padding after the string of characters, needed in order to
  * save pointers to aligned addresses. */
 #define raxNodeCurrentLength(n) ( \
-    sizeof(raxNode)+(n)->size+ \
-    raxPadding((n)->size)+ \
-    ((n)->iscompr ? sizeof(raxNode*) : sizeof(raxNode*)*(n)->size)+ \
+    sizeof(raxNode)+raxNodeCharsLen(n)+ \
+    raxPadding(raxNodeCharsLen(n))+ \
+    sizeof(raxNode*)*raxNodeNumSlots(n)+ \
     (((n)->iskey && !(n)->isnull)*sizeof(void*)) \
 )
 
+/* Children of a node are addressed by position: the child index in sorted
+ * and compressed nodes, the child byte in direct nodes. Positions are what
+ * iterators keep in their child offset stack, and fit in a byte. */
+
+/* Return the first child position >= 'pos', or -1 if there is none. */
+static inline int raxNextChildPos(raxNode *n, int pos) {
+    if (!raxNodeIsDirect(n)) return pos < (int)raxNodeNumSlots(n) ? pos : -1;
+    raxNode **cp = raxNodeFirstChildPtr(n);
+    for (; pos < RAX_DIRECT_SLOTS; pos++) {
+        if (cp[pos]) return pos;
+    }
+    return -1;
+}
+
+/* Return the last child position < 'pos', or -1 if there is none. */
+static inline int raxPrevChildPos(raxNode *n, int pos) {
+    if (!raxNodeIsDirect(n)) return pos - 1;
+    raxNode **cp = raxNodeFirstChildPtr(n);
+    while (--pos >= 0) {
+        if (cp[pos]) return pos;
+    }
+    return -1;
+}
+
+/* Return the edge byte of the child at position 'pos' of a non compressed
+ * node. */
+static inline unsigned char raxChildChar(raxNode *n, int pos) {
+    return raxNodeIsDirect(n) ? (unsigned char)pos : n->data[pos];
+}
+
+/* Return the edge bytes, or compressed string, of the node 'n'. Direct
+ * nodes don't store them, so they are collected into 'buf', that must have
+ * room for RAX_DIRECT_SLOTS bytes. */
+static unsigned char *raxNodeChars(raxNode *n, unsigned char *buf) {
+    if (!raxNodeIsDirect(n)) return n->data;
+    int len = 0;
+    for (int pos = raxNextChildPos(n,0); pos != -1; pos = raxNextChildPos(n,pos+1))
+        buf[len++] = pos;
+    return buf;
+}
+
 /* Allocate a new non compressed node with the specified number of children.
  * If datafiled is true, the allocation is made large enough to hold the
  * associated data pointer.
  * Returns the new node pointer. On out of memory NULL is returned. */
-raxNode *raxNewNode(size_t children, int datafield) {
+raxNode *raxNewNode(rax *rax, size_t children, int datafield) {
     size_t nodesize = sizeof(raxNode)+children+raxPadding(children)+
                       sizeof(raxNode*)*children;
     if (datafield) nodesize += sizeof(void*);
-    raxNode *node = rax_malloc(nodesize);
+    raxNode *node = raxNodeMalloc(rax,nodesize);
     if (node == NULL) return NULL;
     node->iskey = 0;
     node->isnull = 0;
@@ -202,11 +527,19 @@ raxNode *raxNewNode(size_t children, int datafield) {
 /* Allocate a new rax and return its pointer. On out of memory the function
  * returns NULL. */
 rax *raxNew(void) {
+    return raxNewWithAllocator(NULL);
+}
+
+/* Like raxNew() but the nodes are allocated with 'alloc', or rax_malloc()
+ * if it is NULL. The allocator must outlive the tree, and if it has a
+ * release() function it is called by raxFree(). */
+rax *raxNewWithAllocator(raxAllocator *alloc) {
     rax *rax = rax_malloc(sizeof(*rax));
     if (rax == NULL) return NULL;
     rax->numele = 0;
     rax->numnodes = 1;
-    rax->head = raxNewNode(0,0);
+    rax->alloc = alloc;
+    rax->head = raxNewNode(rax,0,0);
     if (rax->head == NULL) {
         rax_free(rax);
         return NULL;
@@ -215,12 +548,23 @@ rax *raxNew(void) {
     }
 }
 
+/* Allocate a new rax with its own slab allocator, see raxSlabAllocatorNew().
+ * Suited to trees that are freed as a whole, or that hold many small nodes.
+ * On out of memory the function returns NULL. */
+rax *raxNewWithSlabs(void) {
+    raxAllocator *alloc = raxSlabAllocatorNew();
+    if (alloc == NULL) return NULL;
+    rax *rax = raxNewWithAllocator(alloc);
+    if (rax == NULL) alloc->release(alloc->ctx);
+    return rax;
+}
+
 /* realloc the node to make room for auxiliary data in order
  * to store an item in that node. On out of memory NULL is returned. */
-raxNode *raxReallocForData(raxNode *n, void *data) {
+raxNode *raxReallocForData(rax *rax, raxNode *n, void *data) {
     if (data == NULL) return n; /* No reallocation needed, setting isnull=1 */
     size_t curlen = raxNodeCurrentLength(n);
-    return rax_realloc(n,curlen+sizeof(void*));
+    return raxNodeRealloc(rax,n,curlen,curlen+sizeof(void*));
 }
 
 /* Set the node auxiliary data to the specified pointer. */
@@ -245,6 +589,89 @@ void *raxGetData(raxNode *n) {
     return data;
 }
 
+/* Turn the sorted node 'n', that must have RAX_NODE_MAX_SORTED children,
+ * into the direct layout, ready for the caller to add one more child and
+ * increment the size. Returns the new node pointer, or NULL on out of memory
+ * with 'n' still valid. */
+static raxNode *raxNodeToDirect(rax *rax, raxNode *n) {
+    assert(!n->iscompr && n->size == RAX_NODE_MAX_SORTED);
+    unsigned char chars[RAX_NODE_MAX_SORTED];
+    raxNode *children[RAX_NODE_MAX_SORTED];
+    void *data = NULL;
+
+    memcpy(chars,n->data,sizeof(chars));
+    memcpy(children,raxNodeFirstChildPtr(n),sizeof(children));
+    int hasdata = n->iskey && !n->isnull;
+    if (hasdata) data = raxGetData(n);
+
+    size_t slotslen = sizeof(raxNode*)*RAX_DIRECT_SLOTS;
+    size_t newlen = sizeof(raxNode)+raxPadding(0)+slotslen+(hasdata ? sizeof(void*) : 0);
+    raxNode *newn = raxNodeRealloc(rax,n,raxNodeCurrentLength(n),newlen);
+    if (newn == NULL) return NULL;
+    n = newn;
+
+    raxNode **slots = (raxNode**)(n->data+raxPadding(0));
+    memset(slots,0,slotslen);
+    for (int j = 0; j < RAX_NODE_MAX_SORTED; j++) slots[chars[j]] = children[j];
+    if (hasdata) memcpy((char*)n+newlen-sizeof(void*),&data,sizeof(data));
+    return n;
+}
+
+/* Turn the direct node 'n', whose size was just decremented to
+ * RAX_NODE_MAX_SORTED, back into the sorted layout. The children are saved
+ * before rewriting the node in place, so this never fails. Returns the new
+ * node pointer. */
+static raxNode *raxNodeToSorted(rax *rax, raxNode *n) {
+    assert(!n->iscompr && n->size == RAX_NODE_MAX_SORTED);
+    unsigned char chars[RAX_NODE_MAX_SORTED];
+    raxNode *children[RAX_NODE_MAX_SORTED];
+    void *data = NULL;
+
+    size_t oldlen = sizeof(raxNode)+raxPadding(0)+sizeof(raxNode*)*RAX_DIRECT_SLOTS;
+    int hasdata = n->iskey && !n->isnull;
+    if (hasdata) memcpy(&data,(char*)n+oldlen,sizeof(data));
+
+    raxNode **slots = (raxNode**)(n->data+raxPadding(0));
+    int size = 0;
+    for (int c = 0; c < RAX_DIRECT_SLOTS; c++) {
+        if (slots[c] == NULL) continue;
+        chars[size] = c;
+        children[size++] = slots[c];
+    }
+    assert(size == RAX_NODE_MAX_SORTED);
+
+    memcpy(n->data,chars,sizeof(chars));
+    memcpy(raxNodeFirstChildPtr(n),children,sizeof(children));
+    if (hasdata) raxSetData(n,data);
+
+    raxNode *newn = raxNodeRealloc(rax,n,oldlen+(hasdata ? sizeof(void*) : 0),raxNodeCurrentLength(n));
+    return newn ? newn : n;
+}
+
+/* raxAddChild() for a node that is direct or that becomes direct with the
+ * new child: the child pointer just goes in the slot of its byte, so the
+ * node is only reallocated when it changes layout. */
+static raxNode *raxAddDirectChild(rax *rax, raxNode *n, unsigned char c, raxNode **childptr, raxNode ***parentlink) {
+    raxNode *child = raxNewNode(rax,0,0);
+    if (child == NULL) return NULL;
+
+    if (!raxNodeIsDirect(n)) {
+        raxNode *newn = raxNodeToDirect(rax,n);
+        if (newn == NULL) {
+            raxNodeFree(rax,child,raxNodeCurrentLength(child));
+            return NULL;
+        }
+        n = newn;
+    }
+
+    raxNode **childfield = (raxNode**)(n->data+raxPadding(0))+c;
+    memcpy(childfield,&child,sizeof(child));
+    n->size++;
+    *childptr = child;
+    *parentlink = childfield;
+    return n;
+}
+
 /* Add a new child to the node 'n' representing the character 'c' and return
  * its new pointer, as well as the child pointer by reference. Additionally
  * '***parentlink' is populated with the raxNode pointer-to-pointer of where
@@ -254,8 +681,9 @@ void *raxGetData(raxNode *n) {
  * On success the new parent node pointer is returned (it may change because
  * of the realloc, so the caller should discard 'n' and use the new value).
  * On out of memory NULL is returned, and the old node is still valid. */
-raxNode *raxAddChild(raxNode *n, unsigned char c, raxNode **childptr, raxNode ***parentlink) {
+raxNode *raxAddChild(rax *rax, raxNode *n, unsigned char c, raxNode **childptr, raxNode ***parentlink) {
     assert(n->iscompr == 0);
+    if (n->size >= RAX_NODE_MAX_SORTED) return raxAddDirectChild(rax,n,c,childptr,parentlink);
 
     size_t curlen = raxNodeCurrentLength(n);
     n->size++;
@@ -264,13 +692,13 @@ raxNode *raxAddChild(raxNode *n, unsigned char c, raxNode **childptr, raxNode **
                   success at the end. */
 
     /* Alloc the new child we will link to 'n'. */
-    raxNode *child = raxNewNode(0,0);
+    raxNode *child = raxNewNode(rax,0,0);
     if (child == NULL) return NULL;
 
     /* Make space in the original node. */
-    raxNode *newn = rax_realloc(n,newlen);
+    raxNode *newn = raxNodeRealloc(rax,n,curlen,newlen);
     if (newn == NULL) {
-        rax_free(child);
+        raxNodeFree(rax,child,raxNodeCurrentLength(child));
         return NULL;
     }
     n = newn;
@@ -303,10 +731,7 @@ raxNode *raxAddChild(raxNode *n, unsigned char c, raxNode **childptr, raxNode **
      * it is inserted in-place lexicographically. Assuming we are adding
      * a child "c" in our case pos will be = 2 after the end of the following
      * loop. */
-    int pos;
-    for (pos = 0; pos < n->size; pos++) {
-        if (n->data[pos] > c) break;
-    }
+    int pos = raxChildGE(n,c); /* The byte isn't a child yet. */
 
     /* Now, if present, move auxiliary data pointer at the end
      * so that we can mess with the other data without overwriting it.
@@ -395,7 +820,7 @@ raxNode *raxAddChild(raxNode *n, unsigned char c, raxNode **childptr, raxNode **
  * The function also returns a child node, since the last node of the
  * compressed chain cannot be part of the chain: it has zero children while
  * we can only compress inner nodes with exactly one child each. */
-raxNode *raxCompressNode(raxNode *n, unsigned char *s, size_t len, raxNode **child) {
+raxNode *raxCompressNode(rax *rax, raxNode *n, unsigned char *s, size_t len, raxNode **child) {
     assert(n->size == 0 && n->iscompr == 0);
     void *data = NULL; /* Initialized only to avoid warnings. */
     size_t newsize;
@@ -403,7 +828,7 @@ raxNode *raxCompressNode(raxNode *n, unsigned char *s, size_t len, raxNode **chi
     debugf("Compress node: %.*s\n", (int)len,s);
 
     /* Allocate the child to link to this node. */
-    *child = raxNewNode(0,0);
+    *child = raxNewNode(rax,0,0);
     if (*child == NULL) return NULL;
 
     /* Make space in the parent node. */
@@ -412,9 +837,9 @@ raxNode *raxCompressNode(raxNode *n, unsigned char *s, size_t len, raxNode **chi
         data = raxGetData(n); /* To restore it later. */
         if (!n->isnull) newsize += sizeof(void*);
     }
-    raxNode *newn = rax_realloc(n,newsize);
+    raxNode *newn = raxNodeRealloc(rax,n,raxNodeCurrentLength(n),newsize);
     if (newn == NULL) {
-        rax_free(*child);
+        raxNodeFree(rax,*child,raxNodeCurrentLength(*child));
         return NULL;
     }
     n = newn;
@@ -457,13 +882,11 @@ raxNode *raxCompressNode(raxNode *n, unsigned char *s, size_t len, raxNode **chi
  * means that the current node represents the key (that is, none of the
  * compressed node characters are needed to represent the key, just all
  * its parents nodes). */
-static inline size_t raxLowWalk(
-    rax *rax, unsigned char *s, size_t len, raxNode **stopnode, raxNode ***plink, int *splitpos, raxStack* ts
+static inline size_t raxLowWalkFrom(
+    raxNode *h, raxNode **parentlink, unsigned char *s, size_t i, size_t len,
+    raxNode **stopnode, raxNode ***plink, int *splitpos, raxStack* ts
 ) {
-    raxNode *h = rax->head;
-    raxNode **parentlink = &rax->head;
-
-    size_t i = 0; /* Position in the string. */
+    /* 'i' is the position in the string, 'h' the node representing it. */
     size_t j = 0; /* Position in the node children (or bytes if compressed).*/
     while(h->size && i < len) {
         debugnode("Lookup current node",h);
@@ -474,14 +897,21 @@ static inline size_t raxLowWalk(
                 if (v[j] != s[i]) break;
             }
             if (j != h->size) break;
+        } else if (raxNodeIsDirect(h)) {
+            j = s[i];
+            if (raxNodeFirstChildPtr(h)[j] == NULL) {
+                j = h->size;
+                break;
+            }
+            i++;
         } else {
-            /* Even when h->size is large, linear scan provides good
-             * performances compared to other approaches that are in theory
-             * more sounding, like performing a binary search. */
-            for (j = 0; j < h->size; j++) {
-                if (v[j] == s[i]) break;
+            /* A linear scan, vectorized for large nodes, beats a binary
+             * search over at most RAX_NODE_MAX_SORTED sorted bytes. */
+            j = raxChildGE(h,s[i]);
+            if (j == h->size || v[j] != s[i]) {
+                j = h->size;
+                break;
             }
-            if (j == h->size) break;
             i++;
         }
 
@@ -502,23 +932,19 @@ static inline size_t raxLowWalk(
     return i;
 }
 
-/* Insert the element 's' of size 'len', setting as auxiliary data
- * the pointer 'data'. If the element is already present, the associated
- * data is updated (only if 'overwrite' is set to 1), and 0 is returned,
- * otherwise the element is inserted and 1 is returned. On out of memory the
- * function returns 0 as well but sets errno to ENOMEM, otherwise errno will
- * be set to 0.
- */
-int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **old, int overwrite) {
-    size_t i;
-    int j = 0; /* Split position. If raxLowWalk() stops in a compressed
-                  node, the index 'j' represents the char we stopped within the
-                  compressed node, that is, the position where to split the
-                  node for insertion. */
-    raxNode *h, **parentlink;
+static inline size_t raxLowWalk(
+    rax *rax, unsigned char *s, size_t len, raxNode **stopnode, raxNode ***plink, int *splitpos, raxStack* ts
+) {
+    return raxLowWalkFrom(rax->head,&rax->head,s,0,len,stopnode,plink,splitpos,ts);
+}
 
-    debugf("### Insert %.*s with value %p\n", (int)len, s, data);
-    i = raxLowWalk(rax,s,len,&h,&parentlink,&j, NULL);
+/* Insert the element 's' of size 'len' where the walk for it stopped: 'i'
+ * chars in, at node 'h' linked from 'parentlink', at index 'j' if 'h' is
+ * compressed. See raxGenericInsert(). The link to the node that holds the
+ * key is returned as '*keylink' if not NULL, unless out of memory. */
+static int raxInsertAt(rax *rax, raxNode *h, raxNode **parentlink, size_t i, int j,
+                       unsigned char *s, size_t len, void *data, void **old, int overwrite, raxNode ***keylink)
+{
 
     /* If i == len we walked following the whole string. If we are not
      * in the middle of a compressed node, the string is either already
@@ -529,13 +955,14 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
         debugf("### Insert: node representing key exists\n");
         /* Make space for the value pointer if needed. */
         if (!h->iskey || (h->isnull && overwrite)) {
-            h = raxReallocForData(h,data);
+            h = raxReallocForData(rax,h,data);
             if (h) memcpy(parentlink,&h,sizeof(h));
         }
         if (h == NULL) {
             errno = ENOMEM;
             return 0;
         }
+        if (keylink) *keylink = parentlink;
 
         /* Update the existing key if there is already one. */
         if (h->iskey) {
@@ -698,25 +1125,25 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
         size_t trimmedlen = j;
         size_t postfixlen = h->size - j - 1;
         int split_node_is_key = !trimmedlen && h->iskey && !h->isnull;
-        size_t nodesize;
+        size_t trimmedsize = 0, postfixsize = 0;
 
         /* 2: Create the split node. Also allocate the other nodes we'll need
          *    ASAP, so that it will be simpler to handle OOM. */
-        raxNode *splitnode = raxNewNode(1, split_node_is_key);
+        raxNode *splitnode = raxNewNode(rax,1, split_node_is_key);
         raxNode *trimmed = NULL;
         raxNode *postfix = NULL;
 
         if (trimmedlen) {
-            nodesize = sizeof(raxNode)+trimmedlen+raxPadding(trimmedlen)+
-                       sizeof(raxNode*);
-            if (h->iskey && !h->isnull) nodesize += sizeof(void*);
-            trimmed = rax_malloc(nodesize);
+            trimmedsize = sizeof(raxNode)+trimmedlen+raxPadding(trimmedlen)+
+                          sizeof(raxNode*);
+            if (h->iskey && !h->isnull) trimmedsize += sizeof(void*);
+            trimmed = raxNodeMalloc(rax,trimmedsize);
         }
 
         if (postfixlen) {
-            nodesize = sizeof(raxNode)+postfixlen+raxPadding(postfixlen)+
-                       sizeof(raxNode*);
-            postfix = rax_malloc(nodesize);
+            postfixsize = sizeof(raxNode)+postfixlen+raxPadding(postfixlen)+
+                          sizeof(raxNode*);
+            postfix = raxNodeMalloc(rax,postfixsize);
         }
 
         /* OOM? Abort now that the tree is untouched. */
@@ -724,9 +1151,9 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
             (trimmedlen && trimmed == NULL) ||
             (postfixlen && postfix == NULL))
         {
-            rax_free(splitnode);
-            rax_free(trimmed);
-            rax_free(postfix);
+            if (splitnode) raxNodeFree(rax,splitnode,raxNodeCurrentLength(splitnode));
+            if (trimmed) raxNodeFree(rax,trimmed,trimmedsize);
+            if (postfix) raxNodeFree(rax,postfix,postfixsize);
             errno = ENOMEM;
             return 0;
         }
@@ -781,7 +1208,7 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
         /* 6. Continue insertion: this will cause the splitnode to
          * get a new child (the non common character at the currently
          * inserted key). */
-        rax_free(h);
+        raxNodeFree(rax,h,raxNodeCurrentLength(h));
         h = splitnode;
     } else if (h->iscompr && i == len) {
     /* ------------------------- ALGORITHM 2 --------------------------- */
@@ -790,18 +1217,18 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
 
         /* Allocate postfix & trimmed nodes ASAP to fail for OOM gracefully. */
         size_t postfixlen = h->size - j;
-        size_t nodesize = sizeof(raxNode)+postfixlen+raxPadding(postfixlen)+
-                          sizeof(raxNode*);
-        if (data != NULL) nodesize += sizeof(void*);
-        raxNode *postfix = rax_malloc(nodesize);
+        size_t postfixsize = sizeof(raxNode)+postfixlen+raxPadding(postfixlen)+
+                             sizeof(raxNode*);
+        if (data != NULL) postfixsize += sizeof(void*);
+        raxNode *postfix = raxNodeMalloc(rax,postfixsize);
 
-        nodesize = sizeof(raxNode)+j+raxPadding(j)+sizeof(raxNode*);
-        if (h->iskey && !h->isnull) nodesize += sizeof(void*);
-        raxNode *trimmed = rax_malloc(nodesize);
+        size_t trimmedsize = sizeof(raxNode)+j+raxPadding(j)+sizeof(raxNode*);
+        if (h->iskey && !h->isnull) trimmedsize += sizeof(void*);
+        raxNode *trimmed = raxNodeMalloc(rax,trimmedsize);
 
         if (postfix == NULL || trimmed == NULL) {
-            rax_free(postfix);
-            rax_free(trimmed);
+            if (postfix) raxNodeFree(rax,postfix,postfixsize);
+            if (trimmed) raxNodeFree(rax,trimmed,trimmedsize);
             errno = ENOMEM;
             return 0;
         }
@@ -838,11 +1265,12 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
          * the postfix node. */
         cp = raxNodeLastChildPtr(trimmed);
         memcpy(cp,&postfix,sizeof(postfix));
+        if (keylink) *keylink = cp;
 
         /* Finish! We don't need to continue with the insertion
          * algorithm for ALGO 2. The key is already inserted. */
         rax->numele++;
-        rax_free(h);
+        raxNodeFree(rax,h,raxNodeCurrentLength(h));
         return 1; /* Key inserted. */
     }
 
@@ -859,7 +1287,7 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
             size_t comprsize = len-i;
             if (comprsize > RAX_NODE_MAX_SIZE)
                 comprsize = RAX_NODE_MAX_SIZE;
-            raxNode *newh = raxCompressNode(h,s+i,comprsize,&child);
+            raxNode *newh = raxCompressNode(rax,h,s+i,comprsize,&child);
             if (newh == NULL) goto oom;
             h = newh;
             memcpy(parentlink,&h,sizeof(h));
@@ -868,7 +1296,7 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
         } else {
             debugf("Inserting normal node\n");
             raxNode **new_parentlink;
-            raxNode *newh = raxAddChild(h,s[i],&child,&new_parentlink);
+            raxNode *newh = raxAddChild(rax,h,s[i],&child,&new_parentlink);
             if (newh == NULL) goto oom;
             h = newh;
             memcpy(parentlink,&h,sizeof(h));
@@ -878,12 +1306,13 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
         rax->numnodes++;
         h = child;
     }
-    raxNode *newh = raxReallocForData(h,data);
+    raxNode *newh = raxReallocForData(rax,h,data);
     if (newh == NULL) goto oom;
     h = newh;
     if (!h->iskey) rax->numele++;
     raxSetData(h,data);
     memcpy(parentlink,&h,sizeof(h));
+    if (keylink) *keylink = parentlink;
     return 1; /* Element inserted. */
 
 oom:
@@ -891,8 +1320,10 @@ oom:
      * already modified. Set the node as a key, and then remove it. However we
      * do that only if the node is a terminal node, otherwise if the OOM
      * happened reallocating a node in the middle, we don't need to free
-     * anything. */
-    if (h->size == 0) {
+     * anything. A terminal node that is already a key is one the walk
+     * stopped at, with nothing added below it yet: removing it would lose
+     * the key. */
+    if (h->size == 0 && !h->iskey) {
         h->isnull = 1;
         h->iskey = 1;
         rax->numele++; /* Compensate the next remove. */
@@ -902,6 +1333,52 @@ oom:
     return 0;
 }
 
+/* Insert the element 's' of size 'len', setting as auxiliary data
+ * the pointer 'data'. If the element is already present, the associated
+ * data is updated (only if 'overwrite' is set to 1), and 0 is returned,
+ * otherwise the element is inserted and 1 is returned. On out of memory the
+ * function returns 0 as well but sets errno to ENOMEM, otherwise errno will
+ * be set to 0.
+ */
+int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **old, int overwrite) {
+    size_t i;
+    int j = 0; /* Split position. If raxLowWalk() stops in a compressed
+                  node, the index 'j' represents the char we stopped within the
+                  compressed node, that is, the position where to split the
+                  node for insertion. */
+    raxNode *h, **parentlink;
+
+    debugf("### Insert %.*s with value %p\n", (int)len, s, data);
+    i = raxLowWalk(rax,s,len,&h,&parentlink,&j, NULL);
+    return raxInsertAt(rax,h,parentlink,i,j,s,len,data,old,overwrite,NULL);
+}
+
+/* Insert, unless already there, the 'count' prefixes of 's' whose lengths
+ * are in the ascending array 'lens', each with its value from 'data'. Each
+ * walk goes on from the node holding the previous prefix rather than from
+ * the head, so that a key and the keys along its path take a single walk.
+ * As with the 'old' argument of raxTryInsert(), data[i] is set to the value
+ * of the key of lens[i] if it was already there. If 'inserted' is not NULL,
+ * inserted[i] is set to 1 if the key was added or to 0 if it was not.
+ *
+ * Returns 1, or 0 with errno set to ENOMEM on out of memory, in which case
+ * the keys before the one that failed remain inserted. */
+int raxTryInsertPrefixes(rax *rax, unsigned char *s, size_t *lens, void **data, int *inserted, size_t count) {
+    raxNode **link = &rax->head;
+    size_t pos = 0;
+
+    for (size_t k = 0; k < count; k++) {
+        raxNode *h, **parentlink;
+        int j = 0;
+        size_t i = raxLowWalkFrom(*link,link,s,pos,lens[k],&h,&parentlink,&j,NULL);
+        int rc = raxInsertAt(rax,h,parentlink,i,j,s,lens[k],data[k],&data[k],0,&link);
+        if (!rc && errno == ENOMEM) return 0;
+        if (inserted) inserted[k] = rc;
+        pos = lens[k];
+    }
+    return 1;
+}
+
 /* Overwriting insert. Just a wrapper for raxGenericInsert() that will
  * update the element if there is already one for the same key. */
 int raxInsert(rax *rax, unsigned char *s, size_t len, void *data, void **old) {
@@ -949,7 +1426,7 @@ raxNode **raxFindParentLink(raxNode *parent, raxNode *child) {
  * removal) is returned. Note that this function does not fix the pointer
  * of the parent node in its parent, so this task is up to the caller.
  * The function never fails for out of memory. */
-raxNode *raxRemoveChild(raxNode *parent, raxNode *child) {
+raxNode *raxRemoveChild(rax *rax, raxNode *parent, raxNode *child) {
     debugnode("raxRemoveChild before", parent);
     /* If parent is a compressed node (having a single child, as for definition
      * of the data structure), the removal of the child consists into turning
@@ -965,6 +1442,17 @@ raxNode *raxRemoveChild(raxNode *parent, raxNode *child) {
         return parent;
     }
 
+    /* A direct node just clears the child slot, unless it is left with few
+     * enough children to go back to the sorted layout. */
+    if (raxNodeIsDirect(parent)) {
+        raxNode **c = raxFindParentLink(parent,child);
+        memset(c,0,sizeof(*c));
+        parent->size--;
+        if (!raxNodeIsDirect(parent)) parent = raxNodeToSorted(rax,parent);
+        debugnode("raxRemoveChild after", parent);
+        return parent;
+    }
+
     /* Otherwise we need to scan for the child pointer and memmove()
      * accordingly.
      *
@@ -1007,11 +1495,12 @@ raxNode *raxRemoveChild(raxNode *parent, raxNode *child) {
     memmove(((char*)c)-shift,c+1,taillen*sizeof(raxNode**)+valuelen);
 
     /* 4. Update size. */
+    size_t oldlen = raxNodeCurrentLength(parent);
     parent->size--;
 
     /* realloc the node according to the theoretical memory usage, to free
      * data if we are over-allocating right now. */
-    raxNode *newnode = rax_realloc(parent,raxNodeCurrentLength(parent));
+    raxNode *newnode = raxNodeRealloc(rax,parent,oldlen,raxNodeCurrentLength(parent));
     if (newnode) {
         debugnode("raxRemoveChild after", newnode);
     }
@@ -1020,6 +1509,160 @@ raxNode *raxRemoveChild(raxNode *parent, raxNode *child) {
     return newnode ? newnode : parent;
 }
 
+/* Unlink the already freed 'child' from its parent 'h', whose own parents
+ * are in 'ts'. A parent that is not a key and has no other child is freed
+ * in turn, up to the head of the rax or the first node with more than one
+ * child. Returns the node the child was finally removed from: it may need
+ * compressing if it is left with a single child and is not a key. If 'pos'
+ * is not NULL it holds the length of the key at 'h' and is set to that of
+ * the returned node. */
+static raxNode *raxUnlinkChild(rax *rax, raxNode *h, raxNode *child, raxStack *ts, size_t *pos) {
+    while(h != rax->head && !h->iskey && (h->iscompr || h->size == 1)) {
+        child = h;
+        debugf("Freeing child %p [%.*s] key:%d\n", (void*)child,
+            (int)child->size, (char*)child->data, child->iskey);
+        raxNodeFree(rax,child,raxNodeCurrentLength(child));
+        rax->numnodes--;
+        h = raxStackPop(ts);
+        if (pos) *pos -= h->iscompr ? h->size : 1;
+    }
+
+    debugf("Unlinking child %p from parent %p\n", (void*)child, (void*)h);
+    raxNode *new = raxRemoveChild(rax,h,child);
+    if (new != h) {
+        raxNode *parent = raxStackPeek(ts);
+        raxNode **parentlink;
+        if (parent == NULL) {
+            parentlink = &rax->head;
+        } else {
+            parentlink = raxFindParentLink(parent,h);
+        }
+        memcpy(parentlink,&new,sizeof(new));
+    }
+    return new;
+}
+
+/* Recompression after a removal: 'h' points to a radix tree node that
+ * changed in a way that could allow to compress nodes in this sub-branch,
+ * and 'ts' holds its parents. Compressed nodes represent chains of nodes
+ * that are not keys and have a single child, so there are two deletion
+ * events that may alter the tree so that further compression is needed:
+ *
+ * 1) A node with a single child was a key and now no longer is a key.
+ * 2) A node with two children now has just one child.
+ *
+ * We try to navigate upward till there are other nodes that can be
+ * compressed, when we reach the upper node which is not a key and has
+ * a single child, we scan the chain of children to collect the
+ * compressable part of the tree, and replace the current node with the
+ * new one, fixing the child pointer to reference the first non
+ * compressable node.
+ *
+ * Example of case "1". A tree stores the keys "FOO" = 1 and
+ * "FOOBAR" = 2:
+ *
+ *
+ * "FOO" -> "BAR" -> [] (2)
+ *           (1)
+ *
+ * After the removal of "FOO" the tree can be compressed as:
+ *
+ * "FOOBAR" -> [] (2)
+ *
+ *
+ * Example of case "2". A tree stores the keys "FOOBAR" = 1 and
+ * "FOOTER" = 2:
+ *
+ *          |B| -> "AR" -> [] (1)
+ * "FOO" -> |-|
+ *          |T| -> "ER" -> [] (2)
+ *
+ * After the removal of "FOOTER" the resulting tree is:
+ *
+ * "FOO" -> |B| -> "AR" -> [] (1)
+ *
+ * That can be compressed into:
+ *
+ * "FOOBAR" -> [] (1)
+ */
+static void raxRecompress(rax *rax, raxNode *h, raxStack *ts) {
+    debugnode("Compression may be needed",h);
+    debugf("Seek start node\n");
+
+    /* Try to reach the upper node that is compressible.
+     * At the end of the loop 'h' will point to the first node we
+     * can try to compress and 'parent' to its parent. */
+    raxNode *parent;
+    while(1) {
+        parent = raxStackPop(ts);
+        if (!parent || parent->iskey ||
+            (!parent->iscompr && parent->size != 1)) break;
+        h = parent;
+        debugnode("Going up to",h);
+    }
+    raxNode *start = h; /* Compression starting node. */
+
+    /* Scan chain of nodes we can compress. */
+    size_t comprsize = h->size;
+    int nodes = 1;
+    while(h->size != 0) {
+        raxNode **cp = raxNodeLastChildPtr(h);
+        memcpy(&h,cp,sizeof(h));
+        if (h->iskey || (!h->iscompr && h->size != 1)) break;
+        /* Stop here if going to the next node would result into
+         * a compressed node larger than h->size can hold. */
+        if (comprsize + h->size > RAX_NODE_MAX_SIZE) break;
+        nodes++;
+        comprsize += h->size;
+    }
+    if (nodes > 1) {
+        /* If we can compress, create the new node and populate it. */
+        size_t nodesize =
+            sizeof(raxNode)+comprsize+raxPadding(comprsize)+sizeof(raxNode*);
+        raxNode *new = raxNodeMalloc(rax,nodesize);
+        /* An out of memory here just means we cannot optimize this
+         * node, but the tree is left in a consistent state. */
+        if (new == NULL) return;
+        new->iskey = 0;
+        new->isnull = 0;
+        new->iscompr = 1;
+        new->size = comprsize;
+        rax->numnodes++;
+
+        /* Scan again, this time to populate the new node content and
+         * to fix the new node child pointer. At the same time we free
+         * all the nodes that we'll no longer use. */
+        comprsize = 0;
+        h = start;
+        while(h->size != 0) {
+            memcpy(new->data+comprsize,h->data,h->size);
+            comprsize += h->size;
+            raxNode **cp = raxNodeLastChildPtr(h);
+            raxNode *tofree = h;
+            memcpy(&h,cp,sizeof(h));
+            raxNodeFree(rax,tofree,raxNodeCurrentLength(tofree)); rax->numnodes--;
+            if (h->iskey || (!h->iscompr && h->size != 1)) break;
+        }
+        debugnode("New node",new);
+
+        /* Now 'h' points to the first node that we still need to use,
+         * so our new node child pointer will point to it. */
+        raxNode **cp = raxNodeLastChildPtr(new);
+        memcpy(cp,&h,sizeof(h));
+
+        /* Fix parent link. */
+        if (parent) {
+            raxNode **parentlink = raxFindParentLink(parent,start);
+            memcpy(parentlink,&new,sizeof(new));
+        } else {
+            rax->head = new;
+        }
+
+        debugf("Compressed %d nodes, %d total bytes\n",
+            nodes, (int)comprsize);
+    }
+}
+
 /* Remove the specified item. Returns 1 if the item was found and
  * deleted, 0 otherwise. */
 int raxRemove(rax *rax, unsigned char *s, size_t len, void **old) {
@@ -1049,39 +1692,17 @@ int raxRemove(rax *rax, unsigned char *s, size_t len, void **old) {
 
     if (h->size == 0) {
         debugf("Key deleted in node without children. Cleanup needed.\n");
-        raxNode *child = NULL;
-        while(h != rax->head) {
-            child = h;
+        if (h != rax->head) {
+            raxNode *child = h;
             debugf("Freeing child %p [%.*s] key:%d\n", (void*)child,
                 (int)child->size, (char*)child->data, child->iskey);
-            rax_free(child);
+            raxNodeFree(rax,child,raxNodeCurrentLength(child));
             rax->numnodes--;
-            h = raxStackPop(&ts);
-             /* If this node has more then one child, or actually holds
-              * a key, stop here. */
-            if (h->iskey || (!h->iscompr && h->size != 1)) break;
-        }
-        if (child) {
-            debugf("Unlinking child %p from parent %p\n",
-                (void*)child, (void*)h);
-            raxNode *new = raxRemoveChild(h,child);
-            if (new != h) {
-                raxNode *parent = raxStackPeek(&ts);
-                raxNode **parentlink;
-                if (parent == NULL) {
-                    parentlink = &rax->head;
-                } else {
-                    parentlink = raxFindParentLink(parent,h);
-                }
-                memcpy(parentlink,&new,sizeof(new));
-            }
+            h = raxUnlinkChild(rax,raxStackPop(&ts),child,&ts,NULL);
 
             /* If after the removal the node has just a single child
              * and is not a key, we need to try to compress it. */
-            if (new->size == 1 && new->iskey == 0) {
-                trycompress = 1;
-                h = new;
-            }
+            if (h->size == 1 && h->iskey == 0) trycompress = 1;
         }
     } else if (h->size == 1) {
         /* If the node had just one child, after the removal of the key
@@ -1093,144 +1714,80 @@ int raxRemove(rax *rax, unsigned char *s, size_t len, void **old) {
      * complete because of OOM while executing raxLowWalk() */
     if (trycompress && ts.oom) trycompress = 0;
 
-    /* Recompression: if trycompress is true, 'h' points to a radix tree node
-     * that changed in a way that could allow to compress nodes in this
-     * sub-branch. Compressed nodes represent chains of nodes that are not
-     * keys and have a single child, so there are two deletion events that
-     * may alter the tree so that further compression is needed:
-     *
-     * 1) A node with a single child was a key and now no longer is a key.
-     * 2) A node with two children now has just one child.
-     *
-     * We try to navigate upward till there are other nodes that can be
-     * compressed, when we reach the upper node which is not a key and has
-     * a single child, we scan the chain of children to collect the
-     * compressable part of the tree, and replace the current node with the
-     * new one, fixing the child pointer to reference the first non
-     * compressable node.
-     *
-     * Example of case "1". A tree stores the keys "FOO" = 1 and
-     * "FOOBAR" = 2:
-     *
-     *
-     * "FOO" -> "BAR" -> [] (2)
-     *           (1)
-     *
-     * After the removal of "FOO" the tree can be compressed as:
-     *
-     * "FOOBAR" -> [] (2)
-     *
-     *
-     * Example of case "2". A tree stores the keys "FOOBAR" = 1 and
-     * "FOOTER" = 2:
-     *
-     *          |B| -> "AR" -> [] (1)
-     * "FOO" -> |-|
-     *          |T| -> "ER" -> [] (2)
-     *
-     * After the removal of "FOOTER" the resulting tree is:
-     *
-     * "FOO" -> |B| -> "AR" -> [] (1)
-     *
-     * That can be compressed into:
-     *
-     * "FOOBAR" -> [] (1)
-     */
     if (trycompress) {
         debugf("After removing %.*s:\n", (int)len, s);
-        debugnode("Compression may be needed",h);
-        debugf("Seek start node\n");
-
-        /* Try to reach the upper node that is compressible.
-         * At the end of the loop 'h' will point to the first node we
-         * can try to compress and 'parent' to its parent. */
-        raxNode *parent;
-        while(1) {
-            parent = raxStackPop(&ts);
-            if (!parent || parent->iskey ||
-                (!parent->iscompr && parent->size != 1)) break;
-            h = parent;
-            debugnode("Going up to",h);
-        }
-        raxNode *start = h; /* Compression starting node. */
-
-        /* Scan chain of nodes we can compress. */
-        size_t comprsize = h->size;
-        int nodes = 1;
-        while(h->size != 0) {
-            raxNode **cp = raxNodeLastChildPtr(h);
-            memcpy(&h,cp,sizeof(h));
-            if (h->iskey || (!h->iscompr && h->size != 1)) break;
-            /* Stop here if going to the next node would result into
-             * a compressed node larger than h->size can hold. */
-            if (comprsize + h->size > RAX_NODE_MAX_SIZE) break;
-            nodes++;
-            comprsize += h->size;
-        }
-        if (nodes > 1) {
-            /* If we can compress, create the new node and populate it. */
-            size_t nodesize =
-                sizeof(raxNode)+comprsize+raxPadding(comprsize)+sizeof(raxNode*);
-            raxNode *new = rax_malloc(nodesize);
-            /* An out of memory here just means we cannot optimize this
-             * node, but the tree is left in a consistent state. */
-            if (new == NULL) {
-                raxStackFree(&ts);
-                return 1;
-            }
-            new->iskey = 0;
-            new->isnull = 0;
-            new->iscompr = 1;
-            new->size = comprsize;
-            rax->numnodes++;
-
-            /* Scan again, this time to populate the new node content and
-             * to fix the new node child pointer. At the same time we free
-             * all the nodes that we'll no longer use. */
-            comprsize = 0;
-            h = start;
-            while(h->size != 0) {
-                memcpy(new->data+comprsize,h->data,h->size);
-                comprsize += h->size;
-                raxNode **cp = raxNodeLastChildPtr(h);
-                raxNode *tofree = h;
-                memcpy(&h,cp,sizeof(h));
-                rax_free(tofree); rax->numnodes--;
-                if (h->iskey || (!h->iscompr && h->size != 1)) break;
-            }
-            debugnode("New node",new);
+        raxRecompress(rax,h,&ts);
+    }
+    raxStackFree(&ts);
+    return 1;
+}
 
-            /* Now 'h' points to the first node that we still need to use,
-             * so our new node child pointer will point to it. */
-            raxNode **cp = raxNodeLastChildPtr(new);
-            memcpy(cp,&h,sizeof(h));
+/* Remove the specified item as raxRemove() does, and in the same ascent
+ * the keys at the 'count' lengths in 'lens', ascending proper prefixes of
+ * it, as long as each is left without children: the deepest first, up to
+ * the first that is not a key or still has children. The values of these
+ * prefixes are dropped, and their number is set in '*pruned' if not NULL.
+ * Returns 1 if the item was found and deleted. Otherwise returns 0, with
+ * errno set to ENOMEM if the walk could not keep the parent nodes, in
+ * which case the tree is unchanged, or to 0 if the item was not there. */
+int raxRemoveWithPrune(rax *rax, unsigned char *s, size_t len, void **old, size_t *lens, size_t count, size_t *pruned) {
+    raxNode *h;
+    raxStack ts;
 
-            /* Fix parent link. */
-            if (parent) {
-                raxNode **parentlink = raxFindParentLink(parent,start);
-                memcpy(parentlink,&new,sizeof(new));
-            } else {
-                rax->head = new;
-            }
+    debugf("### Delete with prune: %.*s\n", (int)len, s);
+    if (pruned) *pruned = 0;
+    raxStackInit(&ts);
+    int splitpos = 0;
+    size_t i = raxLowWalk(rax,s,len,&h,NULL,&splitpos,&ts);
+    if (ts.oom) {
+        raxStackFree(&ts);
+        errno = ENOMEM;
+        return 0;
+    }
+    if (i != len || (h->iscompr && splitpos != 0) || !h->iskey) {
+        raxStackFree(&ts);
+        errno = 0;
+        return 0;
+    }
+    if (old) *old = raxGetData(h);
+    h->iskey = 0;
+    rax->numele--;
 
-            debugf("Compressed %d nodes, %d total bytes\n",
-                nodes, (int)comprsize);
-        }
+    /* Free the nodes left without children as raxRemove() does, keeping
+     * the length of the key at 'h' so that a prefix key reached with no
+     * children left can be removed in turn, and its nodes freed too. */
+    size_t pos = len;
+    while(h->size == 0 && h != rax->head) {
+        raxNode *child = h;
+        raxNodeFree(rax,child,raxNodeCurrentLength(child));
+        rax->numnodes--;
+        h = raxStackPop(&ts);
+        pos -= h->iscompr ? h->size : 1;
+        h = raxUnlinkChild(rax,h,child,&ts,&pos);
+        if (count == 0 || lens[count-1] != pos || !h->iskey || h->size != 0)
+            break;
+        debugf("Pruning prefix %.*s\n", (int)pos, s);
+        h->iskey = 0;
+        rax->numele--;
+        count--;
+        if (pruned) (*pruned)++;
     }
+
+    if (h->size == 1 && h->iskey == 0) raxRecompress(rax,h,&ts);
     raxStackFree(&ts);
     return 1;
 }
 
-/* This is the core of raxFree(): performs a depth-first scan of the
- * tree and releases all the nodes found. */
-void raxRecursiveFree(rax *rax, raxNode *n, void (*free_callback)(void*)) {
+/* Performs a depth-first scan of the subtree at 'n', accounting for and
+ * releasing all the nodes found unless 'freenodes' is zero. */
+static void raxRecursiveFreeNodes(rax *rax, raxNode *n, void (*free_callback)(void*), int freenodes) {
     debugnode("free traversing",n);
-    int numchildren = n->iscompr ? 1 : n->size;
+    int numslots = raxNodeNumSlots(n);
     raxNode **cp = raxNodeLastChildPtr(n);
-    while(numchildren--) {
+    while(numslots--) {
         raxNode *child;
         memcpy(&child,cp,sizeof(child));
-        raxRecursiveFree(rax,child,free_callback);
+        if (child) raxRecursiveFreeNodes(rax,child,free_callback,freenodes);
         cp--;
     }
     debugnode("free depth-first",n);
@@ -1240,15 +1797,27 @@ void raxRecursiveFree(rax *rax, raxNode *n, void (*free_callback)(void*)) {
         if (free_callback && !n->isnull) free_callback(raxGetData(n));
     }
 
-    rax_free(n);
+    if (freenodes) raxNodeFree(rax,n,raxNodeCurrentLength(n));
     rax->numnodes--;
 }
 
+/* This is the core of raxFree(). When the allocator releases the nodes in
+ * bulk the scan only calls the free callback. */
+void raxRecursiveFree(rax *rax, raxNode *n, void (*free_callback)(void*)) {
+    raxRecursiveFreeNodes(rax,n,free_callback,!rax->alloc || !rax->alloc->release);
+}
+
 /* Free a whole radix tree, calling the specified callback in order to
  * free the auxiliary data. */
 void raxFreeWithCallback(rax *rax, void (*free_callback)(void*)) {
-    raxRecursiveFree(rax,rax->head,free_callback);
-    assert(rax->numnodes == 0);
+    if (rax->alloc && rax->alloc->release) {
+        /* No need to visit the nodes at all without a callback. */
+        if (free_callback) raxRecursiveFree(rax,rax->head,free_callback);
+        rax->alloc->release(rax->alloc->ctx);
+    } else {
+        raxRecursiveFree(rax,rax->head,free_callback);
+        assert(rax->numnodes == 0);
+    }
     rax_free(rax);
 }
 
@@ -1257,6 +1826,322 @@ void raxFree(rax *rax) {
     raxFreeWithCallback(rax,NULL);
 }
 
+/* ----------------------------------------------------------------------------
+ * Bulk loading
+ * ----------------------------------------------------------------------------
+ *
+ * raxBulkLoad() builds a tree from keys given in ascending order, bottom-up
+ * and without the splits and reallocations of raxInsert(). The path to the
+ * last key is kept as a stack of frames, one per node on it that is a key,
+ * has more than one child, or is the head. The next key shares a prefix with
+ * the last one: the frames deeper than that prefix can get no more children,
+ * so they are turned into nodes of their exact final size, and the next key
+ * opens a frame below the prefix. The bytes between a frame and the next one
+ * down are those of the last key, and end up either in the compressed node
+ * of a frame having a single child, or in a compressed node of their own
+ * below the edge byte of a frame having more.
+ * ------------------------------------------------------------------------- */
+
+typedef struct raxBulkFrame {
+    size_t depth;       /* Length of the key leading to the node. */
+    size_t children;    /* Its first finished child in the child stack. */
+    raxNode *pending;   /* Its last child, still to be linked. */
+    size_t pendingdepth;/* Depth of the pending child. */
+    int iskey;
+    void *data;
+} raxBulkFrame;
+
+typedef struct raxBulkChild {
+    unsigned char c;
+    raxNode *node;
+} raxBulkChild;
+
+typedef struct raxBulkLoader {
+    rax *rax;
+    raxBulkFrame *frames;
+    size_t numframes;
+    size_t maxframes;
+    raxBulkChild *children;
+    size_t numchildren;
+    size_t maxchildren;
+    unsigned char *key; /* The last key. */
+    size_t keylen;
+    size_t maxkey;
+} raxBulkLoader;
+
+/* Grow the array '*items' of '*max' items of 'size' bytes so it can hold
+ * 'count' of them. Returns 0 on out of memory. */
+static int raxBulkGrow(void **items, size_t *max, size_t size, size_t count) {
+    if (count <= *max) return 1;
+    size_t newmax = *max ? *max : 16;
+    while (newmax < count) newmax *= 2;
+    void *newitems = rax_realloc(*items,newmax*size);
+    if (newitems == NULL) return 0;
+    *items = newitems;
+    *max = newmax;
+    return 1;
+}
+
+/* Allocate compressed nodes for the 'len' bytes at 's', leading to 'child',
+ * with the first one holding the key with 'data' if 'iskey' is true.
+ * Returns the first node, or NULL on out of memory with 'child' left as
+ * it is. */
+static raxNode *raxBulkCompressed(rax *rax, unsigned char *s, size_t len, raxNode *child, int iskey, void *data) {
+    raxNode *last = child;
+    while(1) {
+        size_t comprsize = len > RAX_NODE_MAX_SIZE ? RAX_NODE_MAX_SIZE : len;
+        int hasdata = iskey && comprsize == len && data != NULL;
+        size_t nodesize = sizeof(raxNode)+comprsize+raxPadding(comprsize)+sizeof(raxNode*)+
+                          (hasdata ? sizeof(void*) : 0);
+        raxNode *n = raxNodeMalloc(rax,nodesize);
+        if (n == NULL) {
+            /* Free the nodes of a chain too long for a single node. */
+            while(child != last) {
+                raxNode *next;
+                memcpy(&next,raxNodeFirstChildPtr(child),sizeof(next));
+                raxNodeFree(rax,child,raxNodeCurrentLength(child));
+                rax->numnodes--;
+                child = next;
+            }
+            return NULL;
+        }
+        n->iskey = 0;
+        n->isnull = 0;
+        n->iscompr = 1;
+        n->size = comprsize;
+        memcpy(n->data,s+len-comprsize,comprsize);
+        memcpy(raxNodeFirstChildPtr(n),&child,sizeof(child));
+        rax->numnodes++;
+        child = n;
+        len -= comprsize;
+        if (len == 0) break;
+    }
+    if (iskey) {
+        raxSetData(child,data);
+        rax->numele++;
+    }
+    return child;
+}
+
+/* Link the pending child of 'f' as a finished child, with a compressed node
+ * for the bytes of the last key past its edge byte. Returns 0 on out of
+ * memory. */
+static int raxBulkSettle(raxBulkLoader *bl, raxBulkFrame *f) {
+    if (f->pending == NULL) return 1;
+    if (!raxBulkGrow((void**)&bl->children,&bl->maxchildren,sizeof(raxBulkChild),bl->numchildren+1)) return 0;
+    raxNode *node = f->pending;
+    size_t chainlen = f->pendingdepth-f->depth-1;
+    if (chainlen) {
+        node = raxBulkCompressed(bl->rax,bl->key+f->depth+1,chainlen,node,0,NULL);
+        if (node == NULL) return 0;
+    }
+    bl->children[bl->numchildren].c = bl->key[f->depth];
+    bl->children[bl->numchildren++].node = node;
+    f->pending = NULL;
+    return 1;
+}
+
+/* Turn the frame 'f', that gets no more children, into its node. Returns
+ * NULL on out of memory, with the children still owned by the frame. */
+static raxNode *raxBulkFinish(raxBulkLoader *bl, raxBulkFrame *f) {
+    rax *rax = bl->rax;
+    size_t numchildren = bl->numchildren-f->children;
+
+    /* A single child: the node is compressed. */
+    if (numchildren == 0 && f->pending) {
+        raxNode *n = raxBulkCompressed(rax,bl->key+f->depth,f->pendingdepth-f->depth,f->pending,f->iskey,f->data);
+        if (n) f->pending = NULL;
+        return n;
+    }
+
+    if (!raxBulkSettle(bl,f)) return NULL;
+    numchildren = bl->numchildren-f->children;
+    int direct = numchildren > RAX_NODE_MAX_SORTED;
+    size_t charslen = direct ? 0 : numchildren;
+    size_t numslots = direct ? RAX_DIRECT_SLOTS : numchildren;
+    size_t nodesize = sizeof(raxNode)+charslen+raxPadding(charslen)+sizeof(raxNode*)*numslots+
+                      ((f->iskey && f->data != NULL) ? sizeof(void*) : 0);
+    raxNode *n = raxNodeMalloc(rax,nodesize);
+    if (n == NULL) return NULL;
+    n->iskey = 0;
+    n->isnull = 0;
+    n->iscompr = 0;
+    n->size = numchildren;
+
+    raxNode **cp = raxNodeFirstChildPtr(n);
+    raxBulkChild *child = bl->children+f->children;
+    if (direct) memset(cp,0,sizeof(raxNode*)*RAX_DIRECT_SLOTS);
+    for (size_t j = 0; j < numchildren; j++, child++) {
+        if (direct) {
+            memcpy(cp+child->c,&child->node,sizeof(child->node));
+        } else {
+            n->data[j] = child->c;
+            memcpy(cp+j,&child->node,sizeof(child->node));
+        }
+    }
+    bl->numchildren = f->children;
+    rax->numnodes++;
+    if (f->iskey) {
+        raxSetData(n,f->data);
+        rax->numele++;
+    }
+    return n;
+}
+
+/* Turn the frames deeper than 'depth' into nodes, linking each to the frame
+ * above it. A frame is opened at 'depth' when the path forks there. Returns
+ * 0 on out of memory. */
+static int raxBulkClose(raxBulkLoader *bl, size_t depth) {
+    while(bl->frames[bl->numframes-1].depth > depth) {
+        raxBulkFrame *f = bl->frames+bl->numframes-1;
+        raxNode *n = raxBulkFinish(bl,f);
+        if (n == NULL) return 0;
+        size_t childdepth = f->depth;
+        bl->numframes--;
+        f--;
+        if (f->depth < depth) {
+            /* The path forks at 'depth': open a frame there, in place of
+             * the one just finished. */
+            f++;
+            bl->numframes++;
+            f->depth = depth;
+            f->children = bl->numchildren;
+            f->iskey = 0;
+            f->data = NULL;
+        }
+        f->pending = n;
+        f->pendingdepth = childdepth;
+    }
+    return 1;
+}
+
+/* Free the nodes built so far. */
+static void raxBulkAbort(raxBulkLoader *bl) {
+    for (size_t j = 0; j < bl->numchildren; j++)
+        raxRecursiveFreeNodes(bl->rax,bl->children[j].node,NULL,1);
+    for (size_t j = 0; j < bl->numframes; j++) {
+        if (bl->frames[j].pending) raxRecursiveFreeNodes(bl->rax,bl->frames[j].pending,NULL,1);
+    }
+}
+
+/* Load the keys returned by 'next' into the tree 'rax', that must be empty
+ * but for the empty key, which is kept unless it is loaded again. The keys
+ * must come in ascending order, and a key given again replaces the value of
+ * the last one. 'next' sets the next key, its length and its value and
+ * returns 1, or returns 0 at the end of the keys, or -1 with errno set on
+ * error. The key only needs to stay valid until 'next' is called again.
+ *
+ * Returns 1 on success. Otherwise returns 0 with errno set to EINVAL if
+ * the tree held other keys or the keys were out of order, ENOMEM on out of
+ * memory, or to what 'next' set, leaving the tree as it was. */
+int raxBulkLoadWithCallback(rax *rax, raxBulkNextFunc next, void *privdata) {
+    if (rax->numele != rax->head->iskey || rax->head->size != 0) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    raxBulkLoader bl = {.rax = rax};
+    int rc = 0;
+
+    /* The empty key is counted again along with the new head. */
+    int headkey = rax->head->iskey;
+    rax->numele -= headkey;
+
+    if (!raxBulkGrow((void**)&bl.frames,&bl.maxframes,sizeof(raxBulkFrame),1)) goto oom;
+    memset(bl.frames,0,sizeof(raxBulkFrame));
+    bl.numframes = 1;
+    if (headkey) {
+        bl.frames[0].iskey = 1;
+        bl.frames[0].data = raxGetData(rax->head);
+    }
+
+    while(1) {
+        unsigned char *s;
+        size_t len;
+        void *data;
+        int got = next(privdata,&s,&len,&data);
+        if (got < 0) goto fail;
+        if (got == 0) break;
+
+        size_t lcp = 0;
+        size_t minlen = len < bl.keylen ? len : bl.keylen;
+        while(lcp < minlen && s[lcp] == bl.key[lcp]) lcp++;
+
+        if (lcp == len && len == bl.keylen) {
+            /* The same key again, or the empty key first. */
+            raxBulkFrame *f = bl.frames+bl.numframes-1;
+            f->iskey = 1;
+            f->data = data;
+            continue;
+        }
+        if (lcp == len || (lcp < bl.keylen && s[lcp] < bl.key[lcp])) {
+            errno = EINVAL;
+            goto fail;
+        }
+
+        if (!raxBulkGrow((void**)&bl.frames,&bl.maxframes,sizeof(raxBulkFrame),bl.numframes+1) ||
+            !raxBulkGrow((void**)&bl.key,&bl.maxkey,1,len) ||
+            !raxBulkClose(&bl,lcp) ||
+            !raxBulkSettle(&bl,bl.frames+bl.numframes-1)) goto oom;
+
+        /* The frame at the end of the new key. */
+        raxBulkFrame *f = bl.frames+bl.numframes++;
+        f->depth = len;
+        f->children = bl.numchildren;
+        f->pending = NULL;
+        f->iskey = 1;
+        f->data = data;
+        if (len > lcp) memcpy(bl.key+lcp,s+lcp,len-lcp);
+        bl.keylen = len;
+    }
+
+    if (!raxBulkClose(&bl,0)) goto oom;
+    raxNode *head = raxBulkFinish(&bl,bl.frames);
+    if (head == NULL) goto oom;
+    raxNodeFree(rax,rax->head,raxNodeCurrentLength(rax->head));
+    rax->numnodes--;
+    rax->head = head;
+    rc = 1;
+    goto done;
+
+oom:
+    errno = ENOMEM;
+fail:
+    raxBulkAbort(&bl);
+    rax->numele += headkey;
+done:
+    rax_free(bl.frames);
+    rax_free(bl.children);
+    rax_free(bl.key);
+    return rc;
+}
+
+typedef struct raxBulkArray {
+    unsigned char **keys;
+    size_t *lens;
+    void **data;
+    size_t count;
+    size_t pos;
+} raxBulkArray;
+
+static int raxBulkArrayNext(void *privdata, unsigned char **key, size_t *len, void **data) {
+    raxBulkArray *ba = privdata;
+    if (ba->pos == ba->count) return 0;
+    *key = ba->keys[ba->pos];
+    *len = ba->lens[ba->pos];
+    *data = ba->data ? ba->data[ba->pos] : NULL;
+    ba->pos++;
+    return 1;
+}
+
+/* Load 'count' keys from the arrays 'keys' and 'lens', with the values in
+ * 'data' or NULL values if it is NULL, into the empty tree 'rax'. See
+ * raxBulkLoadWithCallback(). */
+int raxBulkLoad(rax *rax, unsigned char **keys, size_t *lens, void **data, size_t count) {
+    raxBulkArray ba = {keys, lens, data, count, 0};
+    return raxBulkLoadWithCallback(rax,raxBulkArrayNext,&ba);
+}
+
 /* ------------------------------- Iterator --------------------------------- */
 
 /* Initialize a Rax iterator. This call should be performed a single time
@@ -1375,11 +2260,16 @@ int raxIteratorNextStep(raxIterator *it, int noup) {
             /* Seek the lexicographically smaller key in this subtree, which
              * is the first one found always going torwards the first child
              * of every successive node. */
-            raxIteratorPushChildOffset(it, 0); // push 0 to offsetv
+            int pos = raxNextChildPos(it->node,0);
+            raxIteratorPushChildOffset(it, pos); // push first child offset to offsetv
             if (!raxStackPush(&it->stack,it->node)) return 0;
-            raxNode **cp = raxNodeFirstChildPtr(it->node);
-            if (!raxIteratorAddChars(it,it->node->data,
-                it->node->iscompr ? it->node->size : 1)) return 0;
+            raxNode **cp = raxNodeFirstChildPtr(it->node) + pos;
+            if (it->node->iscompr) {
+                if (!raxIteratorAddChars(it,it->node->data,it->node->size)) return 0;
+            } else {
+                unsigned char c = raxChildChar(it->node,pos);
+                if (!raxIteratorAddChars(it,&c,1)) return 0;
+            }
             memcpy(&it->node,cp,sizeof(it->node));
             /* Call the node callback if any, and replace the node pointer
              * if the callback returns true. */
@@ -1429,11 +2319,13 @@ int raxIteratorNextStep(raxIterator *it, int noup) {
                  * additional child. */
                 if (!it->node->iscompr && it->node->size > (old_noup ? 0 : 1)) {
                     debugf("it->node->size: %d\n", it->node->size);
-                    if (it->child_offset + (old_noup ? 0 : 1) != it->node->size) {
-                        it->child_offset += (old_noup ? 0 : 1); // set parent offset to current child
+                    int pos = raxNextChildPos(it->node, it->child_offset + (old_noup ? 0 : 1));
+                    if (pos != -1) {
+                        it->child_offset = pos; // set parent offset to current child
                         raxNode **cp = raxNodeFirstChildPtr(it->node) + it->child_offset;
+                        unsigned char c = raxChildChar(it->node,pos);
                         debugf("SCAN found a new node\n");
-                        raxIteratorAddChars(it,it->node->data + it->child_offset, 1);
+                        raxIteratorAddChars(it,&c,1);
                         raxIteratorPushChildOffset(it, it->child_offset);
                         it->child_offset = 0; // set current_offset to 0
                         if (!raxStackPush(&it->stack,it->node)) return 0;
@@ -1458,16 +2350,18 @@ int raxIteratorNextStep(raxIterator *it, int noup) {
  * iteration functions below. */
 int raxSeekGreatest(raxIterator *it) {
     while(it->node->size) {
+        int pos = 0;
         if (it->node->iscompr) {
             if (!raxIteratorAddChars(it,it->node->data,
                 it->node->size)) return 0;
             raxIteratorPushChildOffset(it, 0);
         } else {
-            if (!raxIteratorAddChars(it,it->node->data+it->node->size-1,1))
-                return 0;
-            raxIteratorPushChildOffset(it, it->node->size - 1);
+            pos = raxPrevChildPos(it->node,raxNodeNumSlots(it->node));
+            unsigned char c = raxChildChar(it->node,pos);
+            if (!raxIteratorAddChars(it,&c,1)) return 0;
+            raxIteratorPushChildOffset(it, pos);
         }
-        raxNode **cp = raxNodeLastChildPtr(it->node);
+        raxNode **cp = raxNodeFirstChildPtr(it->node) + pos;
         if (!raxStackPush(&it->stack,it->node)) return 0;
         memcpy(&it->node,cp,sizeof(it->node));
     }
@@ -1522,13 +2416,15 @@ int raxIteratorPrevStep(raxIterator *it, int noup) {
         /* Try visiting the prev child if there is at least one
          * child. */
         if (!it->node->iscompr && it->node->size > (old_noup ? 0 : 1)) {
-            if (it->child_offset != 0) {
-                it->child_offset -= 1;
+            int pos = raxPrevChildPos(it->node, it->child_offset);
+            if (pos != -1) {
+                it->child_offset = pos;
                 raxIteratorPushChildOffset(it, it->child_offset);
                 raxNode **cp = raxNodeFirstChildPtr(it->node) + it->child_offset;
+                unsigned char c = raxChildChar(it->node,pos);
                 debugf("SCAN found a new node\n");
                 /* Enter the node we just found. */
-                if (!raxIteratorAddChars(it,it->node->data + it->child_offset, 1)) return 0;
+                if (!raxIteratorAddChars(it,&c,1)) return 0;
                 if (!raxStackPush(&it->stack,it->node)) return 0;
                 memcpy(&it->node,cp,sizeof(it->node));
                 /* Seek sub-tree max. */
@@ -1562,19 +2458,23 @@ static inline size_t raxLowWalkSeek(unsigned char *s, size_t len, int *splitpos,
 
             if (j != h->size) break;
         }
-        else {
-            for (j = 0; j < h->size; j++) {
-                if (v[j] >= s[i]) break;
-            }
+        else if (raxNodeIsDirect(h)) {
+            j = s[i];
 
-            if (v[j] > s[i]) {
+            if (raxNodeFirstChildPtr(h)[j] == NULL) { // the empty slot is where s[i] would be
                 k = j;
                 j = h->size;
                 break;
             }
 
-            if (j == h->size) {
+            i++;
+        }
+        else {
+            j = raxChildGE(h, s[i]);
+
+            if (j == h->size || v[j] != s[i]) { // k is where s[i] would be
                 k = j;
+                j = h->size;
                 break;
             }
 
@@ -1831,12 +2731,15 @@ int raxRandomWalk(raxIterator *it, size_t steps) {
             raxIteratorDelChars(it,todel);
         } else {
             /* Select a random child. */
+            int pos = raxNextChildPos(n,0);
+            while (r--) pos = raxNextChildPos(n,pos+1);
             if (n->iscompr) {
                 if (!raxIteratorAddChars(it,n->data,n->size)) return 0;
             } else {
-                if (!raxIteratorAddChars(it,n->data+r,1)) return 0;
+                unsigned char c = raxChildChar(n,pos);
+                if (!raxIteratorAddChars(it,&c,1)) return 0;
             }
-            raxNode **cp = raxNodeFirstChildPtr(n)+r;
+            raxNode **cp = raxNodeFirstChildPtr(n)+pos;
             if (!raxStackPush(&it->stack,n)) return 0;
             memcpy(&n,cp,sizeof(n));
         }
@@ -1929,8 +2832,10 @@ uint64_t raxSize(rax *rax) {
 void raxRecursiveShow(int level, int lpad, raxNode *n) {
     char s = n->iscompr ? '"' : '[';
     char e = n->iscompr ? '"' : ']';
+    unsigned char buf[RAX_DIRECT_SLOTS];
+    unsigned char *chars = raxNodeChars(n,buf);
 
-    int numchars = printf("%c%.*s%c", s, n->size, n->data, e);
+    int numchars = printf("%c%.*s%c", s, n->size, chars, e);
     if (n->iskey) {
         numchars += printf("=%p",raxGetData(n));
     }
@@ -1943,19 +2848,20 @@ void raxRecursiveShow(int level, int lpad, raxNode *n) {
         if (numchildren == 1) lpad += numchars;
     }
     raxNode **cp = raxNodeFirstChildPtr(n);
+    int pos = raxNextChildPos(n,0);
     for (int i = 0; i < numchildren; i++) {
         char *branch = " `-(%c) ";
         if (numchildren > 1) {
             printf("\n");
             for (int j = 0; j < lpad; j++) putchar(' ');
-            printf(branch,n->data[i]);
+            printf(branch,chars[i]);
         } else {
             printf(" -> ");
         }
         raxNode *child;
-        memcpy(&child,cp,sizeof(child));
+        memcpy(&child,cp+pos,sizeof(child));
         raxRecursiveShow(level+1,lpad,child);
-        cp++;
+        pos = raxNextChildPos(n,pos+1);
     }
 }
 
@@ -1968,15 +2874,16 @@ void raxShow(rax *rax) {
 /* Used by debugnode() macro to show info about a given node. */
 void raxDebugShowNode(const char *msg, raxNode *n) {
     if (raxDebugMsg == 0) return;
+    unsigned char buf[RAX_DIRECT_SLOTS];
     printf("%s: %p [%.*s] key:%d size:%d children:",
-        msg, (void*)n, (int)n->size, (char*)n->data, n->iskey, n->size);
-    int numcld = n->iscompr ? 1 : n->size;
-    raxNode **cldptr = raxNodeLastChildPtr(n) - (numcld-1);
-    while(numcld--) {
+        msg, (void*)n, (int)n->size, (char*)raxNodeChars(n,buf), n->iskey, n->size);
+    int numslots = raxNodeNumSlots(n);
+    raxNode **cldptr = raxNodeFirstChildPtr(n);
+    while(numslots--) {
         raxNode *child;
         memcpy(&child,cldptr,sizeof(child));
         cldptr++;
-        printf("%p ", (void*)child);
+        if (child) printf("%p ", (void*)child);
     }
     printf("\n");
     fflush(stdout);
@@ -2008,17 +2915,18 @@ unsigned long raxTouch(raxNode *n) {
 
     int numchildren = n->iscompr ? 1 : n->size;
     raxNode **cp = raxNodeFirstChildPtr(n);
+    int pos = raxNextChildPos(n,0);
     int count = 0;
     for (int i = 0; i < numchildren; i++) {
         if (numchildren > 1) {
-            sum += (long)n->data[i];
+            sum += (long)raxChildChar(n,pos);
         }
         raxNode *child;
-        memcpy(&child,cp,sizeof(child));
+        memcpy(&child,cp+pos,sizeof(child));
         if (child == (void*)0x65d1760) count++;
         if (count > 1) exit(1);
         sum += raxTouch(child);
-        cp++;
+        pos = raxNextChildPos(n,pos+1);
     }
     return sum;
 }
@@ -2049,8 +2957,23 @@ int raxSeekRelative(raxIterator *it, unsigned char *key, size_t key_len) {
         it->child_offset = raxIteratorPopChildOffset(it);
     }
 
-    if (it->key_len == match_len) return raxSeekEle(it, "=", key + match_len, key_len - match_len);
-    else return raxSeek(it, "=", key, key_len);
+    if (it->key_len != match_len) return raxSeek(it, "=", key, key_len);
+
+    // a miss may leave nodes on the stack beyond the current key so restore the state at match_len
+    size_t orig_stack_items = it->stack.items;
+    size_t orig_cpos = it->cpos;
+    raxNode *orig_node = it->node;
+    size_t orig_child_offset = it->child_offset;
+    if (!raxSeekEle(it, "=", key + match_len, key_len - match_len)) return 0;
+
+    if (it->flags & RAX_ITER_EOF) {
+        it->stack.items = orig_stack_items;
+        it->cpos = orig_cpos;
+        it->node = orig_node;
+        it->child_offset = orig_child_offset;
+    }
+
+    return 1;
 }
 
 static int raxSeekSubtreeGeneric(raxIterator* it, uint8_t* key, size_t key_len, bool isrelative) {
@@ -2090,13 +3013,15 @@ void raxRecursiveShowHexKey(int level, int lpad, raxNode *n) {
 
     int numchars = printf("%s", ss);
     bool all_printable = true;
+    unsigned char buf[RAX_DIRECT_SLOTS];
+    unsigned char *chars = raxNodeChars(n, buf);
 
-    for (int i = 0; i < n->size && all_printable; i++) all_printable = isprint(n->data[i]);
+    for (int i = 0; i < n->size && all_printable; i++) all_printable = isprint(chars[i]);
 
-    if (all_printable) numchars += printf("%.*s", n->size, n->data);
+    if (all_printable) numchars += printf("%.*s", n->size, chars);
     else {
         if (n->size) numchars += printf("0x");
-        for (int i = 0; i < n->size; i++) numchars += printf("%02x", n->data[i]);
+        for (int i = 0; i < n->size; i++) numchars += printf("%02x", chars[i]);
     }
 
     numchars += printf("%s", ee);
@@ -2111,6 +3036,7 @@ void raxRecursiveShowHexKey(int level, int lpad, raxNode *n) {
     }
 
     raxNode** cp = raxNodeFirstChildPtr(n);
+    int pos = raxNextChildPos(n, 0);
 
     for (int i = 0; i < numchildren; i++) {
         char* branch = " `—(%c)";
@@ -2119,15 +3045,15 @@ void raxRecursiveShowHexKey(int level, int lpad, raxNode *n) {
             printf("\n");
             for (int j = 0; j < lpad; j++) putchar(' ');
 
-            if (isprint(n->data[i])) printf(branch, n->data[i]);
+            if (isprint(chars[i])) printf(branch, chars[i]);
             else printf(branch, '.');
         }
         else printf("->");
 
         raxNode* child;
-        memcpy(&child, cp, sizeof(child));
+        memcpy(&child, cp + pos, sizeof(child));
         raxRecursiveShowHexKey(level + 1, lpad, child);
-        cp++;
+        pos = raxNextChildPos(n, pos + 1);
     }
 }
 
@@ -2136,79 +3062,109 @@ void raxShowHexKey(rax* rax) {
     putchar('\n');
 }
 
-int raxRemoveSubtree(rax* tree, uint8_t* key, size_t len) {
-    raxIterator it;
-    raxStart(&it, tree);
+/* Remove all the keys starting with 'key' in a single walk: the subtree
+ * holding them is unlinked from its parent, which is then trimmed and
+ * recompressed as by raxRemove(), and its nodes are freed. The values are
+ * not freed. Returns 1, or 0 with errno set to ENOMEM if the walk could not
+ * keep the parent nodes, in which case the tree is unchanged. */
+int raxRemoveSubtree(rax* rax, uint8_t* key, size_t len) {
+    raxNode *h, *parent;
+    raxStack ts;
+    int splitpos = 0;
 
-    rax* del_tree = raxNew();
-    raxIterator it2;
-    raxStart(&it2, del_tree);
+    debugf("### Delete subtree: %.*s\n", (int)len, key);
+    raxStackInit(&ts);
+    size_t i = raxLowWalk(rax,key,len,&h,NULL,&splitpos,&ts);
+    if (ts.oom) {
+        raxStackFree(&ts);
+        errno = ENOMEM;
+        return 0;
+    }
+    if (i != len) { // no key starts with 'key'
+        raxStackFree(&ts);
+        return 1;
+    }
 
-    if (!raxSeekSubtree(&it, key, len)) return 0;
-    while(raxNext(&it)) raxInsert(del_tree, it.key, it.key_len, NULL, NULL);
+    if (h->iscompr && splitpos != 0) {
+        /* Stopped within a compressed node: its key is shorter than 'key',
+         * so the subtree is its only child. */
+        parent = h;
+        memcpy(&h,raxNodeLastChildPtr(parent),sizeof(h));
+    } else {
+        parent = raxStackPop(&ts);
+    }
 
-    if (!raxSeekSubtree(&it2, key, len)) return 0;
-    while(raxNext(&it2)) raxRemove(tree, it2.key, it2.key_len, NULL);
+    if (parent == NULL) {
+        /* The whole tree goes: keep the head as an empty node. */
+        int numslots = raxNodeNumSlots(h);
+        raxNode **cp = raxNodeFirstChildPtr(h);
+        for (int j = 0; j < numslots; j++) {
+            raxNode *child;
+            memcpy(&child,cp+j,sizeof(child));
+            if (child) raxRecursiveFreeNodes(rax,child,NULL,1);
+        }
+        if (h->iskey) rax->numele--;
+        size_t oldlen = raxNodeCurrentLength(h);
+        h->iskey = 0;
+        h->isnull = 0;
+        h->iscompr = 0;
+        h->size = 0;
+        raxNode *new = raxNodeRealloc(rax,h,oldlen,raxNodeCurrentLength(h));
+        if (new) rax->head = new;
+    } else {
+        raxRecursiveFreeNodes(rax,h,NULL,1);
+        h = raxUnlinkChild(rax,parent,h,&ts,NULL);
+        if (h->size == 1 && h->iskey == 0) raxRecompress(rax,h,&ts);
+    }
 
-    raxStop(&it2);
-    raxStop(&it);
-    raxFree(del_tree);
+    raxStackFree(&ts);
     return 1;
 }
 
-raxIterator* raxIteratorDup(raxIterator* piter) {
-    raxIterator* piterdup = rax_malloc(sizeof(raxIterator));
+// Copy iterator state into a caller-owned iterator; only heap buffers of the source cause allocation
+int raxIteratorCopy(raxIterator* pdst, raxIterator* piter) {
+    memcpy(pdst, piter, sizeof(raxIterator));
+    pdst->key = pdst->key_static_string;
+    pdst->child_offset_stack = pdst->child_offset_stack_static;
+    pdst->stack.stack = pdst->stack.static_items;
 
-    if (piterdup == NULL) {
-        errno = ENOMEM;
-        return NULL;
+    if (piter->key != piter->key_static_string) {
+        pdst->key = rax_malloc(piter->key_max);
+        if (pdst->key == NULL) goto oom;
+        memcpy(pdst->key, piter->key, piter->key_len);
     }
 
-    memcpy(piterdup, piter, sizeof(raxIterator));
-
-    if (piter->key == piter->key_static_string) {
-        piterdup->key = piterdup->key_static_string;
+    if (piter->child_offset_stack != piter->child_offset_stack_static) {
+        pdst->child_offset_stack = rax_malloc(piter->cpos_max);
+        if (pdst->child_offset_stack == NULL) goto oom;
+        memcpy(pdst->child_offset_stack, piter->child_offset_stack, piter->cpos);
     }
-    else {
-        piterdup->key = rax_malloc(piter->key_max);
-
-        if (piterdup->key == NULL) {
-            rax_free(piterdup);
-            errno = ENOMEM;
-            return NULL;
-        }
 
-        memcpy(piterdup->key, piter->key, piter->key_len);
+    if (piter->stack.stack != piter->stack.static_items) {
+        pdst->stack.stack = rax_malloc(piter->stack.maxitems * sizeof(void*));
+        if (pdst->stack.stack == NULL) goto oom;
+        memcpy(pdst->stack.stack, piter->stack.stack, piter->stack.items * sizeof(void*));
     }
 
-    if (piter->child_offset_stack == piter->child_offset_stack_static) {
-        piterdup->child_offset_stack = piterdup->child_offset_stack_static;
-    }
-    else {
-        piterdup->child_offset_stack = rax_malloc(piter->cpos_max);
+    return 1;
 
-        if (piterdup->child_offset_stack == NULL) {
-            rax_free(piterdup);
-            errno = ENOMEM;
-            return NULL;
-        }
+oom:
+    raxStop(pdst);
+    errno = ENOMEM;
+    return 0;
+}
 
-        memcpy(piterdup->child_offset_stack, piter->child_offset_stack, piter->cpos);
-    }
+raxIterator* raxIteratorDup(raxIterator* piter) {
+    raxIterator* piterdup = rax_malloc(sizeof(raxIterator));
 
-    if (piter->stack.stack == piter->stack.static_items) {
-        piterdup->stack.stack = piterdup->stack.static_items;
+    if (piterdup == NULL) {
+        errno = ENOMEM;
+        return NULL;
     }
-    else {
-        piterdup->stack.stack = rax_malloc(piter->stack.maxitems * sizeof(void*));
-
-        if (!piterdup->stack.stack) {
-            rax_free(piterdup);
-            errno = ENOMEM;
-            return NULL;
-        }
 
-        memcpy(piterdup->stack.stack, piter->stack.stack, piter->stack.maxitems * sizeof(void*));
+    if (!raxIteratorCopy(piterdup, piter)) {
+        rax_free(piterdup);
+        return NULL;
     }
 
     return piterdup;
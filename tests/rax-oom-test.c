@@ -161,10 +161,53 @@ cleanup:
     return 0;
 }
 
+/* A bulk load that fails for OOM, at any point, must leave the tree as it
+ * was: empty, or holding just the empty key. */
+int bulkoomtest(void) {
+    char *keys[] = {"alien","all","alligator","ba","baloon","chromodynamic","romane","romanus","romulus","rub","rubens","ruber","rubicon","rubicundus",NULL};
+    size_t lens[sizeof(keys)/sizeof(keys[0])];
+    unsigned long items = 0;
+    while(keys[items] != NULL) {
+        lens[items] = strlen(keys[items]);
+        items++;
+    }
+
+    rax *t = raxNew();
+    if (t == NULL) return 0; /* Ok... */
+    int headkey = rand() % 2 && raxInsert(t,(unsigned char*)"",0,(void*)1,NULL);
+
+    if (raxBulkLoad(t,(unsigned char**)keys,lens,NULL,items)) {
+        if (t->numele != items+headkey) {
+            printf("After bulk load: %d elements expected, got %d\n",
+                (int)(items+headkey), (int)t->numele);
+            return 1;
+        }
+    } else {
+        if (errno != ENOMEM) {
+            printf("Bulk load failed but errno != ENOMEM!\n");
+            return 1;
+        }
+        if (t->numele != (uint64_t)headkey || t->head->size != 0) {
+            printf("Bulk load failed for OOM but changed the tree: %d elements\n",
+                (int)t->numele);
+            return 1;
+        }
+        printf("Bulk load failed for OOM\n");
+    }
+
+    if (headkey && raxFind(t,(unsigned char*)"",0) != (void*)1) {
+        printf("Empty key lost by the bulk load\n");
+        return 1;
+    }
+
+    raxFree(t);
+    return 0;
+}
+
 int main(void) {
     srand(1234); /* Make the test reproducible. */
     for (int i = 0; i < 100000; i++) {
-        if (oomtest(i)) {
+        if (oomtest(i) || bulkoomtest()) {
             printf("Test failed\n");
             exit(1);
         }
@@ -250,9 +250,13 @@ static size_t int2key(char *s, size_t maxlen, uint32_t i, int mode) {
 /* -------------------------------------------------------------------------- */
 
 /* Perform a fuzz test, returns 0 on success, 1 on error. */
+/* Set by --slabs to run the fuzz tests on trees with a slab allocator. */
+int fuzz_slabs = 0;
+#define fuzzRaxNew() (fuzz_slabs ? raxNewWithSlabs() : raxNew())
+
 int fuzzTest(int keymode, size_t count, double addprob, double remprob) {
     hashtable *ht = htNew();
-    rax *rax = raxNew();
+    rax *rax = fuzzRaxNew();
 
     printf("Fuzz test in mode %d [%zu]: ", keymode, count);
     fflush(stdout);
@@ -349,7 +353,7 @@ int fuzzTestCluster(size_t count, double addprob, double remprob) {
     printf("Cluster Fuzz test [keys:%zu keylen:%d]: ", count, keylen);
     fflush(stdout);
 
-    rax *rax = raxNew();
+    rax *rax = fuzzRaxNew();
 
     /* This is our template to generate keys. The first two bytes will
      * be replaced with the binary redis cluster hash slot. */
@@ -445,7 +449,7 @@ int arraySeek(arrayItem *array, int count, unsigned char *key, size_t len, char
 
 int iteratorFuzzTest(int keymode, size_t count) {
     count = rc4rand()%count;
-    rax *rax = raxNew();
+    rax *rax = fuzzRaxNew();
     arrayItem *array = malloc(sizeof(arrayItem)*count);
 
     /* Fill a radix tree and a linear array with some data. */
@@ -690,6 +694,638 @@ int tryInsertUnitTests(void) {
     return 0;
 }
 
+/* Test that lookups and seeks through wide nodes give the same answers at
+ * every child search level, including bytes past the last child. */
+int childSearchUnitTests(void) {
+    int errors = 0;
+
+    for (int round = 0; round < 200 && !errors; round++) {
+        rax *t = raxNew();
+        unsigned char present[256] = {0};
+        unsigned char key[2] = {'X', 0};
+        int size = 1 + rc4rand() % 256;
+
+        for (int i = 0; i < size; i++) {
+            key[1] = rc4rand() & 0xff;
+            present[key[1]] = 1;
+            raxInsert(t, key, 2, (void*)(long)(key[1] + 1), NULL);
+        }
+
+        for (int level = RAX_SIMD_NONE; level <= RAX_SIMD_AVX2 && !errors; level++) {
+            if (raxSetSimdLevel(level) != level) break;
+            raxIterator it;
+            raxStart(&it, t);
+
+            for (int c = 0; c < 256; c++) {
+                key[1] = c;
+                void *val = raxFind(t, key, 2);
+                void *expected = present[c] ? (void*)(long)(c + 1) : raxNotFound;
+                if (val != expected) {
+                    printf("Child %d lookup at level %d: got %p\n", c, level, val);
+                    errors++;
+                    break;
+                }
+
+                int next = c;
+                while (next < 256 && !present[next]) next++;
+                raxSeek(&it, ">=", key, 2);
+                int found = raxNext(&it);
+                if (found != (next < 256) || (found && it.key[1] != next)) {
+                    printf("Child %d seek at level %d: expected %d\n", c, level, next);
+                    errors++;
+                    break;
+                }
+            }
+
+            raxStop(&it);
+        }
+
+        raxSetSimdLevel(RAX_SIMD_AVX2);
+        raxFree(t);
+    }
+
+    return errors;
+}
+
+/* Check the keys "X"+c, and "X"+c+"yz" for odd c, against the 'present'
+ * set: lookups, a forward and a backward scan, and "<" seeks. */
+static int checkWideNode(rax *t, unsigned char *present) {
+    unsigned char key[4] = {'X', 0, 'y', 'z'};
+    raxIterator it;
+    raxStart(&it, t);
+    int errors = 0;
+
+    for (int c = 0; c < 256 && !errors; c++) {
+        key[1] = c;
+        void *val = raxFind(t, key, 2);
+        if (val != (present[c] ? (void*)(long)(c + 1) : raxNotFound)) errors++;
+        if (c % 2 && (raxFind(t, key, 4) != raxNotFound) != present[c]) errors++;
+
+        int prev = c - 1;
+        while (prev >= 0 && !present[prev]) prev--;
+        raxSeek(&it, "<", key, 2);
+        int found = raxNext(&it);
+        if (found != (prev >= 0) || (found && it.key[1] != prev)) errors++;
+    }
+
+    int expected = 0;
+    raxSeek(&it, "^", NULL, 0);
+    while (raxNext(&it) && !errors) {
+        while (expected < 256 && !present[expected]) expected++;
+        if (it.key[1] != expected) errors++;
+        if (it.key_len == 2 && expected % 2) continue; /* "X"+c+"yz" follows. */
+        expected++;
+    }
+    while (expected < 256 && !present[expected]) expected++;
+    if (expected != 256) errors++;
+
+    raxSeek(&it, "$", NULL, 0);
+    expected = 255;
+    while (raxPrev(&it) && !errors) {
+        while (expected >= 0 && !present[expected]) expected--;
+        if (it.key[1] != expected) errors++;
+        if (it.key_len == 4) continue; /* "X"+c precedes. */
+        expected--;
+    }
+
+    raxStop(&it);
+    if (errors) printf("Wide node check failed with %d children\n", (int)t->numele);
+    return errors;
+}
+
+/* Test that nodes keep working as they grow past RAX_NODE_MAX_SORTED children
+ * and become direct, and as they shrink back, including the nodes count. */
+int wideNodeUnitTests(void) {
+    rax *t = raxNew();
+    unsigned char present[256] = {0};
+    unsigned char order[256];
+    unsigned char key[4] = {'X', 0, 'y', 'z'};
+    int errors = 0;
+
+    for (int c = 0; c < 256; c++) order[c] = c;
+    for (int round = 0; round < 4 && !errors; round++) {
+        for (int c = 255; c > 0; c--) {
+            int r = rc4rand() % (c + 1);
+            unsigned char tmp = order[c];
+            order[c] = order[r];
+            order[r] = tmp;
+        }
+
+        /* Fill the node, then empty it, checking around the switch. */
+        for (int i = 0; i < 256 && !errors; i++) {
+            int c = order[i];
+            key[1] = c;
+            raxInsert(t, key, 2, (void*)(long)(c + 1), NULL);
+            if (c % 2) raxInsert(t, key, 4, NULL, NULL);
+            present[c] = 1;
+            if (i < 8 || (i >= RAX_NODE_MAX_SORTED - 2 && i <= RAX_NODE_MAX_SORTED + 2) || i % 37 == 0)
+                errors += checkWideNode(t, present);
+        }
+
+        errors += checkWideNode(t, present);
+        for (int i = 0; i < 256 && !errors; i++) {
+            int c = order[(i * 7 + round) % 256];
+            key[1] = c;
+            raxRemove(t, key, 2, NULL);
+            if (c % 2) raxRemove(t, key, 4, NULL);
+            present[c] = 0;
+            int left = 255 - i;
+            if (left < 8 || (left >= RAX_NODE_MAX_SORTED - 2 && left <= RAX_NODE_MAX_SORTED + 2) || i % 37 == 0)
+                errors += checkWideNode(t, present);
+        }
+
+        if (t->numele != 0 || t->numnodes != 1) {
+            printf("Wide node test left %d keys in %d nodes\n", (int)t->numele, (int)t->numnodes);
+            errors++;
+        }
+    }
+
+    raxFree(t);
+    return errors;
+}
+
+/* Allocator counting its live blocks, that frees nodes one by one. */
+static long countingBlocks;
+static long countingFailAfter = -1; /* Allocations until one fails, -1 for never. */
+static void *countingMalloc(void *ctx, size_t size) {
+    (void)ctx;
+    if (countingFailAfter == 0) return NULL;
+    if (countingFailAfter > 0) countingFailAfter--;
+    countingBlocks++;
+    return malloc(size);
+}
+static void *countingRealloc(void *ctx, void *ptr, size_t oldsize, size_t size) {
+    (void)ctx; (void)oldsize;
+    if (ptr == NULL) countingBlocks++;
+    return realloc(ptr, size);
+}
+static void countingFree(void *ctx, void *ptr, size_t size) {
+    (void)ctx; (void)size;
+    if (ptr) countingBlocks--;
+    free(ptr);
+}
+
+static long freedValues;
+static void countFreedValue(void *val) {
+    (void)val;
+    freedValues++;
+}
+
+/* Test that trees using their own allocator, a slab allocator or a
+ * counting one, end up with the same keys and nodes as a plain tree under
+ * random inserts and removes of short, wide and long keys. */
+int allocatorUnitTests(void) {
+    raxAllocator counting = {countingMalloc, countingRealloc, countingFree, NULL, NULL};
+    rax *plain = raxNew();
+    rax *slabs = raxNewWithSlabs();
+    rax *counted = raxNewWithAllocator(&counting);
+    rax *trees[] = {plain, slabs, counted};
+    static unsigned char key[3000];
+    int errors = 0;
+
+    for (int i = 0; i < 200000 && !errors; i++) {
+        size_t len;
+        int mode = rc4rand() % 8;
+        if (mode == 0) {
+            len = 2100 + rc4rand() % 800; /* Beyond the slab size classes. */
+            memset(key, 'L', len);
+            key[len - 1] = rc4rand() % 4;
+        } else if (mode < 3) {
+            len = 2; /* Wide nodes. */
+            key[0] = 'W';
+            key[1] = rc4rand() & 0xff;
+        } else {
+            len = 1 + rc4rand() % 12;
+            for (size_t j = 0; j < len; j++) key[j] = 'a' + rc4rand() % 4;
+        }
+
+        void *val = (rc4rand() % 10) ? (void*)(long)(i + 1) : NULL;
+        int add = rc4rand() % 3;
+        int r[3];
+        for (int t = 0; t < 3; t++)
+            r[t] = add ? raxInsert(trees[t], key, len, val, NULL) : raxRemove(trees[t], key, len, NULL);
+        if (r[0] != r[1] || r[0] != r[2]) errors++;
+    }
+
+    for (int t = 1; t < 3 && !errors; t++) {
+        if (trees[t]->numele != plain->numele || trees[t]->numnodes != plain->numnodes) {
+            printf("Allocator tree %d has %d keys in %d nodes instead of %d in %d\n", t,
+                (int)trees[t]->numele, (int)trees[t]->numnodes, (int)plain->numele, (int)plain->numnodes);
+            errors++;
+        }
+
+        raxIterator a, b;
+        raxStart(&a, plain);
+        raxStart(&b, trees[t]);
+        raxSeek(&a, "^", NULL, 0);
+        raxSeek(&b, "^", NULL, 0);
+        while (raxNext(&a)) {
+            if (!raxNext(&b) || a.key_len != b.key_len || memcmp(a.key, b.key, a.key_len) || a.data != b.data) {
+                printf("Allocator tree %d differs\n", t);
+                errors++;
+                break;
+            }
+        }
+        if (!errors && raxNext(&b)) errors++;
+        raxStop(&a);
+        raxStop(&b);
+    }
+
+    long numvalues = 0;
+    raxIterator it;
+    raxStart(&it, slabs);
+    raxSeek(&it, "^", NULL, 0);
+    while (raxNext(&it)) numvalues += it.data != NULL;
+    raxStop(&it);
+
+    raxFree(plain);
+    raxFreeWithCallback(slabs, countFreedValue);
+    raxFree(counted);
+    if (freedValues != numvalues) {
+        printf("Slab tree freed %ld of %ld values\n", freedValues, numvalues);
+        errors++;
+    }
+    if (countingBlocks != 0) {
+        printf("Counting allocator left %ld blocks\n", countingBlocks);
+        errors++;
+    }
+
+    return errors;
+}
+
+/* Compare two trees key by key, values included. */
+static int sameKeys(rax *a, rax *b) {
+    raxIterator ia, ib;
+    int same = 1;
+    raxStart(&ia, a);
+    raxStart(&ib, b);
+    raxSeek(&ia, "^", NULL, 0);
+    raxSeek(&ib, "^", NULL, 0);
+    while (raxNext(&ia)) {
+        if (!raxNext(&ib) || ia.key_len != ib.key_len || memcmp(ia.key, ib.key, ia.key_len) || ia.data != ib.data) {
+            same = 0;
+            break;
+        }
+    }
+    if (same && raxNext(&ib)) same = 0;
+    raxStop(&ia);
+    raxStop(&ib);
+    return same;
+}
+
+/* Test that raxRemoveSubtree() leaves the same tree as removing each key
+ * of the subtree with raxRemove(), for prefixes ending between nodes,
+ * within compressed nodes and below wide nodes, and that it frees every
+ * node it unlinks. */
+int removeSubtreeUnitTests(void) {
+    raxAllocator counting = {countingMalloc, countingRealloc, countingFree, NULL, NULL};
+    unsigned char key[16], prefix[16];
+    int errors = 0;
+
+    for (int round = 0; round < 2000 && !errors; round++) {
+        rax *ref = raxNew();
+        rax *t = raxNewWithAllocator(&counting);
+        int numkeys = rc4rand() % 300;
+
+        for (int pass = 0; pass < 2 && !errors; pass++) {
+            for (int i = 0; i < numkeys; i++) {
+                size_t len;
+                if (rc4rand() % 4 == 0) {
+                    len = 3; /* Wide nodes. */
+                    key[0] = 'W';
+                    key[1] = 'a' + rc4rand() % 2;
+                    key[2] = rc4rand() & 0xff;
+                } else {
+                    len = rc4rand() % 9;
+                    for (size_t j = 0; j < len; j++) key[j] = 'a' + rc4rand() % 3;
+                }
+                void *val = (void*)(long)(i + 1);
+                raxInsert(ref, key, len, val, NULL);
+                raxInsert(t, key, len, val, NULL);
+            }
+
+            /* Mostly a prefix of a key in the tree, sometimes the empty one. */
+            size_t plen = 0;
+            if (rc4rand() % 20) {
+                raxIterator it;
+                raxStart(&it, ref);
+                raxSeek(&it, "^", NULL, 0);
+                for (int skip = ref->numele ? rc4rand() % ref->numele : 0; skip >= 0; skip--) raxNext(&it);
+                plen = it.key_len ? 1 + rc4rand() % it.key_len : 0;
+                memcpy(prefix, it.key, plen);
+                raxStop(&it);
+                if (plen && rc4rand() % 4 == 0) prefix[plen - 1] = 'a' + rc4rand() % 4;
+            }
+
+            raxIterator it;
+            raxStart(&it, ref);
+            raxSeek(&it, ">=", prefix, plen);
+            while (raxNext(&it) && it.key_len >= plen && memcmp(it.key, prefix, plen) == 0) {
+                raxRemove(ref, it.key, it.key_len, NULL);
+                raxSeek(&it, ">", it.key, it.key_len);
+            }
+            raxStop(&it);
+            if (!raxRemoveSubtree(t, prefix, plen)) errors++;
+
+            if (t->numele != ref->numele || t->numnodes != ref->numnodes || !sameKeys(ref, t)) {
+                printf("Subtree of %.*s removed to %d keys in %d nodes instead of %d in %d\n", (int)plen, prefix,
+                    (int)t->numele, (int)t->numnodes, (int)ref->numele, (int)ref->numnodes);
+                errors++;
+            }
+        }
+
+        raxFree(ref);
+        raxFree(t);
+        if (countingBlocks != 0) {
+            printf("Subtree removal left %ld blocks\n", countingBlocks);
+            errors++;
+        }
+    }
+
+    return errors;
+}
+
+static int compareKeys(const void *a, const void *b) {
+    const arrayItem *ka = a, *kb = b;
+    return compareAB(ka->key, ka->key_len, kb->key, kb->key_len);
+}
+
+/* Test that raxBulkLoad() builds the same keys and values as raxInsert()
+ * from sorted keys, in as many nodes, and that it rejects keys out
+ * of order or a tree that is not empty, and frees what it built when it
+ * runs out of memory. */
+int bulkLoadUnitTests(void) {
+    raxAllocator counting = {countingMalloc, countingRealloc, countingFree, NULL, NULL};
+    static arrayItem items[2000];
+    static unsigned char keystore[2000][12];
+    static unsigned char *keys[2000];
+    static size_t lens[2000];
+    static void *vals[2000];
+    int errors = 0;
+
+    for (int round = 0; round < 1000 && !errors; round++) {
+        size_t count = rc4rand() % 2000;
+        for (size_t i = 0; i < count; i++) {
+            unsigned char *key = items[i].key = keystore[i];
+            if (rc4rand() % 4 == 0) {
+                items[i].key_len = 2 + rc4rand() % 2; /* Wide nodes. */
+                key[0] = 'W';
+                for (size_t j = 1; j < items[i].key_len; j++) key[j] = rc4rand() & 0xff;
+            } else {
+                items[i].key_len = rc4rand() % 12;
+                for (size_t j = 0; j < items[i].key_len; j++) key[j] = 'a' + rc4rand() % 3;
+            }
+        }
+        qsort(items, count, sizeof(arrayItem), compareKeys);
+
+        /* Repeated keys keep the last value, as with raxInsert(). The
+         * empty key may already be there. */
+        rax *ref = raxNew();
+        rax *t = (round % 2) ? raxNewWithSlabs() : raxNewWithAllocator(&counting);
+        if (round % 3 == 0) {
+            raxInsert(ref,(unsigned char*)"",0,(void*)-1,NULL);
+            raxInsert(t,(unsigned char*)"",0,(void*)-1,NULL);
+        }
+        for (size_t i = 0; i < count; i++) {
+            keys[i] = items[i].key;
+            lens[i] = items[i].key_len;
+            vals[i] = (rc4rand() % 8) ? (void*)(long)(i + 1) : NULL;
+            raxInsert(ref, keys[i], lens[i], vals[i], NULL);
+        }
+
+        if (!raxBulkLoad(t, keys, lens, vals, count)) {
+            printf("Bulk load of %d keys failed\n", (int)count);
+            errors++;
+        } else if (t->numele != ref->numele || t->numnodes != ref->numnodes || !sameKeys(ref, t)) {
+            printf("Bulk load made %d keys in %d nodes instead of %d in %d\n",
+                (int)t->numele, (int)t->numnodes, (int)ref->numele, (int)ref->numnodes);
+            errors++;
+        }
+
+        /* The tree is a normal one: more keys can be added and removed. */
+        for (size_t i = 0; i < count && !errors; i += 3) {
+            raxRemove(ref, keys[i], lens[i], NULL);
+            raxRemove(t, keys[i], lens[i], NULL);
+            unsigned char key[3] = {'b', 'Z', (unsigned char)i};
+            raxInsert(ref, key, 3, NULL, NULL);
+            raxInsert(t, key, 3, NULL, NULL);
+        }
+        if (!errors && (t->numele != ref->numele || !sameKeys(ref, t))) {
+            printf("Bulk loaded tree differs after changes\n");
+            errors++;
+        }
+
+        /* Out of order keys, a tree that is not empty, out of memory: the
+         * tree is left as it was. */
+        if (!errors && count > 1 && compareKeys(&items[0], &items[count - 1])) {
+            rax *bad = raxNewWithAllocator(&counting);
+            size_t hasempty = round % 3 == 0;
+            if (hasempty) raxInsert(bad,(unsigned char*)"",0,(void*)-1,NULL);
+            keys[0] = items[count - 1].key;
+            lens[0] = items[count - 1].key_len;
+            errno = 0;
+            if (raxBulkLoad(bad, keys, lens, vals, count) || errno != EINVAL || bad->numele != hasempty ||
+                bad->numnodes != 1) {
+                printf("Bulk load took keys out of order\n");
+                errors++;
+            }
+            keys[0] = items[0].key;
+            lens[0] = items[0].key_len;
+
+            errno = 0;
+            if (raxBulkLoad(t, keys, lens, vals, count) || errno != EINVAL) {
+                printf("Bulk load into a tree that is not empty\n");
+                errors++;
+            }
+
+            countingFailAfter = rc4rand() % (count / 2 + 1);
+            errno = 0;
+            if (raxBulkLoad(bad, keys, lens, vals, count) || errno != ENOMEM || bad->numele != hasempty ||
+                bad->numnodes != 1 || (hasempty && raxFind(bad,(unsigned char*)"",0) != (void*)-1)) {
+                printf("Bulk load out of memory left %d keys in %d nodes\n", (int)bad->numele, (int)bad->numnodes);
+                errors++;
+            }
+            countingFailAfter = -1;
+            raxFree(bad);
+        }
+
+        raxFree(ref);
+        raxFree(t);
+        if (countingBlocks != 0) {
+            printf("Bulk load left %ld blocks\n", countingBlocks);
+            errors++;
+        }
+    }
+
+    return errors;
+}
+
+/* Test that raxTryInsertPrefixes() leaves the same tree, and reports the
+ * same new keys and old values, as raxTryInsert() of each prefix from the
+ * head, with the prefixes ending between nodes, within compressed nodes,
+ * below wide nodes and repeated. Out of memory keeps the keys inserted
+ * before the failure. */
+int insertPrefixesUnitTests(void) {
+    raxAllocator counting = {countingMalloc, countingRealloc, countingFree, NULL, NULL};
+    unsigned char key[24];
+    size_t lens[8];
+    void *vals[8], *given[8];
+    int inserted[8];
+    int errors = 0;
+
+    for (int round = 0; round < 2000 && !errors; round++) {
+        rax *ref = raxNew();
+        rax *t = raxNewWithAllocator(&counting);
+        int numkeys = rc4rand() % 300;
+
+        for (int i = 0; i < numkeys && !errors; i++) {
+            size_t len;
+            if (rc4rand() % 4 == 0) {
+                len = 4 + rc4rand() % 4; /* Wide nodes. */
+                key[0] = 'W';
+                for (size_t j = 1; j < len; j++) key[j] = (j % 2) ? rc4rand() & 0xff : 'a';
+            } else {
+                len = rc4rand() % 24;
+                for (size_t j = 0; j < len; j++) key[j] = 'a' + rc4rand() % 3;
+            }
+
+            size_t count = 1 + rc4rand() % 8;
+            for (size_t k = 0; k < count; k++) {
+                size_t min = k ? lens[k - 1] : 0;
+                lens[k] = (k == count - 1) ? len : min + rc4rand() % (len - min + 1);
+                vals[k] = given[k] = (rc4rand() % 8) ? (void*)(long)(i * 8 + k + 1) : NULL;
+            }
+
+            if (round % 10 == 0) countingFailAfter = rc4rand() % 3;
+            int ok = raxTryInsertPrefixes(t, key, lens, vals, inserted, count);
+            countingFailAfter = -1;
+
+            if (!ok && errno != ENOMEM) {
+                printf("Prefix insert failed without ENOMEM\n");
+                errors++;
+            }
+            for (size_t k = 0; k < count; k++) {
+                if (!ok && raxFind(t, key, lens[k]) == raxNotFound) break;
+                void *old = NULL;
+                int added = raxTryInsert(ref, key, lens[k], given[k], &old);
+                if (ok && (added != inserted[k] || vals[k] != (added ? given[k] : old))) {
+                    printf("Prefix %d of %.*s reported %d instead of %d\n", (int)lens[k], (int)len, key,
+                        inserted[k], added);
+                    errors++;
+                }
+            }
+        }
+
+        /* Out of memory may leave a split node behind, as with raxInsert(). */
+        int samenodes = t->numnodes == ref->numnodes || round % 10 == 0;
+        if (!errors && (t->numele != ref->numele || !samenodes || !sameKeys(ref, t))) {
+            printf("Prefix insert made %d keys in %d nodes instead of %d in %d\n",
+                (int)t->numele, (int)t->numnodes, (int)ref->numele, (int)ref->numnodes);
+            errors++;
+        }
+
+        raxFree(ref);
+        raxFree(t);
+        if (countingBlocks != 0) {
+            printf("Prefix insert left %ld blocks\n", countingBlocks);
+            errors++;
+        }
+    }
+
+    return errors;
+}
+
+/* Test that raxRemoveWithPrune() leaves the same tree, and reports the same
+ * value and pruned prefixes, as raxRemove() of the key followed by the
+ * removal of each prefix from the deepest while it is a leaf, with the keys
+ * and prefixes ending between nodes, within compressed nodes and below wide
+ * nodes. */
+int removeWithPruneUnitTests(void) {
+    raxAllocator counting = {countingMalloc, countingRealloc, countingFree, NULL, NULL};
+    unsigned char keys[300][16];
+    size_t keylens[300], lensv[300][6], counts[300];
+    int errors = 0;
+
+    for (int round = 0; round < 2000 && !errors; round++) {
+        rax *ref = raxNew();
+        rax *t = raxNewWithAllocator(&counting);
+        int numkeys = 1 + rc4rand() % 300;
+
+        for (int i = 0; i < numkeys; i++) {
+            unsigned char *key = keys[i];
+            size_t len, *lens = lensv[i];
+            if (rc4rand() % 4 == 0) {
+                len = 4 + rc4rand() % 4; /* Wide nodes. */
+                key[0] = 'W';
+                for (size_t j = 1; j < len; j++) key[j] = (j % 2) ? rc4rand() & 0xff : 'a';
+            } else {
+                len = rc4rand() % 16;
+                for (size_t j = 0; j < len; j++) key[j] = 'a' + rc4rand() % 3;
+            }
+
+            size_t count = len ? rc4rand() % 7 : 0;
+            for (size_t k = 0; k < count; k++) {
+                size_t min = k ? lens[k - 1] : 0;
+                lens[k] = min + rc4rand() % (len - min);
+            }
+
+            /* Insert the key and its prefixes. */
+            for (size_t k = 0; k < count; k++) {
+                raxInsert(ref, key, lens[k], (void*)(long)(i * 8 + k + 1), NULL);
+                raxInsert(t, key, lens[k], (void*)(long)(i * 8 + k + 1), NULL);
+            }
+            raxInsert(ref, key, len, (void*)(long)(i * 8 + 7), NULL);
+            raxInsert(t, key, len, (void*)(long)(i * 8 + 7), NULL);
+            keylens[i] = len;
+            counts[i] = count;
+        }
+
+        /* Remove the keys in another order, some with other prefixes, and
+         * keys that may not be there. */
+        for (int i = 0; i < 2 * numkeys && !errors; i++) {
+            int n = rc4rand() % numkeys;
+            unsigned char *key = keys[n];
+            size_t len = keylens[n], *lens = lensv[n], count = counts[n];
+            if (rc4rand() % 4 == 0) {
+                for (size_t j = 0; j < len; j++) key[j] = 'a' + rc4rand() % 3;
+                count = len ? rc4rand() % (count + 1) : 0;
+            }
+
+            void *refold = NULL, *old = NULL;
+            size_t refpruned = 0, pruned = 0;
+            int refremoved = raxRemove(ref, key, len, &refold);
+            if (refremoved) {
+                while (refpruned < count && raxIsLeaf(ref, key, lens[count - 1 - refpruned])) {
+                    raxRemove(ref, key, lens[count - 1 - refpruned], NULL);
+                    refpruned++;
+                }
+            }
+
+            int removed = raxRemoveWithPrune(t, key, len, &old, lens, count, &pruned);
+            if (removed != refremoved || old != refold || pruned != refpruned || (!removed && errno != 0)) {
+                printf("Remove with prune of %.*s reported %d, %d pruned instead of %d, %d\n", (int)len, key,
+                    removed, (int)pruned, refremoved, (int)refpruned);
+                errors++;
+            }
+        }
+
+        if (!errors && (t->numele != ref->numele || t->numnodes != ref->numnodes || !sameKeys(ref, t))) {
+            printf("Remove with prune left %d keys in %d nodes instead of %d in %d\n",
+                (int)t->numele, (int)t->numnodes, (int)ref->numele, (int)ref->numnodes);
+            errors++;
+        }
+
+        raxFree(ref);
+        raxFree(t);
+        if (countingBlocks != 0) {
+            printf("Remove with prune left %ld blocks\n", countingBlocks);
+            errors++;
+        }
+    }
+
+    return errors;
+}
+
 /* Regression test #1: Iterator wrong element returned after seek. */
 int regtest1(void) {
     rax *rax = raxNew();
@@ -956,11 +1592,146 @@ void benchmark(void) {
     }
 }
 
+/* Child byte lookup by node size at each SIMD level: one node with 'size'
+ * children spread over the byte range, each a leaf, found by raxFind() and
+ * by raxFindRelative() from an iterator left at the node. Nodes with more
+ * than RAX_NODE_MAX_SORTED children are direct and don't search at all. */
+void childBenchmark(void) {
+    int sizes[] = {4, 8, 16, 24, 32, 48, 64, 256};
+    const char *levels[] = {"scalar", "SSE2", "AVX2"};
+    int numlookups = 10000000;
+    unsigned char *picks = malloc(numlookups);
+
+    printf("Child lookup, ns per lookup by node size:\n");
+    printf("%6s %-8s %10s %10s\n", "size", "level", "raxFind", "relative");
+
+    for (int k = 0; k < (int)(sizeof(sizes) / sizeof(sizes[0])); k++) {
+        int size = sizes[k];
+        rax *t = raxNew();
+        unsigned char key[2] = {'X', 0};
+
+        for (int i = 0; i < size; i++) {
+            key[1] = (unsigned char)(i * 256 / size);
+            raxInsert(t, key, 2, (void*)(long)(i + 1), NULL);
+        }
+
+        for (int i = 0; i < numlookups; i++) picks[i] = (unsigned char)((rc4rand() % size) * 256 / size);
+
+        for (int level = RAX_SIMD_NONE; level <= RAX_SIMD_AVX2; level++) {
+            if (raxSetSimdLevel(level) != level) break;
+            long long start = ustime();
+            long found = 0;
+
+            for (int i = 0; i < numlookups; i++) {
+                key[1] = picks[i];
+                found += raxFind(t, key, 2) != raxNotFound;
+            }
+
+            double findns = (double)(ustime() - start) * 1000 / numlookups;
+            raxIterator it;
+            raxStart(&it, t);
+            raxSeekSubtree(&it, key, 1);
+            start = ustime();
+
+            for (int i = 0; i < numlookups; i++) {
+                key[1] = picks[i];
+                found += raxFindRelative(&it, key, 2) != raxNotFound;
+            }
+
+            double relns = (double)(ustime() - start) * 1000 / numlookups;
+            raxStop(&it);
+            if (found != 2L * numlookups) printf("** Lookups failed: %ld found\n", found);
+            printf("%6d %-8s %10.2f %10.2f\n", size, levels[level], findns, relns);
+        }
+
+        raxFree(t);
+    }
+
+    raxSetSimdLevel(RAX_SIMD_AVX2);
+    free(picks);
+}
+
+/* Insert, lookup, iteration and free times of a tree with 5M integer keys,
+ * allocated with rax_malloc() and with slabs. */
+void slabBenchmark(void) {
+    for (int slabs = 0; slabs < 2; slabs++) {
+        printf("Benchmark with integer keys %s:\n", slabs ? "in slabs" : "by rax_malloc()");
+        rax *t = slabs ? raxNewWithSlabs() : raxNew();
+        long long start = ustime();
+        for (int i = 0; i < 5000000; i++) {
+            char buf[64];
+            int len = int2key(buf,sizeof(buf),i,KEY_INT);
+            raxInsert(t,(unsigned char*)buf,len,(void*)(long)i,NULL);
+        }
+        printf("Insert: %f\n", (double)(ustime()-start)/1000000);
+
+        start = ustime();
+        for (int i = 0; i < 5000000; i++) {
+            char buf[64];
+            int len = int2key(buf,sizeof(buf),rc4rand() % 5000000,KEY_INT);
+            raxFind(t,(unsigned char*)buf,len);
+        }
+        printf("Random lookup: %f\n", (double)(ustime()-start)/1000000);
+
+        start = ustime();
+        raxIterator ri;
+        raxStart(&ri,t);
+        raxSeek(&ri,"^",NULL,0);
+        while (raxNext(&ri));
+        raxStop(&ri);
+        printf("Full iteration: %f\n", (double)(ustime()-start)/1000000);
+
+        start = ustime();
+        for (int i = 0; i < 5000000; i += 2) {
+            char buf[64];
+            int len = int2key(buf,sizeof(buf),i,KEY_INT);
+            raxRemove(t,(unsigned char*)buf,len,NULL);
+        }
+        printf("Remove half: %f\n", (double)(ustime()-start)/1000000);
+
+        printf("%llu total nodes\n", (unsigned long long)t->numnodes);
+        start = ustime();
+        raxFree(t);
+        printf("Free: %f\n\n", (double)(ustime()-start)/1000000);
+    }
+}
+
 /* Compressed nodes can only hold (2^29)-1 characters, so it is important
  * to test for keys bigger than this amount, in order to make sure that
  * the code to handle this edge case works as expected.
  *
  * This test is disabled by default because it uses a lot of memory. */
+void bulkBenchmark(void) {
+    size_t count = 5000000;
+    unsigned char *keybuf = malloc(count * 16);
+    unsigned char **keys = malloc(count * sizeof(unsigned char*));
+    size_t *lens = malloc(count * sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = keybuf + i * 16;
+        lens[i] = snprintf((char*)keys[i], 16, "%010zu", i * 7);
+    }
+
+    for (int slabs = 0; slabs < 2; slabs++) {
+        printf("Benchmark with %zu sorted keys %s:\n", count, slabs ? "in slabs" : "by rax_malloc()");
+        rax *t = slabs ? raxNewWithSlabs() : raxNew();
+        long long start = ustime();
+        for (size_t i = 0; i < count; i++) raxInsert(t, keys[i], lens[i], NULL, NULL);
+        printf("Insert: %f\n", (double)(ustime()-start)/1000000);
+        raxFree(t);
+
+        t = slabs ? raxNewWithSlabs() : raxNew();
+        start = ustime();
+        raxBulkLoad(t, keys, lens, NULL, count);
+        printf("Bulk load: %f\n", (double)(ustime()-start)/1000000);
+        printf("%llu total nodes\n\n", (unsigned long long)t->numnodes);
+        raxFree(t);
+    }
+
+    free(keybuf);
+    free(keys);
+    free(lens);
+}
+
 int testHugeKey(void) {
     size_t max_keylen = ((1<<29)-1) + 100;
     unsigned char *key = malloc(max_keylen);
@@ -993,6 +1764,9 @@ int main(int argc, char **argv) {
 
     /* Tests to run by default are set here. */
     int do_benchmark = 0;
+    int do_child_benchmark = 0;
+    int do_slab_benchmark = 0;
+    int do_bulk_benchmark = 0;
     int do_units = 1;
     int do_fuzz_cluster = 0;
     int do_fuzz = 1;
@@ -1009,6 +1783,14 @@ int main(int argc, char **argv) {
         for (int i = 1; i < argc; i++) {
             if (!strcmp(argv[i],"--bench")) {
                 do_benchmark = 1;
+            } else if (!strcmp(argv[i],"--bench-children")) {
+                do_child_benchmark = 1;
+            } else if (!strcmp(argv[i],"--bench-slabs")) {
+                do_slab_benchmark = 1;
+            } else if (!strcmp(argv[i],"--bench-bulk")) {
+                do_bulk_benchmark = 1;
+            } else if (!strcmp(argv[i],"--slabs")) {
+                fuzz_slabs = 1;
             } else if (!strcmp(argv[i],"--fuzz-cluster")) {
                 do_fuzz_cluster = 1;
             } else if (!strcmp(argv[i],"--fuzz")) {
@@ -1022,6 +1804,10 @@ int main(int argc, char **argv) {
             } else {
                 fprintf(stderr, "Usage: %s <options>:\n"
                                 "          [--bench         (default off)]\n"
+                                "          [--bench-children (default off)]\n"
+                                "          [--bench-slabs   (default off)]\n"
+                                "          [--bench-bulk    (default off)]\n"
+                                "          [--slabs         (fuzz slab trees)]\n"
                                 "          [--fuzz-cluster] (default off)\n"
                                 "          [--fuzz]         (default on)\n"
                                 "          [--units]        (default on)\n"
@@ -1042,6 +1828,13 @@ int main(int argc, char **argv) {
         if (randomWalkTest()) errors++;
         if (iteratorUnitTests()) errors++;
         if (tryInsertUnitTests()) errors++;
+        if (childSearchUnitTests()) errors++;
+        if (wideNodeUnitTests()) errors++;
+        if (allocatorUnitTests()) errors++;
+        if (removeSubtreeUnitTests()) errors++;
+        if (bulkLoadUnitTests()) errors++;
+        if (insertPrefixesUnitTests()) errors++;
+        if (removeWithPruneUnitTests()) errors++;
         if (errors == 0) printf("OK\n");
     }
 
@@ -1112,6 +1905,18 @@ int main(int argc, char **argv) {
         benchmark();
     }
 
+    if (do_child_benchmark) {
+        childBenchmark();
+    }
+
+    if (do_slab_benchmark) {
+        slabBenchmark();
+    }
+
+    if (do_bulk_benchmark) {
+        bulkBenchmark();
+    }
+
     if (errors) {
         printf("!!! WARNING !!!: %d errors found\n", errors);
     } else {
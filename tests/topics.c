@@ -1,5 +1,6 @@
 // topics.c
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -75,8 +76,6 @@ int topic_fun(void) {
 
     size_t numtopics = sizeof(subtopicclientv) / sizeof(subtopicclientv[0]);
 
-    char* tokenv[MAX_TOKENS];
-    size_t numtokens;
     char subtopic[MAX_TOPIC_LEN];
     char subtopicclient[MAX_TOPIC_LEN];
 
@@ -179,7 +178,7 @@ int topic_fun(void) {
     // raxStop(&tciter);
 
     raxFree(client_tree);
-    raxFree(topic_tree);
+    mr_free_topic_tree(topic_tree);
 
 // scratch area
 
@@ -253,6 +252,1293 @@ int topic_fun(void) {
     return 0;
 }
 
+// whether a match returned 0 & its client set holds exactly the clients given, in order. The set is freed
+static bool is_client_set(rax* client_set, int rc, const uint64_t* clientv, size_t numclients) {
+    bool ok = rc == 0;
+    raxIterator iter;
+    raxStart(&iter, client_set);
+    raxSeek(&iter, "^", NULL, 0);
+    uint64_t client;
+    size_t n = 0;
+
+    while (ok && mr_next_client(&iter, &client)) {
+        if (n == numclients || client != clientv[n]) ok = false;
+        n++;
+    }
+
+    raxStop(&iter);
+    raxFree(client_set);
+    return ok && n == numclients;
+}
+
+static bool matches_clients(rax* topic_tree, const char* pubtopic, const uint64_t* clientv, size_t numclients) {
+    rax* client_set = raxNew();
+    return is_client_set(client_set, mr_get_subscribed_clients(topic_tree, client_set, pubtopic), clientv, numclients);
+}
+
+static bool matches_cached_clients(
+    mr_match_cache* pcache, const char* pubtopic, const uint64_t* clientv, size_t numclients
+) {
+    rax* client_set = raxNew();
+    int rc = mr_get_subscribed_clients_cached(pcache, client_set, pubtopic);
+    return is_client_set(client_set, rc, clientv, numclients);
+}
+
+// whether a compiled publish topic matches exactly the clients given, in order
+static bool matches_compiled_clients(
+    rax* topic_tree, const char* pubtopic, const uint64_t* clientv, size_t numclients
+) {
+    mr_pubtopic* ppub = mr_compile_pubtopic(pubtopic);
+    rax* client_set = raxNew();
+    bool ok = is_client_set(client_set, mr_get_subscribed_clients_compiled(topic_tree, client_set, ppub), clientv,
+        numclients);
+    mr_pubtopic_free(ppub);
+    return ok;
+}
+
+// whether the filter passes a publish topic as expected
+static bool filters(rax* topic_tree, const char* pubtopic, bool expected) {
+    if (mr_may_have_subscribers(topic_tree, pubtopic) == expected) return true;
+    printf("Filter %s '%s'\n", expected ? "rejected" : "passed", pubtopic);
+    return false;
+}
+
+int filter_tests(void) {
+    int errors = 0;
+
+    // a first token whose concatenated key is already a deeper level of another topic: '@ab' of 'a/b'
+    const char* repro_subtopicv[][2] = {{"a/b", "ab"}, {"a/b/+", "ab/+"}};
+    const char* repro_pubtopicv[] = {"ab", "ab/c"};
+
+    for (int i = 0; i < 2; i++) {
+        rax* topic_tree = raxNew();
+        rax* client_tree = raxNew();
+        mr_insert_subscription(topic_tree, client_tree, repro_subtopicv[i][0], 1);
+        mr_insert_subscription(topic_tree, client_tree, repro_subtopicv[i][1], 2);
+        const uint64_t clientv[] = {1, 2}; // the concatenated keys can't tell the two apart
+
+        if (!mr_may_have_subscribers(topic_tree, repro_pubtopicv[i])) {
+            printf("Filter rejected '%s' after '%s' & '%s'\n",
+                repro_pubtopicv[i], repro_subtopicv[i][0], repro_subtopicv[i][1]);
+            errors++;
+        }
+
+        if (!matches_clients(topic_tree, repro_pubtopicv[i], clientv, 2)) {
+            printf("Wrong clients for '%s' after '%s' & '%s'\n",
+                repro_pubtopicv[i], repro_subtopicv[i][0], repro_subtopicv[i][1]);
+            errors++;
+        }
+
+        // once they're gone, whatever the order & with a repeat, nothing is left counted
+        mr_remove_subscription(topic_tree, client_tree, repro_subtopicv[i][i], 1 + i);
+        mr_remove_subscription(topic_tree, client_tree, repro_subtopicv[i][1 - i], 2 - i);
+        mr_remove_subscription(topic_tree, client_tree, repro_subtopicv[i][1], 2);
+
+        for (int j = 0; j < 2; j++) {
+            if (mr_may_have_subscribers(topic_tree, repro_pubtopicv[j]) || mr_may_have_subscribers(topic_tree, "a")) {
+                printf("Filter passed '%s' with no subscriptions\n", repro_pubtopicv[j]);
+                errors++;
+            }
+        }
+
+        raxFree(client_tree);
+        mr_free_topic_tree(topic_tree);
+    }
+
+    // a root wildcard passes every topic of its hierarchy, & only those
+    rax* topic_tree = raxNew();
+    rax* client_tree = raxNew();
+    mr_insert_subscription(topic_tree, client_tree, "foo/bar", 1);
+    mr_insert_subscription(topic_tree, client_tree, "$SYS/#", 1);
+    if (!filters(topic_tree, "foo/baz", true) || !filters(topic_tree, "$SYS/x", true)) errors++;
+    if (!filters(topic_tree, "bar/foo", false) || !filters(topic_tree, "$heartbeat/42", false)) errors++;
+    mr_insert_subscription(topic_tree, client_tree, "#", 2);
+    if (!filters(topic_tree, "bar/foo", true) || !filters(topic_tree, "$heartbeat/42", false)) errors++;
+    mr_remove_subscription(topic_tree, client_tree, "#", 2);
+    mr_insert_subscription(topic_tree, client_tree, "$share/g/+/x", 2);
+    if (!filters(topic_tree, "bar/x", true) || !filters(topic_tree, "$heartbeat/x", false)) errors++;
+    mr_remove_subscription(topic_tree, client_tree, "$share/g/+/x", 2);
+    if (!filters(topic_tree, "bar/x", false)) errors++;
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_tree);
+
+    // the compiled & topic ID paths filter as the string ones do: 'ab' after 'a/b' alone is rejected before any walk
+    // could find the concatenated key they share
+    topic_tree = raxNew();
+    client_tree = raxNew();
+    mr_topic_table* ptopic_table = mr_topic_table_new();
+    mr_insert_subscription(topic_tree, client_tree, "a/b", 1);
+    const char* compiled_pubtopicv[] = {"ab", "x/y", "/", "$SYS/x"};
+    const uint64_t compiled_clientv[] = {1};
+
+    for (int i = 0; i < 4; i++) {
+        uint32_t id;
+        mr_intern_topic(ptopic_table, compiled_pubtopicv[i], &id);
+        rax* client_set = raxNew();
+        int rc = mr_get_subscribed_clients_by_id(topic_tree, ptopic_table, client_set, id);
+
+        if (!matches_compiled_clients(topic_tree, compiled_pubtopicv[i], compiled_clientv, 0) ||
+            !is_client_set(client_set, rc, compiled_clientv, 0)) {
+            printf("Compiled '%s' matched with no subscriptions\n", compiled_pubtopicv[i]);
+            errors++;
+        }
+    }
+
+    if (!matches_compiled_clients(topic_tree, "a/b", compiled_clientv, 1)) errors++;
+    mr_insert_subscription(topic_tree, client_tree, "/#", 2);
+    const uint64_t empty_clientv[] = {2};
+    if (!matches_compiled_clients(topic_tree, "/", empty_clientv, 1)) errors++; // the empty level's own slot
+    mr_topic_table_free(ptopic_table);
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_tree);
+
+    // the same client subscribed twice is counted once, & a restore counts as the inserts did
+    const char* restore_subtopicv[] = {"a/b", "ab", "ab", "$SYS/+"};
+    const uint64_t restore_clientv[] = {1, 2, 2, 3};
+    topic_tree = raxNew();
+    client_tree = raxNew();
+    mr_restore_subscriptions(topic_tree, client_tree, restore_subtopicv, restore_clientv, 4);
+    mr_remove_subscription(topic_tree, client_tree, "ab", 2);
+
+    if (mr_may_have_subscribers(topic_tree, "ab") || !mr_may_have_subscribers(topic_tree, "a/b")) {
+        printf("Filter wrong for restored 'ab' once unsubscribed\n");
+        errors++;
+    }
+
+    mr_remove_client_subscriptions(topic_tree, client_tree, 3);
+
+    if (mr_may_have_subscribers(topic_tree, "$SYS/x")) {
+        printf("Filter passed '$SYS/x' with no '$SYS' subscriptions\n");
+        errors++;
+    }
+
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_tree);
+    return errors;
+}
+
+// whether two client sets hold the same clients
+static bool is_same_client_set(rax* client_set, rax* other_set) {
+    raxIterator iter;
+    raxStart(&iter, client_set);
+    raxSeek(&iter, "^", NULL, 0);
+    bool same = client_set->numele == other_set->numele;
+    while (same && raxNext(&iter)) same = raxFind(other_set, iter.key, iter.key_len) != raxNotFound;
+    raxStop(&iter);
+    return same;
+}
+
+int batch_tests(void) {
+    rax* topic_tree = raxNew();
+    rax* client_tree = raxNew();
+    int errors = 0;
+    const char* subtopicv[] = {"foo/bar", "foo/#", "+/bar", "foo/bar/", "$SYS/foo/#", "baz/+"};
+    for (int i = 0; i < 6; i++) mr_insert_subscription(topic_tree, client_tree, subtopicv[i], 1 + i);
+    mr_insert_subscription(topic_tree, client_tree, "foo/bar", 128);
+
+    // out of order, with a repeat & topics sharing levels: each set as if matched alone
+    const char* pubtopicv[] = {"foo/bar/", "baz/bam", "foo/bar", "$SYS/foo/x", "foo/bar", "x/y", "foo/baz"};
+    size_t numtopics = sizeof(pubtopicv) / sizeof(pubtopicv[0]);
+    rax* client_setv[sizeof(pubtopicv) / sizeof(pubtopicv[0])];
+    for (size_t i = 0; i < numtopics; i++) client_setv[i] = raxNew();
+    int rc = mr_get_subscribed_clients_batch(topic_tree, client_setv, pubtopicv, numtopics);
+
+    if (rc) {
+        printf("Batch match failed: %d\n", rc);
+        errors++;
+    }
+
+    for (size_t i = 0; i < numtopics; i++) {
+        rax* client_set = raxNew();
+        mr_get_subscribed_clients(topic_tree, client_set, pubtopicv[i]);
+
+        if (!is_same_client_set(client_set, client_setv[i])) {
+            printf("Batch clients for '%s' differ from a single match\n", pubtopicv[i]);
+            errors++;
+        }
+
+        raxFree(client_set);
+        raxFree(client_setv[i]);
+    }
+
+    // a topic that fails stops the batch with its error
+    const char* badtopicv[] = {"foo/bar", "foo/+/bar"};
+    for (int i = 0; i < 2; i++) client_setv[i] = raxNew();
+
+    if (mr_get_subscribed_clients_batch(topic_tree, client_setv, badtopicv, 2) != -1 || errno != EINVAL) {
+        printf("Batch with the publish topic 'foo/+/bar' didn't fail\n");
+        errors++;
+    }
+
+    for (int i = 0; i < 2; i++) raxFree(client_setv[i]);
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_tree);
+    return errors;
+}
+
+// whether a list holds exactly the clients of a set, each once
+static bool list_is_client_set(mr_client_list* plist, rax* client_set) {
+    rax* list_set = raxNew();
+    uint8_t clientv[NUMBYTES];
+
+    for (size_t i = 0; i < plist->numclients; i++) {
+        raxInsert(list_set, clientv, mr_make_BEVBVBI(plist->clients[i], clientv, NUMBYTES, NUMBITS), NULL, NULL);
+    }
+
+    bool same = list_set->numele == plist->numclients && is_same_client_set(list_set, client_set);
+    raxFree(list_set);
+    return same;
+}
+
+typedef struct client_calls {
+    rax* client_set;
+    size_t numcalls;
+} client_calls;
+
+static void add_client_call(void* ctx, uint64_t client) {
+    client_calls* pcalls = ctx;
+    uint8_t clientv[NUMBYTES];
+    raxInsert(pcalls->client_set, clientv, mr_make_BEVBVBI(client, clientv, NUMBYTES, NUMBITS), NULL, NULL);
+    pcalls->numcalls++;
+}
+
+int list_tests(void) {
+    rax* topic_tree = raxNew();
+    rax* client_tree = raxNew();
+    mr_client_list list;
+    mr_client_list_init(&list);
+    int errors = 0;
+    mr_insert_subscription(topic_tree, client_tree, "foo/bar", 2);
+    mr_insert_subscription(topic_tree, client_tree, "foo/bar", 128);
+    mr_insert_subscription(topic_tree, client_tree, "foo/bar", 1);
+    mr_insert_subscription(topic_tree, client_tree, "foo/#", 1);
+    mr_insert_subscription(topic_tree, client_tree, "foo/#", 3);
+    mr_insert_subscription(topic_tree, client_tree, "$share/g/foo/bar", 5);
+
+    // reused for each topic, a client of two subscribe topics listed once
+    const char* pubtopicv[] = {"foo/bar", "foo/baz", "x/y", "foo/bar"};
+
+    for (int i = 0; i < 4; i++) {
+        rax* client_set = raxNew();
+        mr_get_subscribed_clients(topic_tree, client_set, pubtopicv[i]);
+
+        if (mr_get_subscribed_client_list(topic_tree, &list, pubtopicv[i]) || !list_is_client_set(&list, client_set)) {
+            printf("Client list for '%s' differs from the set\n", pubtopicv[i]);
+            errors++;
+        }
+
+        // the callback gets each once, as found
+        client_calls calls = {raxNew(), 0};
+        int rc = mr_get_subscribed_clients_fn(topic_tree, &list, pubtopicv[i], add_client_call, &calls);
+
+        if (rc || !is_same_client_set(calls.client_set, client_set) || calls.numcalls != client_set->numele) {
+            printf("Client callback for '%s' differs from the set\n", pubtopicv[i]);
+            errors++;
+        }
+
+        raxFree(calls.client_set);
+        raxFree(client_set);
+    }
+
+    mr_client_list_free(&list);
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_tree);
+    return errors;
+}
+
+// the member a publish to 'foo/bar' picks from share 'g' - its only subscription - or 0 if not just one
+static uint64_t share_pick(rax* topic_tree) {
+    rax* client_set = raxNew();
+    mr_get_subscribed_clients(topic_tree, client_set, "foo/bar");
+    raxIterator iter;
+    raxStart(&iter, client_set);
+    raxSeek(&iter, "^", NULL, 0);
+    uint64_t client = 0;
+    if (client_set->numele != 1 || !mr_next_client(&iter, &client)) client = 0;
+    raxStop(&iter);
+    raxFree(client_set);
+    return client;
+}
+
+int share_tests(void) {
+    rax* topic_tree = raxNew();
+    rax* client_tree = raxNew();
+    int errors = 0;
+    for (uint64_t client = 4; client <= 6; client++) {
+        mr_insert_subscription(topic_tree, client_tree, "$share/g/foo/bar", client);
+    }
+
+    uint64_t pickv[6];
+
+    // random, the default: one member per publish
+    for (int i = 0; i < 6; i++) {
+        uint64_t pick = share_pick(topic_tree);
+
+        if (pick < 4 || pick > 6) {
+            printf("Random share pick %llu not one member\n", pick);
+            errors++;
+        }
+    }
+
+    // round robin & least recent each go through every member before one comes again
+    mr_share_strategy strategyv[] = {MR_SHARE_ROUND_ROBIN, MR_SHARE_LEAST_RECENT};
+
+    for (int s = 0; s < 2; s++) {
+        mr_set_share_strategy(topic_tree, "$share/g/foo/bar", strategyv[s]);
+        for (int i = 0; i < 6; i++) pickv[i] = share_pick(topic_tree);
+        bool ok = pickv[0] && pickv[1] && pickv[2];
+        ok = ok && pickv[0] != pickv[1] && pickv[1] != pickv[2] && pickv[0] != pickv[2];
+        ok = ok && pickv[3] == pickv[0] && pickv[4] == pickv[1] && pickv[5] == pickv[2];
+
+        if (!ok) {
+            printf("Share strategy %d picked %llu %llu %llu %llu %llu %llu\n",
+                strategyv[s], pickv[0], pickv[1], pickv[2], pickv[3], pickv[4], pickv[5]);
+            errors++;
+        }
+    }
+
+    // sticky by topic: the same member every time
+    mr_set_share_strategy(topic_tree, "$share/g/foo/bar", MR_SHARE_STICKY);
+    pickv[0] = share_pick(topic_tree);
+
+    for (int i = 1; i < 6; i++) {
+        if (share_pick(topic_tree) != pickv[0] || !pickv[0]) {
+            printf("Sticky share pick changed from %llu\n", pickv[0]);
+            errors++;
+            break;
+        }
+    }
+
+    // least recent after a member leaves: the others still alternate
+    mr_set_share_strategy(topic_tree, "$share/g/foo/bar", MR_SHARE_LEAST_RECENT);
+    mr_remove_subscription(topic_tree, client_tree, "$share/g/foo/bar", 5);
+    for (int i = 0; i < 4; i++) pickv[i] = share_pick(topic_tree);
+
+    if (pickv[0] == 5 || pickv[1] == 5 || pickv[0] == pickv[1] || pickv[2] != pickv[0] || pickv[3] != pickv[1]) {
+        printf("Least recent picks once 5 left: %llu %llu %llu %llu\n", pickv[0], pickv[1], pickv[2], pickv[3]);
+        errors++;
+    }
+
+    if (mr_set_share_strategy(topic_tree, "$share/h/foo/bar", MR_SHARE_STICKY) != -1 || errno != ENOENT) {
+        printf("Strategy set for the unknown share 'h'\n");
+        errors++;
+    }
+
+    mr_remove_client_subscriptions(topic_tree, client_tree, 4);
+    mr_remove_client_subscriptions(topic_tree, client_tree, 6);
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_tree);
+    return errors;
+}
+
+int compiled_tests(void) {
+    rax* topic_treev[] = {raxNew(), mr_topic_tree_new(MR_KEY_DELIMITED)};
+    rax* client_tree = raxNew();
+    mr_client_list list;
+    mr_client_list_init(&list);
+    int errors = 0;
+    const char* subtopicv[] = {"foo/bar", "foo/#", "+/bar/", "foo/bar/", "$SYS/#", "+"};
+
+    for (int t = 0; t < 2; t++) {
+        for (int i = 0; i < 6; i++) mr_insert_subscription(topic_treev[t], client_tree, subtopicv[i], 1 + i + 6 * t);
+    }
+
+    // normalized once & matched repeatedly, in trees of either encoding, as the topic would be
+    const char* pubtopicv[] = {"foo/bar", "foo/bar/", "$SYS/x", "foo", "x/y"};
+
+    for (int i = 0; i < 5; i++) {
+        mr_pubtopic* ppub = mr_compile_pubtopic(pubtopicv[i]);
+
+        for (int t = 0; t < 2 * 2; t++) {
+            rax* topic_tree = topic_treev[t % 2];
+            rax* client_set = raxNew();
+            rax* compiled_set = raxNew();
+            mr_get_subscribed_clients(topic_tree, client_set, pubtopicv[i]);
+            int rc = mr_get_subscribed_clients_compiled(topic_tree, compiled_set, ppub);
+            client_calls calls = {raxNew(), 0};
+            int fnrc = mr_get_subscribed_clients_fn_compiled(topic_tree, &list, ppub, add_client_call, &calls);
+
+            if (rc || fnrc || !is_same_client_set(client_set, compiled_set) ||
+                !is_same_client_set(client_set, calls.client_set)) {
+                printf("Compiled '%s' matched other clients\n", pubtopicv[i]);
+                errors++;
+            }
+
+            raxFree(client_set);
+            raxFree(compiled_set);
+            raxFree(calls.client_set);
+        }
+
+        mr_pubtopic_free(ppub);
+    }
+
+    if (mr_compile_pubtopic("foo/+") != NULL || errno != EINVAL) {
+        printf("Publish topic 'foo/+' compiled\n");
+        errors++;
+    }
+
+    mr_client_list_free(&list);
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_treev[0]);
+    mr_free_topic_tree(topic_treev[1]);
+    return errors;
+}
+
+int cache_tests(void) {
+    rax* topic_tree = raxNew();
+    rax* other_tree = raxNew();
+    rax* client_tree = raxNew();
+    rax* other_client_tree = raxNew();
+    mr_match_cache* pcache = mr_match_cache_new(topic_tree, 64);
+    int errors = 0;
+    mr_insert_subscription(topic_tree, client_tree, "foo/bar", 1);
+    mr_insert_subscription(topic_tree, client_tree, "foo/#", 2);
+    const uint64_t clientv[] = {1, 2, 4, 99};
+
+    if (!matches_cached_clients(pcache, "foo/bar", clientv, 2)) {
+        printf("Cache miss returned the wrong clients\n");
+        errors++;
+    }
+
+    // a client key slipped in without a stamp is only seen once the entry goes
+    uint8_t stray_key[] = "@foobar\xff\x63";
+    raxInsert(topic_tree, stray_key, sizeof(stray_key) - 1, NULL, NULL);
+
+    if (!matches_cached_clients(pcache, "foo/bar", clientv, 2)) {
+        printf("Cache didn't hit for 'foo/bar'\n");
+        errors++;
+    }
+
+    // each tree keeps its own clock: another tree's subscribe leaves the entry be
+    mr_insert_subscription(other_tree, other_client_tree, "foo/bar", 3);
+
+    if (!matches_cached_clients(pcache, "foo/bar", clientv, 2)) {
+        printf("Cache entry invalidated by another tree\n");
+        errors++;
+    }
+
+    // a subscribe that can match the topic invalidates the entry, & so does its unsubscribe
+    mr_insert_subscription(topic_tree, client_tree, "foo/+", 4);
+
+    if (!matches_cached_clients(pcache, "foo/bar", clientv, 4)) {
+        printf("Cache entry not invalidated by 'foo/+'\n");
+        errors++;
+    }
+
+    raxRemove(topic_tree, stray_key, sizeof(stray_key) - 1, NULL);
+    mr_remove_subscription(topic_tree, client_tree, "foo/+", 4);
+
+    if (!matches_cached_clients(pcache, "foo/bar", clientv, 2)) {
+        printf("Cache entry not invalidated by unsubscribing 'foo/+'\n");
+        errors++;
+    }
+
+    mr_match_cache_free(pcache);
+    raxFree(client_tree);
+    raxFree(other_client_tree);
+    mr_free_topic_tree(topic_tree);
+    mr_free_topic_tree(other_tree);
+    return errors;
+}
+
+// whether a publish topic's client count & exactness are as expected
+static bool counts_clients(rax* topic_tree, const char* pubtopic, size_t expected, bool expectexact) {
+    size_t count = 0;
+    bool isexact = !expectexact;
+    int rc = mr_count_subscribed_clients(topic_tree, pubtopic, &count, &isexact);
+    if (rc == 0 && count == expected && isexact == expectexact) return true;
+    printf("Count for '%s': rc %d; %zu%s, %zu%s expected\n", pubtopic, rc, count, isexact ? "" : " at most",
+        expected, expectexact ? "" : " at most");
+    return false;
+}
+
+int count_tests(void) {
+    rax* topic_tree = raxNew();
+    rax* client_tree = raxNew();
+    int errors = 0;
+    const uint64_t clientv[] = {1, 2, 128};
+    for (int i = 0; i < 3; i++) mr_insert_subscription(topic_tree, client_tree, "foo/bar", clientv[i]);
+    mr_insert_subscription(topic_tree, client_tree, "foo/#", 1);
+    mr_insert_subscription(topic_tree, client_tree, "$share/g/foo/bar", 4);
+    mr_insert_subscription(topic_tree, client_tree, "$share/g/foo/bar", 5);
+    mr_insert_subscription(topic_tree, client_tree, "$share/g/s/t", 4);
+    mr_insert_subscription(topic_tree, client_tree, "$share/g/s/t", 5);
+
+    // a single source is exact: a subscribe topic's regular clients, or a share group as 1
+    if (!counts_clients(topic_tree, "foo/baz", 1, true)) errors++;
+    if (!counts_clients(topic_tree, "s/t", 1, true)) errors++;
+    if (!counts_clients(topic_tree, "x/y", 0, true)) errors++;
+
+    // with several the sum is an upper bound: client 1 is in both 'foo/bar' & 'foo/#'
+    if (!counts_clients(topic_tree, "foo/bar", 3 + 1 + 1, false)) errors++;
+
+    // the counts follow unsubscribes, down to the last client of a topic
+    mr_remove_subscription(topic_tree, client_tree, "foo/bar", 2);
+    if (!counts_clients(topic_tree, "foo/bar", 2 + 1 + 1, false)) errors++;
+    mr_remove_subscription(topic_tree, client_tree, "foo/bar", 1);
+    mr_remove_subscription(topic_tree, client_tree, "foo/bar", 128);
+    mr_remove_subscription(topic_tree, client_tree, "$share/g/foo/bar", 4);
+    if (!counts_clients(topic_tree, "foo/bar", 1 + 1, false)) errors++;
+    mr_remove_subscription(topic_tree, client_tree, "$share/g/foo/bar", 5);
+    if (!counts_clients(topic_tree, "foo/bar", 1, true)) errors++;
+
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_tree);
+    return errors;
+}
+
+// whether a bitmap holds exactly the clients given, in order, both by cursor & extracted
+static bool is_client_bitmap(mr_client_bitmap* pbitmap, const uint64_t* clientv, size_t numclients) {
+    mr_client_bitmap_cursor cursor = {0};
+    uint64_t client;
+    size_t n = 0;
+
+    while (mr_client_bitmap_next(pbitmap, &cursor, &client)) {
+        if (n == numclients || client != clientv[n]) return false;
+        n++;
+    }
+
+    if (n != numclients || pbitmap->numclients != numclients) return false;
+    uint64_t* extractv = malloc((numclients + 1) * sizeof(uint64_t));
+    bool ok = mr_client_bitmap_extract(pbitmap, extractv) == numclients &&
+        (numclients == 0 || !memcmp(extractv, clientv, numclients * sizeof(uint64_t)));
+    free(extractv);
+    return ok;
+}
+
+int bitmap_tests(void) {
+    mr_client_bitmap bitmap;
+    mr_client_bitmap_init(&bitmap);
+    int errors = 0;
+
+    // sparse containers & a dense one, added out of order & with repeats
+    size_t numclients = 0;
+    uint64_t* clientv = malloc(6002 * sizeof(uint64_t));
+    clientv[numclients++] = 7;
+    for (uint64_t client = 1 << 16; client < (1 << 16) + 6000; client++) clientv[numclients++] = client;
+    clientv[numclients++] = (uint64_t)1 << 40;
+
+    for (size_t i = numclients; i-- > 0; ) {
+        if (mr_client_bitmap_add(&bitmap, clientv[i]) != 1) {
+            printf("Bitmap add of %llu not new\n", clientv[i]);
+            errors++;
+        }
+    }
+
+    if (mr_client_bitmap_add(&bitmap, 7) != 0 || mr_client_bitmap_add(&bitmap, (1 << 16) + 100) != 0) {
+        printf("Bitmap add of a repeat returned new\n");
+        errors++;
+    }
+
+    if (!is_client_bitmap(&bitmap, clientv, numclients)) {
+        printf("Bitmap of %zu clients read back wrong\n", numclients);
+        errors++;
+    }
+
+    free(clientv);
+
+    // a match resets it to the matching clients
+    rax* topic_tree = raxNew();
+    rax* client_tree = raxNew();
+    const uint64_t matchv[] = {1, 2, 128, 70000};
+    mr_insert_subscription(topic_tree, client_tree, "foo/bar", 128);
+    mr_insert_subscription(topic_tree, client_tree, "foo/bar", 2);
+    mr_insert_subscription(topic_tree, client_tree, "foo/#", 70000);
+    mr_insert_subscription(topic_tree, client_tree, "foo/#", 1);
+    mr_insert_subscription(topic_tree, client_tree, "+/bar", 2);
+    mr_insert_subscription(topic_tree, client_tree, "foo/baz", 3);
+
+    if (mr_get_subscribed_client_bitmap(topic_tree, &bitmap, "foo/bar") || !is_client_bitmap(&bitmap, matchv, 4)) {
+        printf("Bitmap of the clients for 'foo/bar' wrong\n");
+        errors++;
+    }
+
+    if (mr_get_subscribed_client_bitmap(topic_tree, &bitmap, "x/y") || !is_client_bitmap(&bitmap, NULL, 0)) {
+        printf("Bitmap of the clients for 'x/y' not empty\n");
+        errors++;
+    }
+
+    mr_client_bitmap_free(&bitmap);
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_tree);
+    return errors;
+}
+
+// whether a cursor yields exactly the clients given, in order
+static bool cursor_yields(rax* topic_tree, const char* pubtopic, const uint64_t* clientv, size_t numclients) {
+    mr_match_cursor* pcursor = mr_match_cursor_new(topic_tree, pubtopic);
+    if (pcursor == NULL) return false;
+    uint64_t client;
+    size_t n = 0;
+    bool ok = true;
+
+    while (ok && mr_match_cursor_next(pcursor, &client)) {
+        if (n == numclients || client != clientv[n]) ok = false;
+        n++;
+    }
+
+    mr_match_cursor_free(pcursor);
+    return ok && n == numclients;
+}
+
+int parallel_tests(void) {
+    rax* topic_tree = raxNew();
+    rax* client_tree = raxNew();
+    mr_client_bitmap bitmap, parallel_bitmap;
+    mr_client_bitmap_init(&bitmap);
+    mr_client_bitmap_init(&parallel_bitmap);
+    int errors = 0;
+
+    // wide subscribe topics over 1, 2 & 3 byte Client IDs, a narrow one & a share group
+    for (uint64_t client = 1; client < 40000; client += 3) {
+        mr_insert_subscription(topic_tree, client_tree, "foo/bar", client);
+        if (client % 2) mr_insert_subscription(topic_tree, client_tree, "foo/#", client + 1);
+    }
+
+    mr_insert_subscription(topic_tree, client_tree, "+/bar", 1);
+    mr_insert_subscription(topic_tree, client_tree, "+/bar", 50000);
+    mr_insert_subscription(topic_tree, client_tree, "$share/g/foo/bar", 60000);
+    mr_match_pool* ppoolv[] = {mr_match_pool_new(4, 2), mr_match_pool_new(1, 2), mr_match_pool_new(4, 100000)};
+    const char* pubtopicv[] = {"foo/bar", "foo/baz", "x/y"};
+
+    for (int p = 0; p < 3; p++) {
+        for (int i = 0; i < 3; i++) {
+            int rc = mr_get_subscribed_client_bitmap(topic_tree, &bitmap, pubtopicv[i]);
+            int parallel_rc = mr_get_subscribed_client_bitmap_parallel(
+                topic_tree, ppoolv[p], &parallel_bitmap, pubtopicv[i]
+            );
+            uint64_t* clientv = malloc((bitmap.numclients + 1) * sizeof(uint64_t));
+            size_t numclients = mr_client_bitmap_extract(&bitmap, clientv);
+
+            if (rc || parallel_rc || !is_client_bitmap(&parallel_bitmap, clientv, numclients)) {
+                printf("Parallel bitmap for '%s' with pool %d differs\n", pubtopicv[i], p);
+                errors++;
+            }
+
+            free(clientv);
+        }
+    }
+
+    for (int p = 0; p < 3; p++) mr_match_pool_free(ppoolv[p]);
+    mr_client_bitmap_free(&bitmap);
+    mr_client_bitmap_free(&parallel_bitmap);
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_tree);
+    return errors;
+}
+
+int cursor_tests(void) {
+    rax* topic_tree = raxNew();
+    rax* client_tree = raxNew();
+    int errors = 0;
+    mr_insert_subscription(topic_tree, client_tree, "foo/bar", 2);
+    mr_insert_subscription(topic_tree, client_tree, "foo/bar", 128);
+    mr_insert_subscription(topic_tree, client_tree, "foo/bar", 1);
+    mr_insert_subscription(topic_tree, client_tree, "foo/#", 1);
+    mr_insert_subscription(topic_tree, client_tree, "foo/#", 3);
+    mr_insert_subscription(topic_tree, client_tree, "foo/#", 300);
+    mr_insert_subscription(topic_tree, client_tree, "+/bar", 200);
+    mr_insert_subscription(topic_tree, client_tree, "$share/g/foo/bar", 5);
+
+    // merged in VBI key order, 128 as 01 00 before 2 as 02, with client 1 of two subscribe topics once
+    const uint64_t clientv[] = {1, 128, 200, 2, 300, 3, 5};
+    if (!cursor_yields(topic_tree, "foo/bar", clientv, 7)) {
+        printf("Cursor for 'foo/bar' out of VBI order\n");
+        errors++;
+    }
+
+    const uint64_t bazv[] = {1, 300, 3};
+    if (!cursor_yields(topic_tree, "foo/baz", bazv, 3)) {
+        printf("Cursor for 'foo/baz' wrong\n");
+        errors++;
+    }
+
+    if (!cursor_yields(topic_tree, "x/y", NULL, 0)) {
+        printf("Cursor for 'x/y' not empty\n");
+        errors++;
+    }
+
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_tree);
+    return errors;
+}
+
+// the bytes of all a tree's keys
+static size_t key_bytes(rax* tree) {
+    raxIterator iter;
+    raxStart(&iter, tree);
+    raxSeek(&iter, "^", NULL, 0);
+    size_t len = 0;
+    while (raxNext(&iter)) len += iter.key_len;
+    raxStop(&iter);
+    return len;
+}
+
+// whether two topic trees give a publish topic the same clients
+static bool match_alike(rax* topic_tree, rax* other_tree, const char* pubtopic) {
+    rax* client_set = raxNew();
+    rax* other_set = raxNew();
+    mr_get_subscribed_clients(topic_tree, client_set, pubtopic);
+    mr_get_subscribed_clients(other_tree, other_set, pubtopic);
+    bool alike = is_same_client_set(client_set, other_set);
+    raxFree(client_set);
+    raxFree(other_set);
+    return alike;
+}
+
+int dictionary_tests(void) {
+    const char* tokenv[] = {"temperature", "humidity", "pressure", "fleet"};
+    const char* subtopicv[] = {
+        "fleet/+/temperature", "fleet/truck1/#", "$share/g/fleet/truck2/pressure", "temperature/fleet", "+/+/humidity",
+        "fleet/truck1/humidityx",
+    };
+    const char* pubtopicv[] = {
+        "fleet/truck1/temperature", "fleet/truck2/pressure", "temperature/fleet", "x/y/humidity",
+        "fleet/truck1/humidityx", "fleet/truck1/humidity", "fleet",
+    };
+    size_t numsubs = sizeof(subtopicv) / sizeof(subtopicv[0]);
+    size_t numpubs = sizeof(pubtopicv) / sizeof(pubtopicv[0]);
+    int errors = 0;
+
+    if (mr_topic_tree_new_with_dictionary(MR_KEY_DELIMITED, (const char*[]){"a/b"}, 1) != NULL || errno != EINVAL) {
+        printf("Dictionary token 'a/b' accepted\n");
+        errors++;
+    }
+
+    for (int sep = 0; sep < 2; sep++) {
+        mr_key_encoding encoding = sep ? MR_KEY_DELIMITED : MR_KEY_CONCATENATED;
+        rax* plain_tree = mr_topic_tree_new(encoding);
+        rax* coded_tree = mr_topic_tree_new_with_dictionary(encoding, tokenv, 4);
+        rax* restored_tree = mr_topic_tree_new_with_dictionary(encoding, tokenv, 4);
+        rax* plain_client_tree = raxNew();
+        rax* coded_client_tree = raxNew();
+        rax* restored_client_tree = raxNew();
+        uint64_t clientv[sizeof(subtopicv) / sizeof(subtopicv[0])];
+
+        for (size_t i = 0; i < numsubs; i++) {
+            clientv[i] = 1 + i % 3;
+            mr_insert_subscription(plain_tree, plain_client_tree, subtopicv[i], clientv[i]);
+            mr_insert_subscription(coded_tree, coded_client_tree, subtopicv[i], clientv[i]);
+        }
+
+        mr_restore_subscriptions(restored_tree, restored_client_tree, subtopicv, clientv, numsubs);
+
+        // coded keys match as the text they stand for, inserted or restored
+        for (size_t i = 0; i < numpubs; i++) {
+            if (!match_alike(plain_tree, coded_tree, pubtopicv[i]) ||
+                !match_alike(plain_tree, restored_tree, pubtopicv[i])) {
+                printf("Coded tree clients for '%s' differ\n", pubtopicv[i]);
+                errors++;
+            }
+        }
+
+        if (key_bytes(coded_tree) >= key_bytes(plain_tree) || coded_tree->numele != restored_tree->numele) {
+            printf("Coded keys: %zu bytes, plain %zu; %llu keys, restored %llu\n",
+                key_bytes(coded_tree), key_bytes(plain_tree), coded_tree->numele, restored_tree->numele);
+            errors++;
+        }
+
+        // the client tree's coded subscribe topics decode back to the ones subscribed
+        mr_remove_subscription(coded_tree, coded_client_tree, subtopicv[0], clientv[0]);
+        for (uint64_t client = 1; client <= 3; client++) {
+            mr_remove_client_subscriptions(coded_tree, coded_client_tree, client);
+            mr_remove_client_subscriptions(restored_tree, restored_client_tree, client);
+        }
+
+        if (coded_tree->numele != 1 || coded_client_tree->numele != 0 || restored_tree->numele != 1 ||
+            restored_client_tree->numele != 0) {
+            printf("Coded trees left %llu/%llu & restored %llu/%llu keys once unsubscribed\n", coded_tree->numele,
+                coded_client_tree->numele, restored_tree->numele, restored_client_tree->numele);
+            errors++;
+        }
+
+        mr_free_topic_tree(plain_tree);
+        mr_free_topic_tree(coded_tree);
+        mr_free_topic_tree(restored_tree);
+        raxFree(plain_client_tree);
+        raxFree(coded_client_tree);
+        raxFree(restored_client_tree);
+    }
+
+    return errors;
+}
+
+int prune_tests(void) {
+    int errors = 0;
+
+    // 'a' is a level of 'a/+/+' only, though 'ab' of 'ab/+' is below it in the tree
+    const char* subtopicv[] = {"a/+/+", "ab/+", "$share/g/a/#", "a/b", "+/b"};
+    size_t numsubs = sizeof(subtopicv) / sizeof(subtopicv[0]);
+
+    for (int order = 0; order < 2; order++) {
+        for (size_t n = 2; n <= numsubs; n++) {
+            rax* topic_tree = mr_topic_tree_new(MR_KEY_DELIMITED);
+            rax* client_tree = raxNew();
+            for (size_t i = 0; i < n; i++) mr_insert_subscription(topic_tree, client_tree, subtopicv[i], 1 + i);
+
+            for (size_t i = 0; i < n; i++) {
+                size_t j = order ? n - 1 - i : i;
+                mr_remove_subscription(topic_tree, client_tree, subtopicv[j], 1 + j);
+            }
+
+            if (topic_tree->numele != 1) { // the info key
+                printf("Delimited tree of %zu topics left %llu keys once unsubscribed\n", n, topic_tree->numele);
+                errors++;
+            }
+
+            raxFree(client_tree);
+            mr_free_topic_tree(topic_tree);
+        }
+    }
+
+    return errors;
+}
+
+int topic_id_tests(void) {
+    rax* topic_tree = raxNew();
+    rax* client_tree = raxNew();
+    mr_topic_table* ptopic_table = mr_topic_table_new();
+    int errors = 0;
+    mr_insert_subscription(topic_tree, client_tree, "foo/+", 2);
+    mr_insert_subscription(topic_tree, client_tree, "foo/#", 1);
+
+    // interned once: the same topic gets the same ID, another the next
+    uint32_t id, repeat_id, other_id, found_id;
+    mr_intern_topic(ptopic_table, "foo/bar", &id);
+    mr_intern_topic(ptopic_table, "foo/bar", &repeat_id);
+    mr_intern_topic(ptopic_table, "foo//", &other_id);
+
+    if (repeat_id != id || other_id == id) {
+        printf("Interned IDs wrong: %u, %u then %u\n", id, repeat_id, other_id);
+        errors++;
+    }
+
+    if (mr_find_topic_id(ptopic_table, "foo/bar", &found_id) || found_id != id) {
+        printf("Interned 'foo/bar' not found as ID %u\n", id);
+        errors++;
+    }
+
+    if (mr_find_topic_id(ptopic_table, "foo/baz", &found_id) != -1 || errno != ENOENT) {
+        printf("Uninterned 'foo/baz' found\n");
+        errors++;
+    }
+
+    // the topic as interned, its empty tokens restored
+    char topic[MAX_TOPIC_LEN];
+    if (mr_get_interned_topic(ptopic_table, other_id, topic) || strcmp(topic, "foo//")) {
+        printf("Interned topic %u wrong: '%s'\n", other_id, topic);
+        errors++;
+    }
+
+    // matched by ID as by the topic, & an ID never handed out is an error
+    rax* client_set = raxNew();
+    int rc = mr_get_subscribed_clients_by_id(topic_tree, ptopic_table, client_set, id);
+
+    if (rc || client_set->numele != 2) {
+        printf("Clients for topic ID %u: rc %d; %llu found\n", id, rc, client_set->numele);
+        errors++;
+    }
+
+    if (mr_get_subscribed_clients_by_id(topic_tree, ptopic_table, client_set, other_id + 1) != -1 || errno != ENOENT) {
+        printf("Topic ID %u matched without being interned\n", other_id + 1);
+        errors++;
+    }
+
+    raxFree(client_set);
+
+    // aliased by ID
+    uint8_t alias;
+    uint32_t alias_id;
+    mr_upsert_client_topic_alias_id(client_tree, 1, true, id, 3);
+
+    if (mr_get_alias_by_topic_id(client_tree, 1, true, id, &alias) || alias != 3) {
+        printf("No alias 3 for topic ID %u\n", id);
+        errors++;
+    }
+
+    if (mr_get_topic_id_by_alias(client_tree, 1, true, 3, &alias_id) || alias_id != id) {
+        printf("Alias 3 isn't topic ID %u\n", id);
+        errors++;
+    }
+
+    if (mr_get_topic_id_by_alias(client_tree, 1, false, 3, &alias_id) != -1 || errno != ENOENT) {
+        printf("Outgoing alias 3 found when only incoming was set\n");
+        errors++;
+    }
+
+    mr_topic_table_free(ptopic_table);
+    mr_remove_client_data(topic_tree, client_tree, 1);
+    mr_remove_client_data(topic_tree, client_tree, 2);
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_tree);
+    return errors;
+}
+
+int wildcard_tests(void) {
+    int errors = 0;
+
+    // a '#' after a '+' also matches the level the '+' ends at, but not the one before it
+    const uint64_t hash_clientv[] = {1};
+    const uint64_t both_clientv[] = {1, 2};
+    const char* pubtopicv[] = {"x", "a", "a/b", "a/b/c"};
+    const uint64_t* expectedv[] = {hash_clientv, hash_clientv, both_clientv, both_clientv};
+    const size_t numexpectedv[] = {1, 1, 2, 2};
+
+    for (int delimited = 0; delimited < 2; delimited++) {
+        rax* topic_tree = delimited ? mr_topic_tree_new(MR_KEY_DELIMITED) : raxNew();
+        rax* client_tree = raxNew();
+        mr_insert_subscription(topic_tree, client_tree, "+/#", 1);
+        mr_insert_subscription(topic_tree, client_tree, "a/+/#", 2);
+
+        for (int i = 0; i < 4; i++) {
+            if (!matches_clients(topic_tree, pubtopicv[i], expectedv[i], numexpectedv[i]) ||
+                !matches_compiled_clients(topic_tree, pubtopicv[i], expectedv[i], numexpectedv[i])) {
+                printf("'+/#' & 'a/+/#' wrong for '%s', %s\n", pubtopicv[i], delimited ? "delimited" : "concatenated");
+                errors++;
+            }
+        }
+
+        raxFree(client_tree);
+        mr_free_topic_tree(topic_tree);
+    }
+
+    return errors;
+}
+
+int level_flag_tests(void) {
+    int errors = 0;
+    const uint64_t hash_clientv[] = {1};
+    const uint64_t plus_clientv[] = {2};
+
+    for (int delimited = 0; delimited < 2; delimited++) {
+        rax* topic_tree = delimited ? mr_topic_tree_new(MR_KEY_DELIMITED) : raxNew();
+        rax* client_tree = raxNew();
+        mr_insert_subscription(topic_tree, client_tree, "a/#", 1);
+        mr_insert_subscription(topic_tree, client_tree, "a/+", 2);
+
+        // clearing the '#' flag of 'a' leaves its '+' flag set
+        mr_remove_subscription(topic_tree, client_tree, "a/#", 1);
+        int wrong = !matches_clients(topic_tree, "a/b", plus_clientv, 1);
+        wrong += !matches_clients(topic_tree, "a", plus_clientv, 0);
+
+        // & is set again by the next '#' subscription
+        mr_remove_subscription(topic_tree, client_tree, "a/+", 2);
+        mr_insert_subscription(topic_tree, client_tree, "a/#", 1);
+        wrong += !matches_clients(topic_tree, "a/b", hash_clientv, 1);
+        wrong += !matches_clients(topic_tree, "a", hash_clientv, 1);
+
+        if (wrong) printf("Wildcard level flags wrong %d times, %s\n", wrong, delimited ? "delimited" : "concatenated");
+        errors += wrong;
+        mr_remove_subscription(topic_tree, client_tree, "a/#", 1);
+        raxFree(client_tree);
+        mr_free_topic_tree(topic_tree);
+    }
+
+    return errors;
+}
+
+int encoding_tests(void) {
+    rax* concatenated_tree = raxNew();
+    rax* delimited_tree = mr_topic_tree_new(MR_KEY_DELIMITED);
+    rax* concatenated_client_tree = raxNew();
+    rax* delimited_client_tree = raxNew();
+    int errors = 0;
+    mr_insert_subscription(concatenated_tree, concatenated_client_tree, "a/foo/bar", 1);
+    mr_insert_subscription(delimited_tree, delimited_client_tree, "a/foo/bar", 1);
+
+    // the concatenated encoding can't tell 'a/foo/bar' from 'a/foobar'; the delimited one can
+    if (!counts_clients(concatenated_tree, "a/foobar", 1, true)) errors++;
+    if (!counts_clients(delimited_tree, "a/foobar", 0, true)) errors++;
+    const uint64_t clientv[] = {1};
+    if (!matches_clients(delimited_tree, "a/foobar", clientv, 0)) errors++;
+
+    // both still match the topic itself
+    if (!matches_clients(concatenated_tree, "a/foo/bar", clientv, 1)) errors++;
+    if (!matches_clients(delimited_tree, "a/foo/bar", clientv, 1)) errors++;
+
+    raxFree(concatenated_client_tree);
+    raxFree(delimited_client_tree);
+    mr_free_topic_tree(concatenated_tree);
+    mr_free_topic_tree(delimited_tree);
+    return errors;
+}
+
+int deep_topic_tests(void) {
+    int errors = 0;
+
+    // no depth limit: 100 levels spill past the stack buffers into scratch
+    char deep_topic[2 * 100];
+    char deep_wildcard[2 * 100];
+    for (int i = 0; i < 100; i++) memcpy(deep_topic + 2 * i, "d/", 2);
+    deep_topic[2 * 100 - 1] = '\0';
+    memcpy(deep_wildcard, deep_topic, sizeof(deep_wildcard));
+    deep_wildcard[2 * 99] = '#';
+    const uint64_t clientv[] = {10, 11};
+
+    for (int delimited = 0; delimited < 2; delimited++) {
+        rax* topic_tree = delimited ? mr_topic_tree_new(MR_KEY_DELIMITED) : raxNew();
+        rax* client_tree = raxNew();
+        mr_insert_subscription(topic_tree, client_tree, deep_topic, 10);
+        mr_insert_subscription(topic_tree, client_tree, deep_wildcard, 11);
+
+        if (!counts_clients(topic_tree, deep_topic, 2, false)) errors++;
+        if (!matches_clients(topic_tree, deep_topic, clientv, 2)) errors++;
+
+        mr_remove_client_subscriptions(topic_tree, client_tree, 10);
+        mr_remove_client_subscriptions(topic_tree, client_tree, 11);
+
+        if (topic_tree->numele != 1 || client_tree->numele != 0) { // the info key
+            printf("A %d level topic left %llu topic keys & %llu client keys once unsubscribed\n", 100,
+                topic_tree->numele, client_tree->numele);
+            errors++;
+        }
+
+        raxFree(client_tree);
+        mr_free_topic_tree(topic_tree);
+    }
+
+    return errors;
+}
+
+int restore_tests(void) {
+    const char* subtopicv[] = {
+        "sport/tennis/+", "sport/#", "$share/g/sport/tennis", "sport/tennis/+", "$SYS/x", "sport/#",
+    };
+    const uint64_t clientv[] = {1, 2, 3, 4, 5, 2};
+    const char* pubtopicv[] = {"sport/tennis/player1", "sport/tennis", "sport", "$SYS/x", "sport/golf/x"};
+    size_t numsubs = sizeof(subtopicv) / sizeof(subtopicv[0]);
+    size_t numpubs = sizeof(pubtopicv) / sizeof(pubtopicv[0]);
+    int errors = 0;
+
+    for (int delimited = 0; delimited < 2; delimited++) {
+        // a restart: the same subscriptions restored in one sorted load rather than inserted one at a time
+        rax* inserted_tree = delimited ? mr_topic_tree_new(MR_KEY_DELIMITED) : raxNew();
+        rax* restored_tree = delimited ? mr_topic_tree_new(MR_KEY_DELIMITED) : raxNew();
+        rax* inserted_client_tree = raxNew();
+        rax* restored_client_tree = raxNew();
+        for (size_t i = 0; i < numsubs; i++) {
+            mr_insert_subscription(inserted_tree, inserted_client_tree, subtopicv[i], clientv[i]);
+        }
+
+        // an invalid topic restores nothing, & leaves the trees as they were
+        const char* badsubtopicv[] = {"sport/#", "sport/tennis#"};
+        uint64_t emptysize = restored_tree->numele;
+        int rc = mr_restore_subscriptions(restored_tree, restored_client_tree, badsubtopicv, clientv, 2);
+        if (rc != -1 || errno != EINVAL || restored_tree->numele != emptysize || restored_client_tree->numele != 0) {
+            printf("Restore of an invalid topic: rc %d; %llu topic keys\n", rc, restored_tree->numele);
+            errors++;
+        }
+
+        rc = mr_restore_subscriptions(restored_tree, restored_client_tree, subtopicv, clientv, numsubs);
+        if (rc != 0 || restored_tree->numele != inserted_tree->numele ||
+            restored_client_tree->numele != inserted_client_tree->numele) {
+            printf("Restore: rc %d; %llu topic & %llu client keys, inserted %llu & %llu\n", rc, restored_tree->numele,
+                restored_client_tree->numele, inserted_tree->numele, inserted_client_tree->numele);
+            errors++;
+        }
+
+        for (size_t i = 0; i < numpubs; i++) {
+            size_t inserted_count = 0, restored_count = 0;
+            bool inserted_isexact, restored_isexact;
+            mr_count_subscribed_clients(inserted_tree, pubtopicv[i], &inserted_count, &inserted_isexact);
+            mr_count_subscribed_clients(restored_tree, pubtopicv[i], &restored_count, &restored_isexact);
+            if (!match_alike(inserted_tree, restored_tree, pubtopicv[i]) || restored_count != inserted_count ||
+                restored_isexact != inserted_isexact) {
+                printf("Restored tree differs from the inserted one for '%s'\n", pubtopicv[i]);
+                errors++;
+            }
+        }
+
+        if (!counts_clients(restored_tree, "sport/tennis/player1", 3, false)) errors++;
+
+        // a tree holding subscriptions can't be restored into
+        rc = mr_restore_subscriptions(restored_tree, restored_client_tree, subtopicv, clientv, numsubs);
+        if (rc != -1 || errno != EINVAL || restored_tree->numele != inserted_tree->numele) {
+            printf("Restore into a tree holding subscriptions: rc %d\n", rc);
+            errors++;
+        }
+
+        // restored subscriptions unsubscribe as inserted ones do
+        for (uint64_t client = 1; client <= 5; client++) {
+            mr_remove_client_subscriptions(restored_tree, restored_client_tree, client);
+        }
+
+        if (restored_tree->numele != 1 || restored_client_tree->numele != 0) { // the info key
+            printf("Restored tree left %llu keys once unsubscribed\n", restored_tree->numele);
+            errors++;
+        }
+
+        raxFree(inserted_client_tree);
+        raxFree(restored_client_tree);
+        mr_free_topic_tree(inserted_tree);
+        mr_free_topic_tree(restored_tree);
+    }
+
+    return errors;
+}
+
+// a special byte at each offset the scans step over, for every topic length putting it in the SSE2 vector, the 64 bit
+// word or the byte by byte loop: the normalized topic, its key & its tokens are as a byte by byte scan would have them
+int scan_tests(void) {
+    int errors = 0;
+    const size_t offsetv[] = {7, 8, 15, 16, 31};
+    const char* specialv[] = {"/", "\x01", "\xc3\xa9", "\xf0\x9f\x98\x80"};
+    const char neighbourv[] = {'.', ' ', 'a', 'a'}; // '/' ^ 1 & 0x20 before them: what a stray borrow would flag
+    const char* badspecialv[] = {"+", "#", "\xc3(", "\x1f"};
+    char topic_in[48];
+    char prefix[48];
+    char topic[MR_NORMALIZED_TOPIC_LEN(sizeof(topic_in))];
+    char topic_key[MR_NORMALIZED_TOPIC_LEN(sizeof(topic_in))];
+    char expected[MR_NORMALIZED_TOPIC_LEN(sizeof(topic_in))];
+    char expected_key[MR_NORMALIZED_TOPIC_LEN(sizeof(topic_in))];
+
+    for (size_t i = 0; i < sizeof(offsetv) / sizeof(offsetv[0]); i++) {
+        size_t offset = offsetv[i];
+
+        for (size_t j = 0; j < 4; j++) {
+            size_t slen = strlen(specialv[j]);
+            bool issep = specialv[j][0] == '/';
+            const uint64_t clientv[] = {issep ? 1 : 2, 3}; // 'a...a/+' or '+', & the topic itself
+
+            for (size_t tlen = offset + slen; tlen <= 40; tlen++) {
+                memset(topic_in, 'a', tlen);
+                topic_in[offset - 1] = neighbourv[j];
+                memcpy(topic_in + offset, specialv[j], slen);
+                topic_in[tlen] = '\0';
+                bool isempty = issep && tlen == offset + 1; // a trailing empty level
+                snprintf(expected, sizeof(expected), "@/%s%s", topic_in, isempty ? empty_tokenv : "");
+                snprintf(expected_key, sizeof(expected_key), "@%.*s%s%s", (int)offset, topic_in,
+                    topic_in + offset + issep, isempty ? empty_tokenv : "");
+                int rc = mr_validate_and_normalize_topic(topic_in, tlen, false, topic, NULL, topic_key);
+
+                if (rc || strcmp(topic, expected) || strcmp(topic_key, expected_key)) {
+                    printf("Special %zu at %zu of %zu bytes: rc %d, normalized '%s', key '%s'\n",
+                        j, offset, tlen, rc, topic, topic_key);
+                    errors++;
+                    continue;
+                }
+
+                for (int delimited = 0; delimited < 2; delimited++) {
+                    rax* topic_tree = delimited ? mr_topic_tree_new(MR_KEY_DELIMITED) : raxNew();
+                    rax* client_tree = raxNew();
+                    snprintf(prefix, sizeof(prefix), "%.*s/+", (int)offset, topic_in);
+                    mr_insert_subscription(topic_tree, client_tree, prefix, 1);
+                    mr_insert_subscription(topic_tree, client_tree, "+", 2);
+                    mr_insert_subscription(topic_tree, client_tree, topic_in, 3);
+
+                    if (!matches_clients(topic_tree, topic_in, clientv, 2) ||
+                        !matches_compiled_clients(topic_tree, topic_in, clientv, 2)) {
+                        printf("Special %zu at %zu of %zu bytes: wrong tokens, %s\n",
+                            j, offset, tlen, delimited ? "delimited" : "concatenated");
+                        errors++;
+                    }
+
+                    raxFree(client_tree);
+                    mr_free_topic_tree(topic_tree);
+                }
+            }
+        }
+
+        // a wildcard or a malformed char within a level is found wherever it is
+        for (size_t j = 0; j < 4; j++) {
+            size_t slen = strlen(badspecialv[j]);
+
+            for (size_t tlen = offset + slen; tlen <= 40; tlen++) {
+                memset(topic_in, 'a', tlen);
+                memcpy(topic_in + offset, badspecialv[j], slen);
+                topic_in[tlen] = '\0';
+
+                for (int issubscribe = 0; issubscribe < 2; issubscribe++) {
+                    int rc = mr_validate_and_normalize_topic(topic_in, tlen, issubscribe, topic, NULL, NULL);
+
+                    if (rc != -1 || errno != EINVAL) {
+                        printf("Bad special %zu at %zu of %zu bytes accepted, %s\n",
+                            j, offset, tlen, issubscribe ? "subscribe" : "publish");
+                        errors++;
+                    }
+                }
+            }
+        }
+
+        // & alone in its level, a subscribe topic's wildcard is kept
+        for (int j = 0; j < 2; j++) {
+            memset(topic_in, 'a', offset);
+            topic_in[offset - 1] = '/';
+            topic_in[offset] = badspecialv[j][0];
+            topic_in[offset + 1] = '\0';
+            snprintf(expected, sizeof(expected), "@/%s", topic_in);
+            int rc = mr_validate_and_normalize_topic(topic_in, offset + 1, true, topic, NULL, NULL);
+
+            if (rc || strcmp(topic, expected)) {
+                printf("Subscribe topic '%s': rc %d, normalized '%s'\n", topic_in, rc, topic);
+                errors++;
+            }
+        }
+    }
+
+    return errors;
+}
+
+int invalid_topic_tests(void) {
+    rax* topic_tree = raxNew();
+    rax* client_tree = raxNew();
+    int errors = 0;
+
+    // wildcards must fill a whole level, & a publish topic has none
+    const char* badsubtopicv[] = {"", "sport/tennis#", "sport/#/player1", "sport+", "$share/g", "$share//x"};
+    for (size_t i = 0; i < sizeof(badsubtopicv) / sizeof(badsubtopicv[0]); i++) {
+        int rc = mr_insert_subscription(topic_tree, client_tree, badsubtopicv[i], 1);
+        if (rc != -1 || errno != EINVAL) {
+            printf("Subscribe '%s': rc %d; EINVAL expected\n", badsubtopicv[i], rc);
+            errors++;
+        }
+    }
+
+    const char* badpubtopicv[] = {"", "sport/+/player1", "sport/#"};
+    for (size_t i = 0; i < sizeof(badpubtopicv) / sizeof(badpubtopicv[0]); i++) {
+        rax* client_set = raxNew();
+        int rc = mr_get_subscribed_clients(topic_tree, client_set, badpubtopicv[i]);
+        if (rc != -1 || errno != EINVAL) {
+            printf("Publish '%s': rc %d; EINVAL expected\n", badpubtopicv[i], rc);
+            errors++;
+        }
+        raxFree(client_set);
+    }
+
+    // nothing was inserted for the rejected topics
+    if (topic_tree->numele != 0 || client_tree->numele != 0) {
+        printf("Invalid topics left %llu topic keys & %llu client keys\n", topic_tree->numele, client_tree->numele);
+        errors++;
+    }
+
+    raxFree(client_tree);
+    mr_free_topic_tree(topic_tree);
+    return errors;
+}
+
 int main(int argc, char** argv) {
-    return topic_fun();
+    int errors = topic_fun();
+    if (batch_tests()) errors++;
+    if (list_tests()) errors++;
+    if (share_tests()) errors++;
+    if (compiled_tests()) errors++;
+    if (cache_tests()) errors++;
+    if (count_tests()) errors++;
+    if (bitmap_tests()) errors++;
+    if (parallel_tests()) errors++;
+    if (cursor_tests()) errors++;
+    if (dictionary_tests()) errors++;
+    if (filter_tests()) errors++;
+    if (prune_tests()) errors++;
+    if (topic_id_tests()) errors++;
+    if (wildcard_tests()) errors++;
+    if (level_flag_tests()) errors++;
+    if (encoding_tests()) errors++;
+    if (deep_topic_tests()) errors++;
+    if (scan_tests()) errors++;
+    if (invalid_topic_tests()) errors++;
+    if (restore_tests()) errors++;
+    if (errors) printf("!!! WARNING !!!: %d errors found\n", errors);
+    else printf("OK! \\o/\n");
+    return errors;
 }